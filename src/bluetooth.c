@@ -0,0 +1,228 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "bluetooth.h"
+#include "bluez.h"
+#include "cli.h"
+#include "event_loop.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLUETOOTH_STATUS_DIR "/tmp"
+#define BLUETOOTH_STATUS_FILE "bluetooth-status"
+
+// mod-bluetooth can be slow, do not let it run forever
+#define BLUETOOTH_TIMEOUT_MS 2000
+
+// while the status keeps being asked for, refresh periodically too, for changes that do not touch the status file
+#define BLUETOOTH_REFRESH_INTERVAL_MS 10000
+
+static struct {
+    bool debug;
+    bool valid;
+    // status is pushed by BlueZ instead of polling mod-bluetooth
+    bool bluez;
+    // a refresh is running, and if another one was requested meanwhile
+    bool running, pending;
+    // status was asked for since the last periodic refresh
+    bool requested;
+    int timer;
+    int watch;
+    char status[0xff];
+} bt = {
+    .timer = -1,
+    .watch = -1,
+};
+
+static void bluetooth_refresh_callback(const bool success, const char* const output, void* const arg)
+{
+    bt.running = false;
+
+    if (success && output != NULL)
+    {
+        snprintf(bt.status, sizeof(bt.status), "%s", output);
+        bt.valid = true;
+
+        if (bt.debug)
+            printf("%s: bluetooth status is now '%s'\n", __func__, bt.status);
+    }
+
+    if (bt.pending)
+    {
+        bt.pending = false;
+        bluetooth_refresh();
+    }
+
+    return;
+
+    // unused
+    (void)arg;
+}
+
+static void bluetooth_timer_callback(const int timerfd, const uint32_t events, void* const arg)
+{
+    // nobody asked for the status lately, only the status file watch is left until someone does
+    if (! bt.requested)
+        return;
+
+    bt.requested = false;
+    bluetooth_refresh();
+
+    return;
+
+    // unused
+    (void)timerfd;
+    (void)events;
+    (void)arg;
+}
+
+static void bluetooth_file_callback(const int id, const uint32_t events, void* const arg)
+{
+    if (bt.debug)
+        printf("%s: %s/%s changed\n", __func__, BLUETOOTH_STATUS_DIR, BLUETOOTH_STATUS_FILE);
+
+    bluetooth_refresh();
+
+    return;
+
+    // unused
+    (void)id;
+    (void)events;
+    (void)arg;
+}
+
+static void bluetooth_setup_mod_bluetooth(void)
+{
+    bt.timer = event_timer_create(bluetooth_timer_callback, NULL);
+    bt.watch = event_file_watch_add(BLUETOOTH_STATUS_DIR, BLUETOOTH_STATUS_FILE, bluetooth_file_callback, NULL);
+
+    // first refresh happens once the event loop runs, so startup is not delayed by it
+    if (bt.timer >= 0)
+        event_timer_start(bt.timer, 1);
+}
+
+#ifdef HAVE_SYSTEMD
+static void bluetooth_status_changed(const char* const status)
+{
+    if (status == NULL)
+    {
+        fprintf(stderr, "%s: BlueZ did not reply, using mod-bluetooth instead\n", __func__);
+        bluez_destroy();
+        bt.bluez = false;
+        bluetooth_setup_mod_bluetooth();
+        return;
+    }
+
+    snprintf(bt.status, sizeof(bt.status), "%s", status);
+    bt.valid = true;
+
+    if (bt.debug)
+        printf("%s: bluetooth status is now '%s'\n", __func__, bt.status);
+}
+#endif
+
+void bluetooth_setup(const bool debug)
+{
+    bt.debug = debug;
+    bt.valid = bt.running = bt.pending = bt.bluez = false;
+    bt.requested = true;
+
+#ifdef HAVE_SYSTEMD
+    const char* const backend = getenv("MOD_BLUETOOTH_BACKEND");
+
+    if (backend != NULL && strcmp(backend, "bluez") == 0)
+    {
+        if (bluez_setup(bluetooth_status_changed, debug))
+        {
+            bt.bluez = true;
+            return;
+        }
+
+        fprintf(stderr, "%s: cannot talk to BlueZ, using mod-bluetooth instead\n", __func__);
+    }
+#endif
+
+    bluetooth_setup_mod_bluetooth();
+}
+
+void bluetooth_destroy(void)
+{
+#ifdef HAVE_SYSTEMD
+    if (bt.bluez)
+    {
+        bluez_destroy();
+        bt.bluez = false;
+    }
+#endif
+
+    event_file_watch_remove(bt.watch);
+    bt.watch = -1;
+
+    if (bt.timer >= 0)
+    {
+        event_timer_destroy(bt.timer);
+        bt.timer = -1;
+    }
+
+    bt.valid = false;
+}
+
+bool bluetooth_get_status(char buf[0xff])
+{
+    if (! bt.bluez && bt.timer >= 0)
+    {
+        // periodic refresh stopped while nobody asked, what we have might be outdated by now
+        if (! bt.running && ! event_timer_is_active(bt.timer))
+            bluetooth_refresh();
+        else
+            bt.requested = true;
+    }
+
+    if (! bt.valid)
+        return false;
+
+    memcpy(buf, bt.status, sizeof(bt.status));
+    return true;
+}
+
+bool bluetooth_discovery(const unsigned int timeout_ms, const execute_callback callback, void* const arg)
+{
+#ifdef HAVE_SYSTEMD
+    if (bt.bluez)
+        return bluez_discovery(timeout_ms, callback, arg);
+#endif
+
+    return false;
+
+    // unused
+    (void)timeout_ms;
+    (void)callback;
+    (void)arg;
+}
+
+void bluetooth_refresh(void)
+{
+    // BlueZ tells us about changes by itself
+    if (bt.bluez || bt.timer < 0)
+        return;
+
+    if (bt.running)
+    {
+        bt.pending = true;
+        return;
+    }
+
+    const char* argv[] = { "mod-bluetooth", "hmi", NULL };
+
+    // the periodic refresh starts counting again from now
+    event_timer_start(bt.timer, BLUETOOTH_REFRESH_INTERVAL_MS);
+
+    bt.running = true;
+
+    if (! execute_async(argv, true, BLUETOOTH_TIMEOUT_MS, bluetooth_refresh_callback, NULL, bt.debug))
+        bt.running = false;
+}
@@ -0,0 +1,27 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#include "cli.h"
+
+// keeps the last known bluetooth status in memory, as "status|name|address"
+// refreshed from the event loop when /tmp/bluetooth-status changes,
+// and periodically in case we miss something, but only while the status keeps being asked for
+// with MOD_BLUETOOTH_BACKEND=bluez (and systemd support) it is kept up to date by BlueZ instead, see bluez.h
+// going back to mod-bluetooth for good if BlueZ does not reply to the first request
+// NOTE needs the event loop, without setup there is never a status available
+void bluetooth_setup(bool debug);
+void bluetooth_destroy(void);
+
+// get last known status, returns false if there is none yet
+// the first call after a while without any also triggers a refresh
+bool bluetooth_get_status(char buf[0xff]);
+
+// fetch status again as soon as possible
+void bluetooth_refresh(void);
+
+// enable discovery through BlueZ, callback is called once done
+// returns false if not using BlueZ, mod-bluetooth needs to be used instead
+bool bluetooth_discovery(unsigned int timeout_ms, execute_callback callback, void* arg);
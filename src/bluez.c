@@ -0,0 +1,465 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "bluez.h"
+#include "bus.h"
+
+#ifdef HAVE_SYSTEMD
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLUEZ_SERVICE "org.bluez"
+#define BLUEZ_ADAPTER_INTERFACE "org.bluez.Adapter1"
+#define BLUEZ_DEVICE_INTERFACE "org.bluez.Device1"
+#define DBUS_OBJECT_MANAGER_INTERFACE "org.freedesktop.DBus.ObjectManager"
+#define DBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+#define BLUEZ_MAX_DEVICES 16
+#define BLUEZ_PATH_MAX 64
+#define BLUEZ_NAME_MAX 64
+#define BLUEZ_ADDRESS_MAX 18
+
+typedef struct bluez_device {
+    bool used;
+    bool connected;
+    char path[BLUEZ_PATH_MAX];
+    char alias[BLUEZ_NAME_MAX];
+} bluez_device;
+
+// only the first adapter is used, MOD units have a single one
+static struct {
+    bool present;
+    bool powered;
+    bool discoverable;
+    char path[BLUEZ_PATH_MAX];
+    char address[BLUEZ_ADDRESS_MAX];
+} s_adapter;
+
+typedef struct bluez_request {
+    execute_callback callback;
+    void* arg;
+} bluez_request;
+
+static bluez_device s_devices[BLUEZ_MAX_DEVICES];
+static bluez_status_callback s_callback;
+static bool s_debug;
+
+// BlueZ replied at least once, failures after that just mean it went away
+static bool s_replied;
+
+// signal matches, kept so they can be removed without closing the bus connection
+#define BLUEZ_MATCH_COUNT 4
+static sd_bus_slot* s_matches[BLUEZ_MATCH_COUNT];
+
+static void bluez_reset(void)
+{
+    memset(&s_adapter, 0, sizeof(s_adapter));
+    memset(s_devices, 0, sizeof(s_devices));
+}
+
+static void bluez_notify(void)
+{
+    const char* status;
+    const char* name = "";
+    char buf[0xff];
+
+    for (int i = 0; i < BLUEZ_MAX_DEVICES; ++i)
+    {
+        if (s_devices[i].used && s_devices[i].connected)
+        {
+            name = s_devices[i].alias;
+            break;
+        }
+    }
+
+    if (! s_adapter.present)
+        status = "Unavailable";
+    else if (! s_adapter.powered)
+        status = "Off";
+    else if (*name != '\0')
+        status = "Connected";
+    else if (s_adapter.discoverable)
+        status = "Discoverable";
+    else
+        status = "On";
+
+    snprintf(buf, sizeof(buf), "%s|%s|%s",
+             status, name, s_adapter.present && s_adapter.address[0] != '\0' ? s_adapter.address : "(none)");
+
+    s_callback(buf);
+}
+
+static bluez_device* bluez_find_device(const char* const path, const bool create)
+{
+    bluez_device* unused = NULL;
+
+    for (int i = 0; i < BLUEZ_MAX_DEVICES; ++i)
+    {
+        if (s_devices[i].used && strcmp(s_devices[i].path, path) == 0)
+            return &s_devices[i];
+        if (! s_devices[i].used && unused == NULL)
+            unused = &s_devices[i];
+    }
+
+    if (! create || unused == NULL)
+        return NULL;
+
+    unused->used = true;
+    unused->connected = false;
+    unused->alias[0] = '\0';
+    snprintf(unused->path, sizeof(unused->path), "%s", path);
+    return unused;
+}
+
+static int bluez_read_string(sd_bus_message* const m, char* const buf, const size_t size)
+{
+    const char* str;
+    const int r = sd_bus_message_read(m, "v", "s", &str);
+
+    if (r >= 0)
+        snprintf(buf, size, "%s", str);
+
+    return r;
+}
+
+static int bluez_read_bool(sd_bus_message* const m, bool* const value)
+{
+    int b;
+    const int r = sd_bus_message_read(m, "v", "b", &b);
+
+    if (r >= 0)
+        *value = b != 0;
+
+    return r;
+}
+
+// read a{sv} properties of an object, only the ones we care about are kept
+static int bluez_read_properties(sd_bus_message* const m, const char* const path, const char* const interface)
+{
+    bluez_device* device = NULL;
+    const char* property;
+    int r;
+
+    if (strcmp(interface, BLUEZ_ADAPTER_INTERFACE) == 0)
+    {
+        if (! s_adapter.present)
+        {
+            s_adapter.present = true;
+            snprintf(s_adapter.path, sizeof(s_adapter.path), "%s", path);
+        }
+        else if (strcmp(s_adapter.path, path) != 0)
+        {
+            return sd_bus_message_skip(m, "a{sv}");
+        }
+    }
+    else if (strcmp(interface, BLUEZ_DEVICE_INTERFACE) == 0)
+    {
+        if ((device = bluez_find_device(path, true)) == NULL)
+            return sd_bus_message_skip(m, "a{sv}");
+    }
+    else
+    {
+        return sd_bus_message_skip(m, "a{sv}");
+    }
+
+    if ((r = sd_bus_message_enter_container(m, 'a', "{sv}")) < 0)
+        return r;
+
+    while ((r = sd_bus_message_enter_container(m, 'e', "sv")) > 0)
+    {
+        if ((r = sd_bus_message_read(m, "s", &property)) < 0)
+            return r;
+
+        if (device == NULL && strcmp(property, "Address") == 0)
+            r = bluez_read_string(m, s_adapter.address, sizeof(s_adapter.address));
+        else if (device == NULL && strcmp(property, "Powered") == 0)
+            r = bluez_read_bool(m, &s_adapter.powered);
+        else if (device == NULL && strcmp(property, "Discoverable") == 0)
+            r = bluez_read_bool(m, &s_adapter.discoverable);
+        else if (device != NULL && strcmp(property, "Alias") == 0)
+            r = bluez_read_string(m, device->alias, sizeof(device->alias));
+        else if (device != NULL && strcmp(property, "Connected") == 0)
+            r = bluez_read_bool(m, &device->connected);
+        else
+            r = sd_bus_message_skip(m, "v");
+
+        if (r < 0 || (r = sd_bus_message_exit_container(m)) < 0)
+            return r;
+    }
+
+    if (r < 0)
+        return r;
+
+    return sd_bus_message_exit_container(m);
+}
+
+// read a{sa{sv}} interfaces of an object
+static int bluez_read_interfaces(sd_bus_message* const m, const char* const path)
+{
+    const char* interface;
+    int r;
+
+    if ((r = sd_bus_message_enter_container(m, 'a', "{sa{sv}}")) < 0)
+        return r;
+
+    while ((r = sd_bus_message_enter_container(m, 'e', "sa{sv}")) > 0)
+    {
+        if ((r = sd_bus_message_read(m, "s", &interface)) < 0 ||
+            (r = bluez_read_properties(m, path, interface)) < 0 ||
+            (r = sd_bus_message_exit_container(m)) < 0)
+            return r;
+    }
+
+    if (r < 0)
+        return r;
+
+    return sd_bus_message_exit_container(m);
+}
+
+static int bluez_managed_objects_reply(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* path;
+    int r;
+
+    if (sd_bus_message_get_error(m) != NULL)
+    {
+        if (s_debug)
+            printf("%s: BlueZ is not available: %s\n", __func__, sd_bus_message_get_error(m)->message);
+
+        // never got anything from BlueZ since setup, let the caller fall back to something else
+        if (! s_replied)
+        {
+            s_callback(NULL);
+            return 0;
+        }
+
+        goto out;
+    }
+
+    s_replied = true;
+
+    if ((r = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}")) < 0)
+        goto error;
+
+    while ((r = sd_bus_message_enter_container(m, 'e', "oa{sa{sv}}")) > 0)
+    {
+        if ((r = sd_bus_message_read(m, "o", &path)) < 0 ||
+            (r = bluez_read_interfaces(m, path)) < 0 ||
+            (r = sd_bus_message_exit_container(m)) < 0)
+            goto error;
+    }
+
+    if (r < 0)
+        goto error;
+
+    goto out;
+
+error:
+    fprintf(stderr, "%s failed, cannot parse BlueZ objects: %s\n", __func__, strerror(-r));
+
+out:
+    bluez_notify();
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static void bluez_fetch(void)
+{
+    sd_bus* const bus = bus_get();
+
+    bluez_reset();
+
+    if (bus == NULL)
+        return;
+
+    if (sd_bus_call_method_async(bus, NULL, BLUEZ_SERVICE, "/", DBUS_OBJECT_MANAGER_INTERFACE,
+                                 "GetManagedObjects", bluez_managed_objects_reply, NULL, "") < 0)
+        fprintf(stderr, "%s failed, cannot request BlueZ objects\n", __func__);
+
+    bus_update();
+}
+
+static int bluez_properties_changed(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* const path = sd_bus_message_get_path(m);
+    const char* interface;
+
+    if (path == NULL || sd_bus_message_read(m, "s", &interface) < 0)
+        return 0;
+
+    if (bluez_read_properties(m, path, interface) < 0)
+        fprintf(stderr, "%s failed, cannot parse changes of '%s'\n", __func__, path);
+
+    bluez_notify();
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int bluez_interfaces_added(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* path;
+
+    if (sd_bus_message_read(m, "o", &path) < 0)
+        return 0;
+
+    if (bluez_read_interfaces(m, path) < 0)
+        fprintf(stderr, "%s failed, cannot parse interfaces of '%s'\n", __func__, path);
+
+    bluez_notify();
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int bluez_interfaces_removed(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* path;
+    const char* interface;
+    bluez_device* device;
+
+    if (sd_bus_message_read(m, "o", &path) < 0 || sd_bus_message_enter_container(m, 'a', "s") < 0)
+        return 0;
+
+    while (sd_bus_message_read(m, "s", &interface) > 0)
+    {
+        if (strcmp(interface, BLUEZ_ADAPTER_INTERFACE) == 0 && s_adapter.present && strcmp(s_adapter.path, path) == 0)
+            memset(&s_adapter, 0, sizeof(s_adapter));
+        else if (strcmp(interface, BLUEZ_DEVICE_INTERFACE) == 0 && (device = bluez_find_device(path, false)) != NULL)
+            device->used = false;
+    }
+
+    bluez_notify();
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+// bluetoothd (re)started or went away
+static int bluez_name_owner_changed(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* name;
+    const char* old_owner;
+    const char* new_owner;
+
+    if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) < 0 || strcmp(name, BLUEZ_SERVICE) != 0)
+        return 0;
+
+    if (s_debug)
+        printf("%s: BlueZ %s\n", __func__, *new_owner != '\0' ? "started" : "stopped");
+
+    if (*new_owner != '\0')
+    {
+        bluez_fetch();
+        return 0;
+    }
+
+    bluez_reset();
+    bluez_notify();
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int bluez_discovery_reply(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    bluez_request* const req = userdata;
+    const bool success = sd_bus_message_get_error(m) == NULL;
+
+    if (! success)
+        fprintf(stderr, "%s failed, cannot enable discovery: %s\n", __func__, sd_bus_message_get_error(m)->message);
+
+    req->callback(success, NULL, req->arg);
+    free(req);
+    return 0;
+
+    // unused
+    (void)error;
+}
+
+bool bluez_setup(const bluez_status_callback callback, const bool debug)
+{
+    sd_bus* const bus = bus_get();
+
+    s_callback = callback;
+    s_debug = debug;
+    s_replied = false;
+
+    if (bus == NULL)
+        return false;
+
+    if (sd_bus_match_signal(bus, &s_matches[0], BLUEZ_SERVICE, NULL, DBUS_PROPERTIES_INTERFACE,
+                            "PropertiesChanged", bluez_properties_changed, NULL) < 0 ||
+        sd_bus_match_signal(bus, &s_matches[1], BLUEZ_SERVICE, "/", DBUS_OBJECT_MANAGER_INTERFACE,
+                            "InterfacesAdded", bluez_interfaces_added, NULL) < 0 ||
+        sd_bus_match_signal(bus, &s_matches[2], BLUEZ_SERVICE, "/", DBUS_OBJECT_MANAGER_INTERFACE,
+                            "InterfacesRemoved", bluez_interfaces_removed, NULL) < 0 ||
+        sd_bus_match_signal(bus, &s_matches[3], "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                            "NameOwnerChanged", bluez_name_owner_changed, NULL) < 0)
+    {
+        fprintf(stderr, "%s failed, cannot watch BlueZ signals\n", __func__);
+        bluez_destroy();
+        return false;
+    }
+
+    bluez_fetch();
+    return true;
+}
+
+void bluez_destroy(void)
+{
+    for (int i = 0; i < BLUEZ_MATCH_COUNT; ++i)
+        s_matches[i] = sd_bus_slot_unref(s_matches[i]);
+
+    bluez_reset();
+}
+
+bool bluez_discovery(const unsigned int timeout_ms, const execute_callback callback, void* const arg)
+{
+    sd_bus* const bus = bus_get();
+    sd_bus_message* m = NULL;
+    bluez_request* req;
+
+    if (bus == NULL || ! s_adapter.present)
+        return false;
+
+    if ((req = malloc(sizeof(bluez_request))) == NULL)
+        return false;
+
+    req->callback = callback;
+    req->arg = arg;
+
+    // pairable does not need a reply, as BlueZ handles messages in order
+    if (sd_bus_call_method_async(bus, NULL, BLUEZ_SERVICE, s_adapter.path, DBUS_PROPERTIES_INTERFACE, "Set",
+                                 NULL, NULL, "ssv", BLUEZ_ADAPTER_INTERFACE, "Pairable", "b", 1) < 0 ||
+        sd_bus_message_new_method_call(bus, &m, BLUEZ_SERVICE, s_adapter.path, DBUS_PROPERTIES_INTERFACE, "Set") < 0 ||
+        sd_bus_message_append(m, "ssv", BLUEZ_ADAPTER_INTERFACE, "Discoverable", "b", 1) < 0 ||
+        sd_bus_call_async(bus, NULL, m, bluez_discovery_reply, req, (uint64_t)timeout_ms * 1000) < 0)
+    {
+        fprintf(stderr, "%s failed, cannot request discovery\n", __func__);
+        sd_bus_message_unref(m);
+        free(req);
+        return false;
+    }
+
+    sd_bus_message_unref(m);
+    bus_update();
+    return true;
+}
+
+#endif // HAVE_SYSTEMD
@@ -0,0 +1,24 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#include "cli.h"
+
+#ifdef HAVE_SYSTEMD
+// bluetooth status straight from BlueZ over the system bus (see bus.h), instead of running mod-bluetooth
+// status is pushed through callback whenever adapter or device properties change, as "status|name|address"
+// status is one of Unavailable, Off, On, Discoverable or Connected,
+// name is the alias of the connected device (if any) and address the one of the adapter
+// status is NULL if BlueZ fails to reply to the first request after setup, nothing else is reported after that
+// NOTE BlueZ replies asynchronously, so setup succeeding does not mean it is there
+typedef void (*bluez_status_callback)(const char* status);
+
+bool bluez_setup(bluez_status_callback callback, bool debug);
+void bluez_destroy(void);
+
+// make the adapter discoverable and pairable, callback is called once BlueZ replies
+// returns false if there is no adapter, callback is not called in that case
+bool bluez_discovery(unsigned int timeout_ms, execute_callback callback, void* arg);
+#endif
@@ -0,0 +1,139 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "bus.h"
+#include "event_loop.h"
+
+#ifdef HAVE_SYSTEMD
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static sd_bus* s_bus = NULL;
+static int s_fd = -1;
+static int s_timer = -1;
+static bool s_debug;
+
+static void bus_process(void)
+{
+    int r;
+
+    while ((r = sd_bus_process(s_bus, NULL)) > 0) {}
+
+    if (r < 0)
+    {
+        fprintf(stderr, "%s failed, connection lost: %s\n", __func__, strerror(-r));
+        bus_destroy();
+        return;
+    }
+
+    bus_update();
+}
+
+static void bus_fd_callback(const int fd, const uint32_t events, void* const arg)
+{
+    bus_process();
+
+    return;
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
+}
+
+static void bus_timer_callback(const int timerfd, const uint32_t events, void* const arg)
+{
+    bus_process();
+
+    return;
+
+    // unused
+    (void)timerfd;
+    (void)events;
+    (void)arg;
+}
+
+bool bus_setup(const bool debug)
+{
+    int r;
+
+    s_debug = debug;
+
+    if ((r = sd_bus_open_system(&s_bus)) < 0)
+    {
+        fprintf(stderr, "%s failed, cannot connect to system bus: %s\n", __func__, strerror(-r));
+        s_bus = NULL;
+        return false;
+    }
+
+    s_fd = sd_bus_get_fd(s_bus);
+    s_timer = event_timer_create(bus_timer_callback, NULL);
+
+    if (s_timer < 0 || ! event_loop_add(s_fd, EPOLLIN, bus_fd_callback, NULL))
+    {
+        if (s_timer >= 0)
+            event_timer_destroy(s_timer);
+
+        s_bus = sd_bus_flush_close_unref(s_bus);
+        s_fd = s_timer = -1;
+        return false;
+    }
+
+    if (debug)
+        printf("%s: connected to system bus\n", __func__);
+
+    bus_update();
+    return true;
+}
+
+void bus_destroy(void)
+{
+    if (s_bus == NULL)
+        return;
+
+    event_loop_remove(s_fd);
+    event_timer_destroy(s_timer);
+
+    s_bus = sd_bus_flush_close_unref(s_bus);
+    s_fd = s_timer = -1;
+}
+
+sd_bus* bus_get(void)
+{
+    return s_bus;
+}
+
+void bus_update(void)
+{
+    uint64_t timeout_us;
+
+    if (s_bus == NULL)
+        return;
+
+    // poll and epoll flags share the same values
+    const int events = sd_bus_get_events(s_bus);
+
+    if (events >= 0)
+        event_loop_modify(s_fd, (uint32_t)events);
+
+    // sd-bus gives an absolute CLOCK_MONOTONIC time, or UINT64_MAX if there is nothing to wait for
+    if (sd_bus_get_timeout(s_bus, &timeout_us) < 0 || timeout_us == UINT64_MAX)
+    {
+        event_timer_stop(s_timer);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const uint64_t now_us = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+    const uint64_t delay_ms = timeout_us > now_us ? (timeout_us - now_us + 999) / 1000 : 0;
+
+    event_timer_start(s_timer, (unsigned int)delay_ms);
+}
+
+#endif // HAVE_SYSTEMD
@@ -0,0 +1,22 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef HAVE_SYSTEMD
+#include <systemd/sd-bus.h>
+
+// persistent connection to the system bus, processed from the event loop
+// NOTE the bus can be overridden for testing through DBUS_SYSTEM_BUS_ADDRESS
+bool bus_setup(bool debug);
+void bus_destroy(void);
+
+// returns NULL if there is no connection, e.g. because it failed or got closed by the other side
+sd_bus* bus_get(void);
+
+// must be called after queueing messages from outside bus callbacks, so they get written out
+void bus_update(void);
+#endif
@@ -3,6 +3,8 @@
  */
 
 #include "cli.h"
+#include "event_loop.h"
+#include "monotonic.h"
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -11,10 +13,80 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <stdint.h>
+#include <time.h>
+
+// how long to wait for a coprocess response before considering it stuck
+#define COPROCESS_TIMEOUT_MS 5000
+
+// deadline for synchronous processes that we read output from
+#define EXECUTE_TIMEOUT_MS 5000
+
+// how often to check if such a process exited, once it closed its output
+#define EXECUTE_WAIT_INTERVAL_MS 1
+
+// captured output is kept up to this size, anything after is read and discarded
+#define EXECUTE_OUTPUT_MAX 0x10000
+
+// limits for async processes
+#define EXECUTE_ASYNC_MAX_RUNNING 4
+#define EXECUTE_ASYNC_MAX_JOBS 32
+#define EXECUTE_ASYNC_MAX_ARGS 16
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+extern char** environ;
+
+typedef enum {
+    EXECUTE_JOB_FREE,
+    EXECUTE_JOB_QUEUED,
+    EXECUTE_JOB_RUNNING,
+} execute_job_state;
+
+// growable buffer for process output, always null-terminated once something was read
+typedef struct execute_output {
+    char* data;
+    size_t size, capacity;
+} execute_output;
+
+typedef struct execute_job {
+    execute_job_state state;
+    uint32_t seq;
+    pid_t pid;
+    int pidfd, outfd, timerfd;
+    unsigned int timeout_ms;
+    bool timed_out;
+    execute_output output;
+    bool get_output;
+    bool debug;
+    execute_callback callback;
+    void* arg;
+    // copy of the arguments, argv points into argbuf
+    const char* argv[EXECUTE_ASYNC_MAX_ARGS + 1];
+    char argbuf[0x200];
+} execute_job;
+
+static execute_job jobs[EXECUTE_ASYNC_MAX_JOBS];
+static uint32_t jobs_running = 0;
+static uint32_t jobs_seq = 0;
+
+// child processes must not inherit the signals we block for signalfd
+static void execute_unblock_signals(void)
+{
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigprocmask(SIG_SETMASK, &sigs, NULL);
+}
 
 bool execute(const char* argv[], const bool debug)
 {
@@ -36,6 +108,7 @@ bool execute(const char* argv[], const bool debug)
     if (pid == 0)
     {
         close(STDIN_FILENO);
+        execute_unblock_signals();
 
         execvp(argv[0], (char* const*)argv);
 
@@ -52,6 +125,60 @@ bool execute(const char* argv[], const bool debug)
     return true;
 }
 
+// read everything currently available from fd (which must be non-blocking)
+// returns false once the other side closed the pipe
+static bool execute_output_read(execute_output* const out, const int fd)
+{
+    char discard[256];
+
+    for (;;)
+    {
+        char* dest = discard;
+        size_t avail = sizeof(discard);
+
+        if (out->size < EXECUTE_OUTPUT_MAX)
+        {
+            if (out->capacity - out->size < 2)
+            {
+                const size_t capacity = out->capacity != 0 ? out->capacity * 2 : 0x100;
+                char* const data = realloc(out->data, capacity + 1);
+
+                if (data != NULL)
+                {
+                    out->data = data;
+                    out->capacity = capacity;
+                }
+            }
+
+            if (out->capacity - out->size >= 2)
+            {
+                dest = out->data + out->size;
+                avail = out->capacity - out->size;
+            }
+        }
+
+        const ssize_t r = read(fd, dest, avail);
+
+        if (r < 0)
+            return errno == EAGAIN || errno == EINTR;
+        if (r == 0)
+            return false;
+
+        if (dest != discard)
+        {
+            out->size += (size_t)r;
+            out->data[out->size] = '\0';
+        }
+    }
+}
+
+// remove the final newline, as done for the output of processes since forever
+static void execute_output_trim(execute_output* const out)
+{
+    if (out->size != 0 && out->data[out->size - 1] == '\n')
+        out->data[--out->size] = '\0';
+}
+
 bool execute_and_get_output(char buf[0xff], const char* argv[], const bool debug)
 {
     if (debug)
@@ -62,10 +189,12 @@ bool execute_and_get_output(char buf[0xff], const char* argv[], const bool debug
         printf("\"\n");
     }
 
+    execute_output out = { NULL, 0, 0 };
     int pipefd[2];
-    pid_t pid;
+    pid_t pid, waited;
     int state;
-    ssize_t r;
+    bool timed_out = false;
+    int64_t deadline;
 
     if (pipe(pipefd) != 0)
         goto error;
@@ -74,7 +203,11 @@ bool execute_and_get_output(char buf[0xff], const char* argv[], const bool debug
 
     // error
     if (pid == -1)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
         goto error;
+    }
 
     // child process
     if (pid == 0)
@@ -85,6 +218,8 @@ bool execute_and_get_output(char buf[0xff], const char* argv[], const bool debug
         close(pipefd[1]);
         close(pipefd[0]);
         close(STDIN_FILENO);
+        execute_unblock_signals();
+        setpgid(0, 0);
 
         execvp(argv[0], (char* const*)argv);
 
@@ -95,27 +230,572 @@ bool execute_and_get_output(char buf[0xff], const char* argv[], const bool debug
 
     // main process
     close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
 
-    // wait for process to finish
-    if (waitpid(pid, &state, 0x0) < 0)
-        goto error;
+    // read output while the process runs, so it never blocks on a full pipe
+    deadline = monotonic_ms() + EXECUTE_TIMEOUT_MS;
+
+    {
+        struct pollfd pfd = { .fd = pipefd[0], .events = POLLIN, .revents = 0 };
+
+        while (execute_output_read(&out, pipefd[0]))
+        {
+            const int64_t remaining = deadline - monotonic_ms();
+
+            if (remaining <= 0 || (poll(&pfd, 1, (int)remaining) == 0))
+            {
+                fprintf(stderr, "%s: \"%s\" did not finish in time, killing it\n", __func__, argv[0]);
+                kill(-pid, SIGKILL);
+                timed_out = true;
+                break;
+            }
+        }
+    }
 
-    r = read(pipefd[0], buf, 0xff-1);
+    close(pipefd[0]);
 
-    if (r <= 0 || r >= 0xff)
+    // closing stdout does not mean it is done, so waiting for it to finish gets the rest of the same deadline
+    if (! timed_out)
+    {
+        while ((waited = waitpid(pid, &state, WNOHANG)) == 0 && monotonic_ms() < deadline)
+            usleep(EXECUTE_WAIT_INTERVAL_MS * 1000);
+
+        if (waited == 0)
+        {
+            fprintf(stderr, "%s: \"%s\" did not exit in time, killing it\n", __func__, argv[0]);
+            kill(-pid, SIGKILL);
+            timed_out = true;
+        }
+    }
+
+    // killed, so this does not block for long
+    if (timed_out)
+        waited = waitpid(pid, &state, 0x0);
+
+    if (waited < 0 || timed_out || out.size == 0)
         goto error;
 
+    execute_output_trim(&out);
+
     if (debug)
-        printf("%s(%p) got %li bytes\n", __func__, argv, r);
+        printf("%s(%p) got %zu bytes\n", __func__, argv, out.size);
 
-    if (buf[r-1] == '\n')
-        buf[r-1] = '\0';
+    // callers only have room for this much, as before, longer output gets truncated
+    if (out.size >= 0xff)
+    {
+        if (debug)
+            printf("%s(%p) output truncated to %d bytes\n", __func__, argv, 0xff - 1);
+
+        out.size = 0xff - 1;
+        out.data[out.size] = '\0';
+        execute_output_trim(&out);
+    }
+
+    if (out.size == 0)
+        goto error;
+
+    memcpy(buf, out.data, out.size + 1);
+    free(out.data);
+    return true;
+
+error:
+    free(out.data);
+    memset(buf, 0, sizeof(char)*0xff);
+    return false;
+}
+
+static void execute_async_start_next(void);
+
+static void execute_async_finish(execute_job* const job, const bool success, const char* const output)
+{
+    const execute_callback callback = job->callback;
+    void* const arg = job->arg;
+
+    job->state = EXECUTE_JOB_FREE;
+    --jobs_running;
+
+    // start next queued process before the callback, which might queue more
+    execute_async_start_next();
+
+    callback(success, output, arg);
+}
+
+static void execute_async_output_callback(const int fd, const uint32_t events, void* const arg)
+{
+    execute_job* const job = (execute_job*)arg;
+
+    if (execute_output_read(&job->output, fd))
+        return;
+
+    // pipe closed, the pidfd callback takes care of the rest
+    event_loop_remove(fd);
+    close(fd);
+    job->outfd = -1;
+
+    return;
+
+    // unused
+    (void)events;
+}
+
+static void execute_async_timer_callback(const int fd, const uint32_t events, void* const arg)
+{
+    execute_job* const job = (execute_job*)arg;
+
+    fprintf(stderr, "%s: \"%s\" did not finish in time, killing it\n", __func__, job->argv[0]);
+
+    // completion is reported through the pidfd as usual
+    job->timed_out = true;
+    kill(-job->pid, SIGKILL);
+
+    return;
+
+    // unused
+    (void)fd;
+    (void)events;
+}
+
+static void execute_async_callback(const int fd, const uint32_t events, void* const arg)
+{
+    execute_job* const job = (execute_job*)arg;
+    int state;
+
+    if (waitpid(job->pid, &state, WNOHANG) <= 0)
+        return;
+
+    event_loop_remove(job->pidfd);
+    close(job->pidfd);
+    event_timer_destroy(job->timerfd);
+
+    // get whatever is left in the pipe
+    if (job->outfd >= 0)
+    {
+        execute_output_read(&job->output, job->outfd);
+        event_loop_remove(job->outfd);
+        close(job->outfd);
+    }
+
+    // job can be reused during the callback, keep output around until we are done with it
+    execute_output output = job->output;
+    execute_output_trim(&output);
+
+    if (job->debug)
+        printf("%s: \"%s\" finished, got %zu bytes%s\n",
+               __func__, job->argv[0], output.size, job->timed_out ? " (timed out)" : "");
+
+    if (job->timed_out)
+        execute_async_finish(job, false, NULL);
+    else if (job->get_output)
+        execute_async_finish(job, output.size != 0, output.data);
     else
-        buf[r] = '\0';
+        execute_async_finish(job, true, NULL);
+
+    free(output.data);
+    return;
+
+    // unused
+    (void)fd;
+    (void)events;
+}
+
+static bool execute_async_spawn(execute_job* const job)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int pipefd[2] = { -1, -1 };
+    int ret;
+
+    job->pidfd = job->outfd = job->timerfd = -1;
+    job->timed_out = false;
+    memset(&job->output, 0, sizeof(job->output));
+
+    if (job->get_output)
+    {
+        if (pipe(pipefd) != 0)
+            return false;
+
+        fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+        fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    if (job->get_output)
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+
+    // do not pass along our blocked signals
+    // and use a new process group, so that on timeout we can kill everything the process started
+    sigemptyset(&sigs);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETPGROUP);
+
+    ret = posix_spawnp(&job->pid, job->argv[0], &actions, &attr, (char* const*)job->argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (job->get_output)
+        close(pipefd[1]);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "cannot exec \"%s\": %s\n", job->argv[0], strerror(ret));
+        goto error;
+    }
+
+    job->pidfd = (int)syscall(SYS_pidfd_open, job->pid, 0);
+
+    if (job->pidfd < 0)
+    {
+        fprintf(stderr, "%s failed, pidfd_open error: %s\n", __func__, strerror(errno));
+        goto error_kill;
+    }
+
+    if (! event_loop_add(job->pidfd, EPOLLIN, execute_async_callback, job))
+    {
+        close(job->pidfd);
+        goto error_kill;
+    }
+
+    if (job->get_output)
+    {
+        if (! event_loop_add(pipefd[0], EPOLLIN, execute_async_output_callback, job))
+            goto error_remove_pidfd;
+
+        job->outfd = pipefd[0];
+    }
 
+    if (job->timeout_ms != 0)
+    {
+        job->timerfd = event_timer_create(execute_async_timer_callback, job);
+
+        if (job->timerfd < 0)
+            goto error_remove_outfd;
+
+        event_timer_start(job->timerfd, job->timeout_ms);
+    }
+
+    job->state = EXECUTE_JOB_RUNNING;
+    ++jobs_running;
     return true;
 
+error_remove_outfd:
+    if (job->outfd >= 0)
+    {
+        event_loop_remove(job->outfd);
+        job->outfd = -1;
+    }
+
+error_remove_pidfd:
+    event_loop_remove(job->pidfd);
+    close(job->pidfd);
+
+error_kill:
+    // not much else we can do without being notified of its completion
+    kill(job->pid, SIGKILL);
+    waitpid(job->pid, NULL, 0);
+
 error:
+    if (job->get_output)
+        close(pipefd[0]);
+
+    return false;
+}
+
+static void execute_async_start_next(void)
+{
+    while (jobs_running < EXECUTE_ASYNC_MAX_RUNNING)
+    {
+        execute_job* next = NULL;
+
+        // oldest queued job goes first
+        for (int i = 0; i < EXECUTE_ASYNC_MAX_JOBS; ++i)
+        {
+            if (jobs[i].state != EXECUTE_JOB_QUEUED)
+                continue;
+            if (next == NULL || (int32_t)(jobs[i].seq - next->seq) < 0)
+                next = &jobs[i];
+        }
+
+        if (next == NULL)
+            return;
+
+        if (! execute_async_spawn(next))
+        {
+            next->state = EXECUTE_JOB_FREE;
+            next->callback(false, NULL, next->arg);
+        }
+    }
+}
+
+bool execute_async(const char* argv[], const bool get_output, const unsigned int timeout_ms,
+                   const execute_callback callback, void* const arg, const bool debug)
+{
+    if (debug)
+    {
+        printf("%s(%p) => \"%s", __func__, argv, argv[0]);
+        for (int i=1; argv[i] != NULL; ++i)
+            printf(" %s", argv[i]);
+        printf("\"\n");
+    }
+
+    // nothing to hand completion to, run it right away
+    if (! event_loop_is_running())
+    {
+        char buf[0xff];
+
+        if (get_output)
+        {
+            const bool ok = execute_and_get_output(buf, argv, debug);
+            callback(ok, buf, arg);
+        }
+        else
+        {
+            callback(execute(argv, debug), NULL, arg);
+        }
+
+        return true;
+    }
+
+    execute_job* job = NULL;
+
+    for (int i = 0; i < EXECUTE_ASYNC_MAX_JOBS; ++i)
+    {
+        if (jobs[i].state == EXECUTE_JOB_FREE)
+        {
+            job = &jobs[i];
+            break;
+        }
+    }
+
+    if (job == NULL)
+    {
+        fprintf(stderr, "%s failed, too many pending processes\n", __func__);
+        return false;
+    }
+
+    // copy arguments
+    size_t offset = 0;
+    int argc = 0;
+
+    for (; argv[argc] != NULL; ++argc)
+    {
+        const size_t len = strlen(argv[argc]) + 1;
+
+        if (argc == EXECUTE_ASYNC_MAX_ARGS || offset + len > sizeof(job->argbuf))
+        {
+            fprintf(stderr, "%s failed, arguments are too big\n", __func__);
+            return false;
+        }
+
+        memcpy(job->argbuf + offset, argv[argc], len);
+        job->argv[argc] = job->argbuf + offset;
+        offset += len;
+    }
+
+    job->argv[argc] = NULL;
+    job->state = EXECUTE_JOB_QUEUED;
+    job->seq = jobs_seq++;
+    job->get_output = get_output;
+    job->timeout_ms = timeout_ms;
+    job->debug = debug;
+    job->callback = callback;
+    job->arg = arg;
+
+    execute_async_start_next();
+    return true;
+}
+
+static bool coprocess_spawn(coprocess* const proc)
+{
+    int sockfd[2];
+
+    // a socket instead of pipes so we can use MSG_NOSIGNAL and not die from SIGPIPE if the helper crashes
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sockfd) != 0)
+    {
+        fprintf(stderr, "%s failed, socketpair error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    const pid_t pid = vfork();
+
+    // error
+    if (pid == -1)
+    {
+        close(sockfd[0]);
+        close(sockfd[1]);
+        return false;
+    }
+
+    // child process
+    if (pid == 0)
+    {
+        dup2(sockfd[1], STDIN_FILENO);
+        dup2(sockfd[1], STDOUT_FILENO);
+        execute_unblock_signals();
+
+        execlp(proc->name, proc->name, "serve", NULL);
+
+        fprintf(stderr, "cannot exec \"%s\": %s\n", proc->name, strerror(errno));
+        _exit(EXIT_FAILURE);
+        return false;
+    }
+
+    // main process
+    close(sockfd[1]);
+
+    proc->pid = pid;
+    proc->fd = sockfd[0];
+
+    if (proc->debug)
+        printf("%s: started '%s serve' as pid %d\n", __func__, proc->name, pid);
+
+    return true;
+}
+
+static void coprocess_kill(coprocess* const proc)
+{
+    if (proc->pid <= 0)
+        return;
+
+    close(proc->fd);
+    kill(proc->pid, SIGKILL);
+    waitpid(proc->pid, NULL, 0);
+
+    proc->pid = -1;
+    proc->fd = -1;
+}
+
+static bool coprocess_send(coprocess* const proc, const char* const req, const size_t reqlen)
+{
+    for (size_t written = 0; written < reqlen;)
+    {
+        const ssize_t r = send(proc->fd, req + written, reqlen - written, MSG_NOSIGNAL);
+
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        written += (size_t)r;
+    }
+
+    return true;
+}
+
+static bool coprocess_receive(coprocess* const proc, char buf[0xff])
+{
+    struct pollfd pfd = { .fd = proc->fd, .events = POLLIN, .revents = 0 };
+    size_t total = 0;
+
+    for (;;)
+    {
+        const int ret = poll(&pfd, 1, COPROCESS_TIMEOUT_MS);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            fprintf(stderr, "%s failed, '%s' did not reply in time\n", __func__, proc->name);
+            return false;
+        }
+
+        const ssize_t r = recv(proc->fd, buf + total, 0xff - 1 - total, 0);
+
+        // helper is gone
+        if (r <= 0)
+            return false;
+
+        total += (size_t)r;
+
+        // response is complete once we receive the null byte
+        if (buf[total - 1] == '\0')
+            break;
+
+        if (total == 0xff - 1)
+        {
+            fprintf(stderr, "%s failed, '%s' response is too big\n", __func__, proc->name);
+            return false;
+        }
+    }
+
+    // remove trailing newlines, as with execute_and_get_output
+    --total;
+    while (total != 0 && buf[total - 1] == '\n')
+        buf[--total] = '\0';
+
+    return true;
+}
+
+bool coprocess_start(coprocess* const proc, const char* const name, const bool debug)
+{
+    proc->name = name;
+    proc->pid = -1;
+    proc->fd = -1;
+    proc->debug = debug;
+
+    return coprocess_spawn(proc);
+}
+
+void coprocess_stop(coprocess* const proc)
+{
+    if (proc->pid <= 0)
+        return;
+
+    // closing our side makes the helper read EOF and quit by itself
+    close(proc->fd);
+    waitpid(proc->pid, NULL, 0);
+
+    proc->pid = -1;
+    proc->fd = -1;
+}
+
+bool coprocess_request(coprocess* const proc, const char* argv[], char buf[0xff], const bool retry)
+{
+    char req[0xff];
+    size_t reqlen = 0;
+
+    // one request per line, arguments separated by spaces
+    for (int i = 0; argv[i] != NULL; ++i)
+    {
+        const int r = snprintf(req + reqlen, sizeof(req) - reqlen, i == 0 ? "%s" : " %s", argv[i]);
+
+        if (r < 0 || (size_t)r >= sizeof(req) - reqlen - 1)
+            return false;
+
+        reqlen += (size_t)r;
+    }
+
+    req[reqlen++] = '\n';
+
+    if (proc->debug)
+        printf("%s(%p) => \"%.*s\"\n", __func__, argv, (int)reqlen - 1, req);
+
+    for (int attempt = 0; attempt < (retry ? 2 : 1); ++attempt)
+    {
+        if (proc->pid <= 0 && ! coprocess_spawn(proc))
+            break;
+
+        if (coprocess_send(proc, req, reqlen) && coprocess_receive(proc, buf))
+        {
+            if (proc->debug)
+                printf("%s(%p) got '%s'\n", __func__, argv, buf);
+
+            return true;
+        }
+
+        // crashed or stuck, restart and try again
+        fprintf(stderr, "%s: helper '%s' failed, restarting\n", __func__, proc->name);
+        coprocess_kill(proc);
+    }
+
     memset(buf, 0, sizeof(char)*0xff);
     return false;
 }
@@ -5,11 +5,42 @@
 #pragma once
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 bool execute(const char* argv[], bool debug);
+// NOTE output is read while the process runs, which is killed if it takes more than a few seconds
 bool execute_and_get_output(char buf[0xff], const char* argv[], bool debug);
 
+// called from the event loop once an async process finished
+// output is NULL unless requested, and only valid during the call
+typedef void (*execute_callback)(bool success, const char* output, void* arg);
+
+// run a process without waiting for it, argv is copied
+// if the process does not finish within timeout_ms (0 for no limit) it is killed and reported as failed
+// only a few processes run at once, others wait in a queue
+// returns false if the process could not be queued, callback is not called in that case
+// NOTE if the event loop is not running the process is run synchronously and callback is called right away
+bool execute_async(const char* argv[], bool get_output, unsigned int timeout_ms,
+                   execute_callback callback, void* arg, bool debug);
+
 bool create_file(const char* filename, bool debug);
 bool delete_file(const char* filename, bool debug);
 bool read_file(char buf[0xff], const char* filename, bool debug);
 bool write_file(char buf[0xff], const char* filename, bool debug);
+
+// long-lived helper process, fed one request per line and answering with a null-terminated response
+// NOTE the helper must support a "serve" argument (e.g. "mod-amixer serve")
+typedef struct coprocess {
+    const char* name;
+    pid_t pid;
+    int fd;
+    bool debug;
+} coprocess;
+
+bool coprocess_start(coprocess* proc, const char* name, bool debug);
+void coprocess_stop(coprocess* proc);
+
+// send argv (without program name) as a request, response is stored in buf
+// if retry is set the helper is restarted once and asked again if it crashed or does not reply in time,
+// otherwise it is only stopped and started again on the next request
+bool coprocess_request(coprocess* proc, const char* argv[], char buf[0xff], bool retry);
@@ -0,0 +1,369 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "event_loop.h"
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+
+#define EVENT_LOOP_MAX_WATCHES 32
+#define EVENT_LOOP_MAX_EVENTS 16
+#define EVENT_LOOP_MAX_FILE_WATCHES 16
+
+// same mask for every watch, as inotify keeps a single one per directory
+#define EVENT_FILE_WATCH_MASK (IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+
+typedef struct event_loop_watch {
+    int fd;
+    bool timer;
+    event_loop_callback callback;
+    void* arg;
+} event_loop_watch;
+
+typedef struct event_file_watch {
+    int wd;
+    char name[NAME_MAX + 1];
+    event_loop_callback callback;
+    void* arg;
+} event_file_watch;
+
+static event_loop_watch watches[EVENT_LOOP_MAX_WATCHES];
+static event_file_watch file_watches[EVENT_LOOP_MAX_FILE_WATCHES];
+static volatile bool event_loop_running = false;
+static int epollfd = -1;
+static int inotifyfd = -1;
+
+static event_loop_watch* event_loop_find(const int fd)
+{
+    for (int i = 0; i < EVENT_LOOP_MAX_WATCHES; ++i)
+    {
+        if (watches[i].callback != NULL && watches[i].fd == fd)
+            return &watches[i];
+    }
+
+    return NULL;
+}
+
+static bool event_loop_add_watch(const int fd, const uint32_t events, const bool timer,
+                                 const event_loop_callback callback, void* const arg)
+{
+    event_loop_watch* watch = NULL;
+
+    for (int i = 0; i < EVENT_LOOP_MAX_WATCHES; ++i)
+    {
+        if (watches[i].callback == NULL)
+        {
+            watch = &watches[i];
+            break;
+        }
+    }
+
+    if (watch == NULL)
+    {
+        fprintf(stderr, "%s failed, too many watches\n", __func__);
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watch;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        fprintf(stderr, "%s failed, epoll_ctl error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    watch->fd = fd;
+    watch->timer = timer;
+    watch->callback = callback;
+    watch->arg = arg;
+    return true;
+}
+
+bool event_loop_init(void)
+{
+    memset(watches, 0, sizeof(watches));
+    memset(file_watches, 0, sizeof(file_watches));
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epollfd < 0)
+    {
+        fprintf(stderr, "%s failed, epoll_create1 error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void event_loop_cleanup(void)
+{
+    if (inotifyfd >= 0)
+    {
+        close(inotifyfd);
+        inotifyfd = -1;
+    }
+
+    if (epollfd < 0)
+        return;
+
+    close(epollfd);
+    epollfd = -1;
+}
+
+bool event_loop_add(const int fd, const uint32_t events, const event_loop_callback callback, void* const arg)
+{
+    return event_loop_add_watch(fd, events, false, callback, arg);
+}
+
+bool event_loop_modify(const int fd, const uint32_t events)
+{
+    event_loop_watch* const watch = event_loop_find(fd);
+
+    if (watch == NULL)
+        return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watch;
+
+    return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void event_loop_remove(const int fd)
+{
+    event_loop_watch* const watch = event_loop_find(fd);
+
+    if (watch == NULL)
+        return;
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+
+    // NOTE pending events for this watch are ignored in event_loop_run
+    watch->fd = -1;
+    watch->callback = NULL;
+    watch->arg = NULL;
+}
+
+bool event_loop_run(void)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    uint64_t expirations;
+    int n;
+
+    event_loop_running = true;
+
+    while (event_loop_running)
+    {
+        n = epoll_wait(epollfd, events, EVENT_LOOP_MAX_EVENTS, -1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "%s failed, epoll_wait error: %s\n", __func__, strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < n && event_loop_running; ++i)
+        {
+            event_loop_watch* const watch = (event_loop_watch*)events[i].data.ptr;
+
+            // removed by a previous callback
+            if (watch->callback == NULL)
+                continue;
+
+            if (watch->timer && read(watch->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
+
+            watch->callback(watch->fd, events[i].events, watch->arg);
+        }
+    }
+
+    return true;
+}
+
+void event_loop_stop(void)
+{
+    event_loop_running = false;
+}
+
+bool event_loop_is_running(void)
+{
+    return event_loop_running;
+}
+
+int event_timer_create(const event_loop_callback callback, void* const arg)
+{
+    const int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+    if (timerfd < 0)
+    {
+        fprintf(stderr, "%s failed, timerfd_create error: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    if (! event_loop_add_watch(timerfd, EPOLLIN, true, callback, arg))
+    {
+        close(timerfd);
+        return -1;
+    }
+
+    return timerfd;
+}
+
+void event_timer_destroy(const int timerfd)
+{
+    if (timerfd < 0)
+        return;
+
+    event_loop_remove(timerfd);
+    close(timerfd);
+}
+
+void event_timer_start(const int timerfd, const unsigned int delay_ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    // a zero value disarms the timer, so use the smallest delay possible instead
+    its.it_value.tv_sec = delay_ms / 1000;
+    its.it_value.tv_nsec = delay_ms != 0 ? (long)(delay_ms % 1000) * 1000000 : 1;
+
+    timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+void event_timer_stop(const int timerfd)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+bool event_timer_is_active(const int timerfd)
+{
+    struct itimerspec its;
+
+    if (timerfd_gettime(timerfd, &its) != 0)
+        return false;
+
+    return its.it_value.tv_sec != 0 || its.it_value.tv_nsec != 0;
+}
+
+static void event_file_watch_callback(const int fd, const uint32_t events, void* const arg)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    ssize_t r;
+
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (char* ptr = buf; ptr < buf + r; ptr += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event*)ptr;
+
+            for (int i = 0; i < EVENT_LOOP_MAX_FILE_WATCHES; ++i)
+            {
+                event_file_watch* const watch = &file_watches[i];
+
+                if (watch->callback == NULL || watch->wd != ev->wd)
+                    continue;
+                if (watch->name[0] != '\0' && (ev->len == 0 || strcmp(watch->name, ev->name) != 0))
+                    continue;
+
+                watch->callback(i, ev->mask, watch->arg);
+            }
+        }
+    }
+
+    return;
+
+    // unused
+    (void)events;
+    (void)arg;
+}
+
+int event_file_watch_add(const char* const dir, const char* const name,
+                         const event_loop_callback callback, void* const arg)
+{
+    int id = -1;
+
+    for (int i = 0; i < EVENT_LOOP_MAX_FILE_WATCHES; ++i)
+    {
+        if (file_watches[i].callback == NULL)
+        {
+            id = i;
+            break;
+        }
+    }
+
+    if (id < 0)
+    {
+        fprintf(stderr, "%s failed, too many file watches\n", __func__);
+        return -1;
+    }
+
+    if (inotifyfd < 0)
+    {
+        inotifyfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+        if (inotifyfd < 0)
+        {
+            fprintf(stderr, "%s failed, inotify_init1 error: %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        if (! event_loop_add(inotifyfd, EPOLLIN, event_file_watch_callback, NULL))
+        {
+            close(inotifyfd);
+            inotifyfd = -1;
+            return -1;
+        }
+    }
+
+    const int wd = inotify_add_watch(inotifyfd, dir, EVENT_FILE_WATCH_MASK);
+
+    if (wd < 0)
+    {
+        fprintf(stderr, "%s failed, cannot watch '%s': %s\n", __func__, dir, strerror(errno));
+        return -1;
+    }
+
+    file_watches[id].wd = wd;
+    snprintf(file_watches[id].name, sizeof(file_watches[id].name), "%s", name != NULL ? name : "");
+    file_watches[id].callback = callback;
+    file_watches[id].arg = arg;
+    return id;
+}
+
+void event_file_watch_remove(const int id)
+{
+    if (id < 0 || id >= EVENT_LOOP_MAX_FILE_WATCHES || file_watches[id].callback == NULL)
+        return;
+
+    const int wd = file_watches[id].wd;
+
+    file_watches[id].callback = NULL;
+    file_watches[id].arg = NULL;
+
+    // only remove the inotify watch once nothing else uses it
+    for (int i = 0; i < EVENT_LOOP_MAX_FILE_WATCHES; ++i)
+    {
+        if (file_watches[i].callback != NULL && file_watches[i].wd == wd)
+            return;
+    }
+
+    inotify_rm_watch(inotifyfd, wd);
+}
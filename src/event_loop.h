@@ -0,0 +1,44 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// called from the event loop when fd has events (EPOLLIN, EPOLLOUT, etc)
+typedef void (*event_loop_callback)(int fd, uint32_t events, void* arg);
+
+bool event_loop_init(void);
+void event_loop_cleanup(void);
+
+// watch fd for events, arg is passed as-is to callback
+bool event_loop_add(int fd, uint32_t events, event_loop_callback callback, void* arg);
+bool event_loop_modify(int fd, uint32_t events);
+void event_loop_remove(int fd);
+
+// run until event_loop_stop is called, returns false on error
+bool event_loop_run(void);
+void event_loop_stop(void);
+
+// true while inside event_loop_run, i.e. callbacks will be triggered
+bool event_loop_is_running(void);
+
+// one-shot timers backed by timerfd, already added to the event loop
+// returns the timer fd, or -1 on error
+int event_timer_create(event_loop_callback callback, void* arg);
+void event_timer_destroy(int timerfd);
+
+// (re)starts timer, callback will be triggered once after delay_ms
+void event_timer_start(int timerfd, unsigned int delay_ms);
+void event_timer_stop(int timerfd);
+bool event_timer_is_active(int timerfd);
+
+// file change notifications backed by a single inotify fd, already added to the event loop
+// callback is triggered with the inotify event mask as events when the entry called name inside dir is
+// created, written, moved or deleted. name can be NULL to get notified of changes to any entry in dir
+// returns a watch id, or -1 on error
+int event_file_watch_add(const char* dir, const char* name, event_loop_callback callback, void* arg);
+void event_file_watch_remove(int id);
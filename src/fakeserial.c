@@ -158,6 +158,15 @@ enum sp_return sp_blocking_read(struct sp_port *port, void *buf, size_t count, u
     return (int)read;
 }
 
+enum sp_return sp_nonblocking_read(struct sp_port *port, void *buf, size_t count)
+{
+    const uint32_t read = loribu_read(port->bread.loribu, buf, (uint32_t)count);
+#ifdef DEBUG_PRINT_SP_OPERATIONS
+    printf("sp_nonblocking_read(%p, %p, %lu) -> %u\n", port, buf, count, read);
+#endif
+    return (int)read;
+}
+
 enum sp_return sp_nonblocking_write(struct sp_port *port, const void *buf, size_t count)
 {
     if (port->otherside == NULL)
@@ -174,6 +183,16 @@ enum sp_return sp_nonblocking_write(struct sp_port *port, const void *buf, size_
     return written == count ? (int)written : SP_ERR_FAIL;
 }
 
+enum sp_return sp_blocking_write(struct sp_port *port, const void *buf, size_t count, unsigned int timeout_ms)
+{
+    return sp_nonblocking_write(port, buf, count);
+}
+
+enum sp_return sp_get_port_handle(const struct sp_port *port, void *result_ptr)
+{
+    return SP_ERR_SUPP;
+}
+
 enum sp_return sp_close(struct sp_port* const serialport)
 {
     serialport->otherside = NULL;
@@ -2,6 +2,7 @@
  * This file is part of mod-system-control.
  */
 
+#include "event_loop.h"
 #include "serial_io.h"
 #include "serial_rw.h"
 #include "reply.h"
@@ -12,20 +13,93 @@
 #include <string.h>
 
 #include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
 
 #ifdef HAVE_SYSTEMD
 #include <systemd/sd-daemon.h>
 #endif
 
-static volatile bool g_running = true;
+static serial_rx s_rx;
+static bool s_debug;
 
-static void signal_handler(int sig)
+static void signal_callback(const int fd, const uint32_t events, void* const arg)
 {
-    g_running = false;
+    struct signalfd_siginfo si;
+
+    if (read(fd, &si, sizeof(si)) != sizeof(si))
+        return;
+
+    event_loop_stop();
     return;
 
     // unused
-    (void)sig;
+    (void)events;
+    (void)arg;
+}
+
+static void serial_callback(const int fd, const uint32_t events, void* const arg)
+{
+    struct sp_port* const serialport = (struct sp_port*)arg;
+    char buf[0xff];
+
+    if (events & (EPOLLERR|EPOLLHUP))
+    {
+        fprintf(stderr, "serial device error or hangup\n");
+        event_loop_stop();
+        return;
+    }
+
+    // write pending messages
+    if (events & EPOLLOUT)
+    {
+        if (! serial_tx_flush())
+        {
+            event_loop_stop();
+            return;
+        }
+    }
+
+    if ((events & EPOLLIN) == 0)
+        return;
+
+    // read everything available in one go, then handle all complete messages
+    if (serial_rx_fill(serialport, &s_rx) == SP_READ_ERROR_IO)
+    {
+        event_loop_stop();
+        return;
+    }
+
+    for (;;)
+    {
+        const int ret = serial_rx_next_msg(&s_rx, buf, s_debug);
+
+        if (ret == SP_READ_ERROR_NO_DATA)
+            break;
+        if (ret == SP_READ_ERROR_INVALID_DATA)
+            continue;
+
+        if (s_debug)
+        {
+            fprintf(stdout, "mod-system-control received '%s'\n", buf);
+            fflush(stdout);
+        }
+
+        if (serial_msg_is_response(buf))
+        {
+            process_hmi_response(buf);
+            continue;
+        }
+
+        if (! parse_and_reply_to_message(serialport, buf, s_debug))
+        {
+            event_loop_stop();
+            return;
+        }
+    }
+
+    // unused
+    (void)fd;
 }
 
 int main(int argc, char* argv[])
@@ -33,7 +107,9 @@ int main(int argc, char* argv[])
     struct sp_port* serialport;
     const char* serial;
     int baudrate;
-    char buf[0xff];
+    int serialfd, sigfd;
+    sigset_t sigs;
+    int ret = EXIT_FAILURE;
 
     if (argc <= 2)
     {
@@ -45,6 +121,10 @@ int main(int argc, char* argv[])
     serial = argv[1];
     baudrate = atoi(argv[2]);
 
+    // check if debugging
+    const char* const mod_log = getenv("MOD_LOG");
+    s_debug = atoi(mod_log != NULL ? mod_log : "0");
+
     // open serial port
     serialport = serial_open(serial, baudrate);
 
@@ -54,54 +134,50 @@ int main(int argc, char* argv[])
     // flush buffers
     sp_flush(serialport, SP_BUF_BOTH);
 
-    // check if debugging
-    const char* const mod_log = getenv("MOD_LOG");
-    const bool debug = atoi(mod_log != NULL ? mod_log : "0");
+    if (sp_get_port_handle(serialport, &serialfd) != SP_OK)
+    {
+        fprintf(stderr, "%s: cannot get serial port handle\n", argv[0]);
+        goto close_serial;
+    }
+
+    // setup quit signal, blocked before creating any threads so they inherit the mask
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+    sigfd = signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC);
+
+    if (sigfd < 0)
+    {
+        fprintf(stderr, "%s: signalfd failed\n", argv[0]);
+        goto close_serial;
+    }
+
+    // setup event loop
+    if (! event_loop_init())
+        goto close_sigfd;
+
+    serial_rx_init(&s_rx);
 
-    // setup quit signal
-    struct sigaction sig;
-    memset(&sig, 0, sizeof(sig));
+    if (! event_loop_add(sigfd, EPOLLIN, signal_callback, NULL) ||
+        ! event_loop_add(serialfd, EPOLLIN, serial_callback, serialport))
+        goto cleanup_event_loop;
 
-    sig.sa_handler = signal_handler;
-    sig.sa_flags   = SA_RESTART;
-    sigemptyset(&sig.sa_mask);
-    sigaction(SIGTERM, &sig, NULL);
-    sigaction(SIGINT, &sig, NULL);
+    serial_tx_attach(serialport);
 
     // create thread for postponed messages
-    create_postponed_messages_thread(debug);
+    create_postponed_messages_thread(serialport, s_debug);
 
     // notify we are running
     fprintf(stdout, "%s now running with '%s', %d baudrate and logging %s\n",
-            argv[0], serial, baudrate, debug ? "enabled" : "disabled");
+            argv[0], serial, baudrate, s_debug ? "enabled" : "disabled");
 #ifdef HAVE_SYSTEMD
     sd_notify(0, "READY=1");
 #endif
 
-    while (g_running)
-    {
-        switch (serial_read_msg_until_zero(serialport, buf, debug))
-        {
-        case SP_READ_ERROR_NO_DATA:
-            process_postponed_messages(serialport);
-            continue;
-        case SP_READ_ERROR_INVALID_DATA:
-            serial_read_ignore_until_zero(serialport);
-            process_postponed_messages(serialport);
-            continue;
-        case SP_READ_ERROR_IO:
-            break;
-        }
-
-        if (debug)
-        {
-            fprintf(stdout, "mod-system-control received '%s'\n", buf);
-            fflush(stdout);
-        }
-
-        if (! parse_and_reply_to_message(serialport, buf, debug))
-            break;
-    }
+    if (event_loop_run())
+        ret = EXIT_SUCCESS;
 
     // notify we are stopping
 #ifdef HAVE_SYSTEMD
@@ -112,8 +188,19 @@ int main(int argc, char* argv[])
     // close postponed messages thread
     destroy_postponed_messages_thread();
 
+    // write whatever is left in the queue
+    serial_tx_flush();
+    serial_tx_detach();
+
+cleanup_event_loop:
+    event_loop_cleanup();
+
+close_sigfd:
+    close(sigfd);
+
+close_serial:
     // close serial port
     serial_close(serialport);
 
-    return EXIT_SUCCESS;
+    return ret;
 }
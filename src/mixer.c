@@ -0,0 +1,379 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "mixer.h"
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const mixer_driver* const kDrivers[] = {
+    &mixer_driver_helper,
+    &mixer_driver_file,
+};
+
+static const char* const kControlNames[MIXER_CONTROL_COUNT] = {
+    "in1",
+    "in2",
+    "out1",
+    "out2",
+    "hp",
+    "cvexp",
+    "exppedal",
+    "cvhp",
+};
+
+// names for toggle values 0 and 1, as printed by mod-amixer
+static const char* const kToggleNames[MIXER_CONTROL_COUNT][2] = {
+    [MIXER_CONTROL_CV_EXP] = { "cv", "exp" },
+    [MIXER_CONTROL_EXP_PEDAL] = { "tip", "ring" },
+    [MIXER_CONTROL_CV_HP] = { "hp", "cv" },
+};
+
+static const mixer_driver* s_driver = NULL;
+
+// taken for reading by every driver call and for writing when opening or closing the driver
+// on top of that, calls lock the lanes of the controls they touch, or lane 0 for drivers without concurrent_lanes
+static pthread_rwlock_t s_driver_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t s_lane_mutexes[MIXER_LANE_COUNT] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define MIXER_ALL_LANES ((1u << MIXER_LANE_COUNT) - 1)
+
+// last known value of each control, readable without taking the driver lock
+// NOTE values are stored as raw float bits so they can be read and written atomically
+static uint32_t s_shadow_values[MIXER_CONTROL_COUNT];
+static uint32_t s_shadow_valid;
+
+static void mixer_shadow_store(const mixer_control control, const float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    __atomic_store_n(&s_shadow_values[control], bits, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&s_shadow_valid, 1u << control, __ATOMIC_RELEASE);
+}
+
+static bool mixer_shadow_load(const mixer_control control, float* const value)
+{
+    if ((__atomic_load_n(&s_shadow_valid, __ATOMIC_ACQUIRE) & (1u << control)) == 0)
+        return false;
+
+    const uint32_t bits = __atomic_load_n(&s_shadow_values[control], __ATOMIC_RELAXED);
+    memcpy(value, &bits, sizeof(*value));
+    return true;
+}
+
+static void mixer_shadow_invalidate(const mixer_control control)
+{
+    __atomic_fetch_and(&s_shadow_valid, ~(1u << control), __ATOMIC_RELEASE);
+}
+
+static void mixer_shadow_fill(const bool debug)
+{
+    float values[MIXER_CONTROL_COUNT];
+
+    if (s_driver->get_all == NULL || ! s_driver->get_all(values))
+        return;
+
+    for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
+        mixer_shadow_store((mixer_control)i, values[i]);
+
+    if (debug)
+        printf("%s: got all mixer values from driver '%s'\n", __func__, s_driver->name);
+}
+
+static bool mixer_init_locked(const char* driver, const bool debug)
+{
+    if (s_driver != NULL)
+        return true;
+
+    if (driver == NULL)
+        driver = getenv("MOD_MIXER_DRIVER");
+    if (driver == NULL || *driver == '\0')
+        driver = mixer_driver_helper.name;
+
+    for (size_t i = 0; i < sizeof(kDrivers)/sizeof(kDrivers[0]); ++i)
+    {
+        if (strcmp(kDrivers[i]->name, driver) != 0)
+            continue;
+
+        if (! kDrivers[i]->open(debug))
+        {
+            fprintf(stderr, "%s failed, cannot open mixer driver '%s'\n", __func__, driver);
+            return false;
+        }
+
+        if (debug)
+            printf("%s: using mixer driver '%s'\n", __func__, driver);
+
+        s_driver = kDrivers[i];
+        mixer_shadow_fill(debug);
+        return true;
+    }
+
+    fprintf(stderr, "%s failed, unknown mixer driver '%s'\n", __func__, driver);
+    return false;
+}
+
+// lock the driver for a call touching lanes (bitmask), opening the default driver if needed
+// locked is set to the lanes to pass to mixer_unlock later
+static bool mixer_lock(const uint32_t lanes, uint32_t* const locked)
+{
+    pthread_rwlock_rdlock(&s_driver_lock);
+
+    while (s_driver == NULL)
+    {
+        pthread_rwlock_unlock(&s_driver_lock);
+        pthread_rwlock_wrlock(&s_driver_lock);
+        const bool ok = mixer_init_locked(NULL, false);
+        pthread_rwlock_unlock(&s_driver_lock);
+
+        if (! ok)
+            return false;
+
+        // someone might close the driver again in between, thus the loop
+        pthread_rwlock_rdlock(&s_driver_lock);
+    }
+
+    *locked = s_driver->concurrent_lanes ? lanes : 1u;
+
+    // always in the same order, so calls touching several lanes cannot deadlock
+    for (int i = 0; i < MIXER_LANE_COUNT; ++i)
+    {
+        if (*locked & (1u << i))
+            pthread_mutex_lock(&s_lane_mutexes[i]);
+    }
+
+    return true;
+}
+
+static void mixer_unlock(const uint32_t locked)
+{
+    for (int i = MIXER_LANE_COUNT; --i >= 0;)
+    {
+        if (locked & (1u << i))
+            pthread_mutex_unlock(&s_lane_mutexes[i]);
+    }
+
+    pthread_rwlock_unlock(&s_driver_lock);
+}
+
+bool mixer_init(const char* const driver, const bool debug)
+{
+    pthread_rwlock_wrlock(&s_driver_lock);
+    const bool ok = mixer_init_locked(driver, debug);
+    pthread_rwlock_unlock(&s_driver_lock);
+
+    return ok;
+}
+
+void mixer_cleanup(void)
+{
+    pthread_rwlock_wrlock(&s_driver_lock);
+
+    if (s_driver != NULL)
+    {
+        s_driver->close();
+        s_driver = NULL;
+    }
+
+    __atomic_store_n(&s_shadow_valid, 0, __ATOMIC_RELEASE);
+
+    pthread_rwlock_unlock(&s_driver_lock);
+}
+
+bool mixer_get(const mixer_control control, float* const value)
+{
+    uint32_t locked;
+    bool ok;
+
+    // no need to wait for the driver if we know the value already
+    if (mixer_shadow_load(control, value))
+        return true;
+
+    if (! mixer_lock(1u << mixer_control_lane(control), &locked))
+        return false;
+
+    ok = s_driver->get(control, value);
+
+    // still locked, so a set happening right after cannot be overwritten by this older value
+    if (ok)
+        mixer_shadow_store(control, *value);
+
+    mixer_unlock(locked);
+
+    return ok;
+}
+
+bool mixer_set(const mixer_control control, const float value)
+{
+    uint32_t locked;
+    bool ok;
+
+    if (! mixer_lock(1u << mixer_control_lane(control), &locked))
+    {
+        mixer_shadow_invalidate(control);
+        return false;
+    }
+
+    ok = s_driver->set(control, value);
+
+    // if setting failed we do not know what the hardware has, ask the driver next time
+    if (ok)
+        mixer_shadow_store(control, value);
+    else
+        mixer_shadow_invalidate(control);
+
+    mixer_unlock(locked);
+
+    return ok;
+}
+
+static bool mixer_set_batch_locked(const mixer_value* const values, const int count)
+{
+    bool ok = true;
+
+    if (s_driver->set_batch != NULL)
+    {
+        ok = s_driver->set_batch(values, count);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (ok)
+                mixer_shadow_store(values[i].control, values[i].value);
+            else
+                mixer_shadow_invalidate(values[i].control);
+        }
+
+        return ok;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (s_driver->set(values[i].control, values[i].value))
+        {
+            mixer_shadow_store(values[i].control, values[i].value);
+        }
+        else
+        {
+            mixer_shadow_invalidate(values[i].control);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+bool mixer_set_batch(const mixer_value* const values, const int count)
+{
+    uint32_t lanes = 0, locked;
+    bool ok;
+
+    for (int i = 0; i < count; ++i)
+        lanes |= 1u << mixer_control_lane(values[i].control);
+
+    if (! mixer_lock(lanes, &locked))
+    {
+        for (int i = 0; i < count; ++i)
+            mixer_shadow_invalidate(values[i].control);
+
+        return false;
+    }
+
+    ok = mixer_set_batch_locked(values, count);
+    mixer_unlock(locked);
+
+    return ok;
+}
+
+bool mixer_save(void)
+{
+    uint32_t locked;
+    bool ok;
+
+    if (! mixer_lock(MIXER_ALL_LANES, &locked))
+        return false;
+
+    ok = s_driver->save();
+    mixer_unlock(locked);
+
+    return ok;
+}
+
+const char* mixer_control_name(const mixer_control control)
+{
+    return kControlNames[control];
+}
+
+bool mixer_control_is_toggle(const mixer_control control)
+{
+    return control >= MIXER_CONTROL_CV_EXP;
+}
+
+mixer_lane mixer_control_lane(const mixer_control control)
+{
+    switch (control)
+    {
+    case MIXER_CONTROL_IN1:
+    case MIXER_CONTROL_IN2:
+        return MIXER_LANE_INPUT;
+    case MIXER_CONTROL_OUT1:
+    case MIXER_CONTROL_OUT2:
+        return MIXER_LANE_OUTPUT;
+    case MIXER_CONTROL_HP:
+        return MIXER_LANE_HP;
+    default:
+        return MIXER_LANE_ROUTING;
+    }
+}
+
+mixer_control mixer_control_for_gain(const bool input, const char channel)
+{
+    if (input)
+        return channel == '2' ? MIXER_CONTROL_IN2 : MIXER_CONTROL_IN1;
+
+    return channel == '2' ? MIXER_CONTROL_OUT2 : MIXER_CONTROL_OUT1;
+}
+
+bool mixer_parse_value(const mixer_control control, const char* const str, float* const value)
+{
+    char* end;
+
+    if (mixer_control_is_toggle(control))
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (strcmp(str, kToggleNames[control][i]) == 0)
+            {
+                *value = (float)i;
+                return true;
+            }
+        }
+
+        const long toggle = strtol(str, &end, 10);
+
+        if (end == str || (toggle != 0 && toggle != 1))
+            return false;
+
+        *value = (float)toggle;
+        return true;
+    }
+
+    *value = strtof(str, &end);
+    return end != str;
+}
+
+void mixer_format_value(const mixer_control control, const float value, char buf[MIXER_VALUE_SIZE])
+{
+    if (mixer_control_is_toggle(control))
+        snprintf(buf, MIXER_VALUE_SIZE, "%s", kToggleNames[control][value > 0.5f ? 1 : 0]);
+    else
+        snprintf(buf, MIXER_VALUE_SIZE, "%d", (int)lroundf(value));
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+// all audio mixer controls exposed to the HMI
+typedef enum mixer_control {
+    MIXER_CONTROL_IN1,
+    MIXER_CONTROL_IN2,
+    MIXER_CONTROL_OUT1,
+    MIXER_CONTROL_OUT2,
+    MIXER_CONTROL_HP,
+    // toggles, 0 or 1
+    MIXER_CONTROL_CV_EXP,    /* 0 = cv, 1 = exp */
+    MIXER_CONTROL_EXP_PEDAL, /* 0 = tip, 1 = ring */
+    MIXER_CONTROL_CV_HP,     /* 0 = hp, 1 = cv */
+    MIXER_CONTROL_COUNT
+} mixer_control;
+
+// groups of controls backed by unrelated hardware, which can be set concurrently
+typedef enum mixer_lane {
+    MIXER_LANE_INPUT,   /* in1, in2 */
+    MIXER_LANE_OUTPUT,  /* out1, out2 */
+    MIXER_LANE_HP,      /* hp */
+    MIXER_LANE_ROUTING, /* cvexp, exppedal, cvhp */
+    MIXER_LANE_COUNT
+} mixer_lane;
+
+// enough for any formatted mixer value
+#define MIXER_VALUE_SIZE 16
+
+typedef struct mixer_value {
+    mixer_control control;
+    float value;
+} mixer_value;
+
+// a mixer driver talks to the actual hardware (or something pretending to be it)
+// gain values are in dB, toggles are 0 or 1
+// set_batch is optional, for drivers that can apply several controls at once for less than the cost of each
+// get_all is optional too, for drivers that can read all controls at once
+// NOTE calls are serialized by the mixer engine, drivers do not need to be thread-safe
+// unless they set concurrent_lanes, then calls for controls of different lanes can happen at the same time
+// (calls within a lane, as well as open, close, get_all and save, are still serialized)
+typedef struct mixer_driver {
+    const char* name;
+    bool concurrent_lanes;
+    bool (*open)(bool debug);
+    void (*close)(void);
+    bool (*get)(mixer_control control, float* value);
+    bool (*set)(mixer_control control, float value);
+    bool (*set_batch)(const mixer_value* values, int count);
+    bool (*get_all)(float values[MIXER_CONTROL_COUNT]);
+    bool (*save)(void);
+} mixer_driver;
+
+// goes through mod-amixer for every operation (default)
+// NOTE mod-amixer is kept running as a coprocess, so this does not spawn a process per call
+extern const mixer_driver mixer_driver_helper;
+
+// keeps values in plain files, one per control, inside MOD_MIXER_STATE_DIR (for tests)
+extern const mixer_driver mixer_driver_file;
+
+// select driver by name, or through the MOD_MIXER_DRIVER environment variable if name is NULL
+// NOTE this is also called automatically on first use of the mixer
+bool mixer_init(const char* driver, bool debug);
+void mixer_cleanup(void);
+
+// NOTE values are kept in memory once read or set, so only the first get of each control reaches the driver
+bool mixer_get(mixer_control control, float* value);
+bool mixer_set(mixer_control control, float value);
+// NOTE values of a batch should belong to a single lane, otherwise the batch waits for all lanes it touches
+bool mixer_set_batch(const mixer_value* values, int count);
+bool mixer_save(void);
+
+// names as used by mod-amixer and the HMI
+const char* mixer_control_name(mixer_control control);
+bool mixer_control_is_toggle(mixer_control control);
+mixer_lane mixer_control_lane(mixer_control control);
+
+// get mixer control from HMI gain command arguments, channel is '1' or '2'
+// NOTE channel '0' means both, use the returned control and the one after it
+mixer_control mixer_control_for_gain(bool input, char channel);
+
+// convert values from/to the text sent over serial and used by mod-amixer
+// toggles accept both numbers and their names (e.g. "cv" or "exp")
+bool mixer_parse_value(mixer_control control, const char* str, float* value);
+void mixer_format_value(mixer_control control, float value, char buf[MIXER_VALUE_SIZE]);
@@ -0,0 +1,107 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "mixer.h"
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MIXER_FILE_DEFAULT_DIR "/tmp/mod-mixer"
+
+// directory plus "/" and control name
+#define MIXER_FILE_PATH_MAX (PATH_MAX + MIXER_VALUE_SIZE)
+
+static char s_dir[PATH_MAX];
+
+static void file_path(char path[MIXER_FILE_PATH_MAX], const mixer_control control)
+{
+    snprintf(path, MIXER_FILE_PATH_MAX, "%s/%s", s_dir, mixer_control_name(control));
+}
+
+static bool file_open(const bool debug)
+{
+    const char* const dir = getenv("MOD_MIXER_STATE_DIR");
+
+    snprintf(s_dir, sizeof(s_dir), "%s", dir != NULL && *dir != '\0' ? dir : MIXER_FILE_DEFAULT_DIR);
+
+    if (mkdir(s_dir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "%s failed, cannot create '%s': %s\n", __func__, s_dir, strerror(errno));
+        return false;
+    }
+
+    if (debug)
+        printf("%s: keeping mixer state in '%s'\n", __func__, s_dir);
+
+    return true;
+}
+
+static void file_close(void)
+{
+}
+
+static bool file_get(const mixer_control control, float* const value)
+{
+    char path[MIXER_FILE_PATH_MAX];
+    file_path(path, control);
+
+    FILE* const fd = fopen(path, "r");
+
+    // controls that were never set are at 0 (or the first toggle value)
+    if (fd == NULL)
+    {
+        *value = 0.f;
+        return errno == ENOENT;
+    }
+
+    const bool ok = fscanf(fd, "%f", value) == 1;
+    fclose(fd);
+
+    return ok;
+}
+
+static bool file_set(const mixer_control control, const float value)
+{
+    char path[MIXER_FILE_PATH_MAX];
+    file_path(path, control);
+
+    FILE* const fd = fopen(path, "w");
+
+    if (fd == NULL)
+        return false;
+
+    fprintf(fd, "%f\n", value);
+    return fclose(fd) == 0;
+}
+
+// values are always written right away, saving only leaves a line in "saves" so tests can count them
+static bool file_save(void)
+{
+    char path[MIXER_FILE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/saves", s_dir);
+
+    FILE* const fd = fopen(path, "a");
+
+    if (fd == NULL)
+        return false;
+
+    fprintf(fd, "save\n");
+    return fclose(fd) == 0;
+}
+
+const mixer_driver mixer_driver_file = {
+    .name = "file",
+    // one file per control, nothing shared between lanes
+    .concurrent_lanes = true,
+    .open = file_open,
+    .close = file_close,
+    .get = file_get,
+    .set = file_set,
+    .save = file_save,
+};
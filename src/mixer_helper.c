@@ -0,0 +1,237 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "mixer.h"
+#include "cli.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+// one mod-amixer per lane, so lanes do not wait for each other
+// only the first is started right away, the others are spawned on their first request
+static coprocess s_procs[MIXER_LANE_COUNT];
+static bool s_debug;
+
+// set when mod-amixer cannot run as a coprocess, so we spawn it for every call instead
+// NOTE these flags can be set from any lane, so they are accessed atomically
+static bool s_oneshot;
+
+// set when mod-amixer does not know about "batch", older versions need one call per control
+static bool s_no_batch;
+
+// "mod-amixer batch", then up to 4 arguments per control followed by ","
+#define HELPER_BATCH_MAX_ARGS (2 + MIXER_CONTROL_COUNT * 5 + 1)
+
+// run mod-amixer with argv on the coprocess of lane, output is optional
+static bool helper_run(const mixer_lane lane, const char* argv[], char buf[0xff])
+{
+    char tmpbuf[0xff];
+
+    if (! __atomic_load_n(&s_oneshot, __ATOMIC_RELAXED))
+    {
+        if (coprocess_request(&s_procs[lane], argv + 1, buf != NULL ? buf : tmpbuf, true))
+            return true;
+
+        fprintf(stderr, "%s: mod-amixer does not work as coprocess, running it for each call from now on\n", __func__);
+        coprocess_stop(&s_procs[lane]);
+        __atomic_store_n(&s_oneshot, true, __ATOMIC_RELAXED);
+    }
+
+    return buf != NULL ? execute_and_get_output(buf, argv, s_debug) : execute(argv, s_debug);
+}
+
+// fill argv for mod-amixer, value is NULL for getters
+static void helper_argv(const char* argv[6], const mixer_control control, const char* const value)
+{
+    switch (control)
+    {
+    case MIXER_CONTROL_IN1:
+    case MIXER_CONTROL_IN2:
+    case MIXER_CONTROL_OUT1:
+    case MIXER_CONTROL_OUT2:
+        argv[0] = "mod-amixer";
+        argv[1] = control <= MIXER_CONTROL_IN2 ? "in" : "out";
+        argv[2] = control == MIXER_CONTROL_IN1 || control == MIXER_CONTROL_OUT1 ? "1" : "2";
+        argv[3] = "xvol";
+        argv[4] = value;
+        argv[5] = NULL;
+        break;
+    case MIXER_CONTROL_HP:
+        argv[0] = "mod-amixer";
+        argv[1] = "hp";
+        argv[2] = "xvol";
+        argv[3] = value;
+        argv[4] = NULL;
+        break;
+    default:
+        argv[0] = "mod-amixer";
+        argv[1] = mixer_control_name(control);
+        argv[2] = value;
+        argv[3] = NULL;
+        break;
+    }
+}
+
+static bool helper_open(const bool debug)
+{
+    s_debug = debug;
+    s_no_batch = false;
+    s_oneshot = ! coprocess_start(&s_procs[0], "mod-amixer", debug);
+
+    for (int i = 1; i < MIXER_LANE_COUNT; ++i)
+        s_procs[i] = (coprocess){ .name = "mod-amixer", .pid = -1, .fd = -1, .debug = debug };
+
+    return true;
+}
+
+static void helper_close(void)
+{
+    for (int i = 0; i < MIXER_LANE_COUNT; ++i)
+        coprocess_stop(&s_procs[i]);
+}
+
+static bool helper_get(const mixer_control control, float* const value)
+{
+    const char* argv[6];
+    char buf[0xff];
+
+    helper_argv(argv, control, NULL);
+
+    if (! helper_run(mixer_control_lane(control), argv, buf))
+        return false;
+
+    return mixer_parse_value(control, buf, value);
+}
+
+static void helper_format(char valuestr[MIXER_VALUE_SIZE], const mixer_control control, const float value)
+{
+    if (mixer_control_is_toggle(control))
+        snprintf(valuestr, MIXER_VALUE_SIZE, "%d", value > 0.5f ? 1 : 0);
+    else
+        snprintf(valuestr, MIXER_VALUE_SIZE, "%f", value);
+}
+
+// "in1|in2|cvexp|exppedal" or "out1|out2|hp|cvhp"
+static bool helper_parse_all(char* const buf, const mixer_control controls[4], float values[MIXER_CONTROL_COUNT])
+{
+    char* saveptr;
+    char* str = strtok_r(buf, "|", &saveptr);
+
+    for (int i = 0; i < 4; ++i, str = strtok_r(NULL, "|", &saveptr))
+    {
+        if (str == NULL || ! mixer_parse_value(controls[i], str, &values[controls[i]]))
+            return false;
+    }
+
+    return true;
+}
+
+static bool helper_get_all(float values[MIXER_CONTROL_COUNT])
+{
+    static const mixer_control kInControls[4] = {
+        MIXER_CONTROL_IN1, MIXER_CONTROL_IN2, MIXER_CONTROL_CV_EXP, MIXER_CONTROL_EXP_PEDAL
+    };
+    static const mixer_control kOutControls[4] = {
+        MIXER_CONTROL_OUT1, MIXER_CONTROL_OUT2, MIXER_CONTROL_HP, MIXER_CONTROL_CV_HP
+    };
+    const char* argvin[6] = { "mod-amixer", "in", "xall", NULL };
+    const char* argvout[6] = { "mod-amixer", "out", "xall", NULL };
+    char buf[0xff];
+
+    if (! helper_run(0, argvin, buf) || ! helper_parse_all(buf, kInControls, values))
+        return false;
+
+    if (! helper_run(0, argvout, buf) || ! helper_parse_all(buf, kOutControls, values))
+        return false;
+
+    return true;
+}
+
+static bool helper_set(const mixer_control control, const float value)
+{
+    const char* argv[6];
+    char valuestr[MIXER_VALUE_SIZE];
+
+    helper_format(valuestr, control, value);
+    helper_argv(argv, control, valuestr);
+
+    return helper_run(mixer_control_lane(control), argv, NULL);
+}
+
+static bool helper_set_each(const mixer_value* const values, const int count)
+{
+    bool ok = true;
+
+    for (int i = 0; i < count; ++i)
+        ok = helper_set(values[i].control, values[i].value) && ok;
+
+    return ok;
+}
+
+// all controls in a single call, e.g. "mod-amixer batch in 1 xvol -3.0 , hp xvol 0.0 ,"
+// mod-amixer replies with "batch ok" at the end, if it understood the request
+// if the call fails instead, which might have been halfway through, controls are set one by one from then on
+// NOTE this runs on the coprocess of the first control, the engine has all lanes of the batch locked
+static bool helper_set_batch(const mixer_value* const values, const int count)
+{
+    const char* argv[HELPER_BATCH_MAX_ARGS];
+    const char* ctrlargv[6];
+    char valuestrs[MIXER_CONTROL_COUNT][MIXER_VALUE_SIZE];
+    char buf[0xff];
+    int argc = 0;
+
+    if (count == 1 || count > MIXER_CONTROL_COUNT || __atomic_load_n(&s_no_batch, __ATOMIC_RELAXED))
+        return helper_set_each(values, count);
+
+    argv[argc++] = "mod-amixer";
+    argv[argc++] = "batch";
+
+    for (int i = 0; i < count; ++i)
+    {
+        helper_format(valuestrs[i], values[i].control, values[i].value);
+        helper_argv(ctrlargv, values[i].control, valuestrs[i]);
+
+        for (int j = 1; ctrlargv[j] != NULL; ++j)
+            argv[argc++] = ctrlargv[j];
+
+        argv[argc++] = ",";
+    }
+
+    argv[argc] = NULL;
+
+    // tried only once, an old mod-amixer failing on it must not send the coprocess into one-shot mode
+    const bool ok = __atomic_load_n(&s_oneshot, __ATOMIC_RELAXED)
+                  ? execute_and_get_output(buf, argv, s_debug)
+                  : coprocess_request(&s_procs[mixer_control_lane(values[0].control)], argv + 1, buf, false);
+
+    if (ok && strstr(buf, "batch ok") != NULL)
+        return true;
+
+    // a failed call is treated the same as an unknown request, no point in trying again for every batch
+    // values are absolute, so applying them again one by one is harmless
+    fprintf(stderr, "%s: mod-amixer batch failed, setting controls one by one from now on\n", __func__);
+    __atomic_store_n(&s_no_batch, true, __ATOMIC_RELAXED);
+
+    return helper_set_each(values, count);
+}
+
+static bool helper_save(void)
+{
+    const char* argv[6] = { "mod-amixer", "save", NULL };
+
+    return helper_run(0, argv, NULL);
+}
+
+const mixer_driver mixer_driver_helper = {
+    .name = "helper",
+    .concurrent_lanes = true,
+    .open = helper_open,
+    .close = helper_close,
+    .get = helper_get,
+    .set = helper_set,
+    .set_batch = helper_set_batch,
+    .get_all = helper_get_all,
+    .save = helper_save,
+};
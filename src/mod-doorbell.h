@@ -0,0 +1,181 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+// doorbell for a single consumer, living in shared memory next to the data it signals
+// the consumer spins briefly before going to sleep on a futex, and producers only make the wake syscall
+// when the consumer is actually sleeping, so bursts of messages cost no syscalls on either side
+// there is also a pollable variant, where the consumer waits through poll/epoll on a unix datagram socket
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// how many times the consumer checks for new data before going to sleep
+#define MOD_DOORBELL_SPIN_COUNT 256
+
+#define MOD_DOORBELL_AWAKE 0
+#define MOD_DOORBELL_SLEEPING 1
+
+typedef struct {
+    // MOD_DOORBELL_AWAKE or MOD_DOORBELL_SLEEPING, also used as futex word
+    uint32_t state;
+    // set when the consumer waits on the socket at path instead of the futex
+    uint32_t pollable;
+    char path[56];
+} mod_doorbell;
+
+static inline
+void mod_doorbell_init(mod_doorbell* const db)
+{
+    db->state = MOD_DOORBELL_AWAKE;
+    db->pollable = 0;
+    db->path[0] = '\0';
+}
+
+static inline
+void mod_doorbell_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* --------------------------------------------------------------------- */
+// producer side
+
+// to be called after publishing new data
+static inline
+void mod_doorbell_ring(mod_doorbell* const db)
+{
+    // make sure the consumer sees our data if it sees the state change, and we see it going to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&db->state, __ATOMIC_RELAXED) != MOD_DOORBELL_SLEEPING)
+        return;
+
+    // only one producer gets to wake the consumer
+    if (__atomic_exchange_n(&db->state, MOD_DOORBELL_AWAKE, __ATOMIC_SEQ_CST) != MOD_DOORBELL_SLEEPING)
+        return;
+
+    if (__atomic_load_n(&db->pollable, __ATOMIC_ACQUIRE) == 0)
+    {
+        syscall(SYS_futex, &db->state, FUTEX_WAKE, 1, NULL, NULL, 0);
+        return;
+    }
+
+    // sent by path, so this keeps working if the consumer restarts, and never raises SIGPIPE
+    // NOTE the socket is per process (and per file including us), producers are expected to hold a write lock
+    static int fd = -1;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (fd < 0 && (fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0)
+        return;
+
+    memcpy(addr.sun_path, db->path, sizeof(db->path));
+
+    // a full socket queue already has the consumer woken up
+    sendto(fd, "", 1, MSG_DONTWAIT|MSG_NOSIGNAL, (const struct sockaddr*)&addr, sizeof(addr));
+}
+
+/* --------------------------------------------------------------------- */
+// consumer side
+
+// announce going to sleep, consumer must check for new data once more after this
+static inline
+void mod_doorbell_sleep_begin(mod_doorbell* const db)
+{
+    __atomic_store_n(&db->state, MOD_DOORBELL_SLEEPING, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline
+void mod_doorbell_sleep_cancel(mod_doorbell* const db)
+{
+    __atomic_store_n(&db->state, MOD_DOORBELL_AWAKE, __ATOMIC_RELAXED);
+}
+
+// sleep until rung, after mod_doorbell_sleep_begin, timeout < 0 means forever
+// returns false on timeout
+static inline
+bool mod_doorbell_wait(mod_doorbell* const db, const int timeout_ms)
+{
+    struct timespec ts = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+
+    while (__atomic_load_n(&db->state, __ATOMIC_ACQUIRE) == MOD_DOORBELL_SLEEPING)
+    {
+        if (syscall(SYS_futex, &db->state, FUTEX_WAIT, MOD_DOORBELL_SLEEPING,
+                    timeout_ms >= 0 ? &ts : NULL, NULL, 0) != 0 && errno == ETIMEDOUT)
+        {
+            mod_doorbell_sleep_cancel(db);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// switch the doorbell to its pollable variant, returns the fd to poll for reading or -1 on error
+// NOTE the consumer must call mod_doorbell_fd_drain when the fd becomes readable
+static inline
+int mod_doorbell_fd_open(mod_doorbell* const db, const char* const path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if ((size_t)snprintf(db->path, sizeof(db->path), "%s", path) >= sizeof(db->path))
+    {
+        fprintf(stderr, "mod_doorbell_fd_open: failed, path too long\n");
+        return -1;
+    }
+
+    memcpy(addr.sun_path, db->path, sizeof(db->path));
+
+    const int fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "mod_doorbell_fd_open: socket failed\n");
+        return -1;
+    }
+
+    // always remove in case of process crash
+    unlink(path);
+
+    if (bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "mod_doorbell_fd_open: bind failed\n");
+        close(fd);
+        return -1;
+    }
+
+    __atomic_store_n(&db->pollable, 1, __ATOMIC_RELEASE);
+    return fd;
+}
+
+static inline
+void mod_doorbell_fd_close(mod_doorbell* const db, const int fd)
+{
+    __atomic_store_n(&db->pollable, 0, __ATOMIC_RELEASE);
+    close(fd);
+    unlink(db->path);
+}
+
+static inline
+void mod_doorbell_fd_drain(const int fd)
+{
+    char buf[8];
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {}
+}
@@ -0,0 +1,18 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <time.h>
+
+// milliseconds since some unspecified point, not affected by wall clock changes
+// NOTE 64-bit, as a 32-bit value of milliseconds wraps around after less than 25 days of uptime
+static inline int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
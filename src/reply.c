@@ -3,14 +3,20 @@
  */
 
 #include "reply.h"
+#include "bluetooth.h"
+#include "bus.h"
 #include "cli.h"
+#include "event_loop.h"
+#include "mixer.h"
 #include "serial_rw.h"
 #include "sys_host.h"
 #include "sys_mixer.h"
+#include "unit_state.h"
 
 #include "../mod-controller-proto/mod-protocol.h"
 
 #define _GNU_SOURCE
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,47 +25,273 @@
 // "sys_ver 07 version" -> "version"
 #define SYS_CMD_ARG_START (_CMD_SYS_LENGTH + _CMD_SYS_DATA_LENGTH + 2)
 
-/*static*/ bool execute_ignoring_output(struct sp_port* const serialport, const char* argv[], const bool debug)
+// deadlines for external tools, after which they get killed and we reply with "r -1"
+#define BLUETOOTH_TIMEOUT_MS 2000
+#define SYSTEMCTL_TIMEOUT_MS 1000
+#define VERSION_TIMEOUT_MS 1000
+
+// files and directories with the data behind cached replies, see reply_cache_setup
+#define SERIAL_NUMBER_DIR "/var/cache/mod"
+#define SERIAL_NUMBER_FILE "tag"
+#define VERSION_DIR "/etc/mod-release"
+
+// replies that do not change while running, cached until their backing files change
+#define REPLY_CACHE_SIZE 16
+#define REPLY_CACHE_KEY_SIZE 32
+
+typedef enum reply_cache_group {
+    REPLY_CACHE_SERIAL,
+    REPLY_CACHE_VERSION,
+    REPLY_CACHE_GROUP_COUNT
+} reply_cache_group;
+
+// what to store once a reply is known, generation allows to discard results that were invalidated meanwhile
+typedef struct reply_cache_request {
+    bool enabled;
+    reply_cache_group group;
+    uint32_t generation;
+    char key[REPLY_CACHE_KEY_SIZE];
+} reply_cache_request;
+
+typedef struct reply_cache_entry {
+    bool valid;
+    reply_cache_group group;
+    char key[REPLY_CACHE_KEY_SIZE];
+    char msg[0xff + 4];
+} reply_cache_entry;
+
+static struct {
+    reply_cache_entry entries[REPLY_CACHE_SIZE];
+    uint32_t generations[REPLY_CACHE_GROUP_COUNT];
+    int watches[REPLY_CACHE_GROUP_COUNT];
+    int prewarm_timer;
+    bool debug;
+} cache = {
+    .watches = { -1, -1 },
+    .prewarm_timer = -1,
+};
+
+// mod-version arguments used by the HMI, prewarmed on startup
+static const char* const kVersionKeys[] = {
+    "version",
+    "release",
+    "build",
+    "controller",
+    "system",
+    "restore",
+};
+
+static reply_cache_request cache_prewarm_requests[sizeof(kVersionKeys)/sizeof(kVersionKeys[0])];
+
+// replies must go out in the same order as requests came in, even if some of them complete later
+#define REPLY_MAX_PENDING 64
+
+typedef struct reply_slot {
+    bool ready;
+    char msg[0xff + 4];
+    reply_cache_request cache;
+} reply_slot;
+
+static struct {
+    reply_slot slots[REPLY_MAX_PENDING];
+    // free-running indexes, head is the next reply to write and tail the next slot to reserve
+    uint32_t head, tail;
+    struct sp_port* serialport;
+    bool io_error;
+} replies;
+
+// reserve a place for a reply that will be written later, returns false if there are too many pending
+static bool reply_reserve(struct sp_port* const serialport, uint32_t* const slot)
 {
-    if (execute(argv, debug))
+    if (replies.tail - replies.head == REPLY_MAX_PENDING)
     {
-        if (debug)
-            printf("%s(%p) completed successfully\n", __func__, argv);
+        fprintf(stderr, "%s failed, too many pending replies\n", __func__);
+        return false;
+    }
+
+    replies.serialport = serialport;
+    replies.slots[replies.tail % REPLY_MAX_PENDING].ready = false;
+    replies.slots[replies.tail % REPLY_MAX_PENDING].cache.enabled = false;
+    *slot = replies.tail++;
+    return true;
+}
+
+// fill a reserved reply and write all replies that are ready, in order
+static void reply_complete(const uint32_t slot, const char* const msg)
+{
+    reply_slot* const rslot = &replies.slots[slot % REPLY_MAX_PENDING];
+
+    snprintf(rslot->msg, sizeof(rslot->msg), "%s", msg);
+    rslot->ready = true;
+
+    while (replies.head != replies.tail)
+    {
+        reply_slot* const next = &replies.slots[replies.head % REPLY_MAX_PENDING];
 
-        return serialport != NULL ? write_or_close(serialport, "r 0") : true;
+        if (! next->ready)
+            break;
+
+        ++replies.head;
+
+        if (! replies.io_error && ! write_or_close(replies.serialport, next->msg))
+        {
+            replies.io_error = true;
+            event_loop_stop();
+        }
     }
+}
 
-    if (debug)
-        printf("%s(%p) failed\n", __func__, argv);
+static bool write_reply(struct sp_port* const serialport, const char* const msg)
+{
+    uint32_t slot;
+
+    // nothing pending, send right away
+    if (replies.head == replies.tail)
+        return write_or_close(serialport, msg);
+
+    // otherwise wait for the earlier replies
+    if (! reply_reserve(serialport, &slot))
+        return write_or_close(serialport, msg);
 
-    return serialport != NULL ? write_or_close(serialport, "r -1") : false;
+    reply_complete(slot, msg);
+    return ! replies.io_error;
 }
 
-static bool execute_and_write_output_resp(struct sp_port* const serialport, const char* argv[], const bool debug)
+static void reply_cache_request_init(reply_cache_request* const req, const reply_cache_group group,
+                                     const char* const key)
 {
-    char cmdbuf[0xff + 4];
+    // without a watch we would never know when to drop the entry, so nothing gets cached
+    req->enabled = cache.watches[group] >= 0;
+    req->group = group;
+    req->generation = cache.generations[group];
+    snprintf(req->key, sizeof(req->key), "%s", key);
+}
 
-    if (execute_and_get_output(cmdbuf, argv, debug))
+static const reply_cache_entry* reply_cache_lookup(const reply_cache_group group, const char* const key)
+{
+    for (int i = 0; i < REPLY_CACHE_SIZE; ++i)
     {
-        memmove(cmdbuf+4, cmdbuf, strlen(cmdbuf)+1);
-        cmdbuf[0] = 'r';
-        cmdbuf[1] = ' ';
-        cmdbuf[2] = '0';
-        cmdbuf[3] = ' ';
+        const reply_cache_entry* const entry = &cache.entries[i];
 
-        if (debug)
-            printf("%s(%p) completed successfully, responding with '%s'\n", __func__, argv, cmdbuf);
+        if (entry->valid && entry->group == group && strcmp(entry->key, key) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+// only successful replies are stored, so bogus requests do not fill the cache
+static void reply_cache_store(const reply_cache_request* const req, const char* const msg)
+{
+    reply_cache_entry* entry = NULL;
 
-        return write_or_close(serialport, cmdbuf);
+    if (! req->enabled || req->generation != cache.generations[req->group])
+        return;
+
+    for (int i = 0; i < REPLY_CACHE_SIZE; ++i)
+    {
+        reply_cache_entry* const e = &cache.entries[i];
+
+        if (e->valid && e->group == req->group && strcmp(e->key, req->key) == 0)
+        {
+            entry = e;
+            break;
+        }
+        if (! e->valid && entry == NULL)
+            entry = e;
     }
 
-    if (debug)
-        printf("%s(%p) failed\n", __func__, argv);
+    if (entry == NULL)
+        return;
+
+    entry->valid = true;
+    entry->group = req->group;
+    snprintf(entry->key, sizeof(entry->key), "%s", req->key);
+    snprintf(entry->msg, sizeof(entry->msg), "%s", msg);
+
+    if (cache.debug)
+        printf("%s: cached '%s' as '%s'\n", __func__, entry->key, entry->msg);
+}
+
+static void reply_cache_invalidate(const int id, const uint32_t events, void* const arg)
+{
+    const reply_cache_group group = (reply_cache_group)(uintptr_t)arg;
+
+    ++cache.generations[group];
+
+    for (int i = 0; i < REPLY_CACHE_SIZE; ++i)
+    {
+        if (cache.entries[i].group == group)
+            cache.entries[i].valid = false;
+    }
+
+    if (cache.debug)
+        printf("%s: backing files changed, dropped cached replies of group %d\n", __func__, (int)group);
 
-    return write_or_close(serialport, "r -1");
+    return;
+
+    // unused
+    (void)id;
+    (void)events;
 }
 
-static bool read_file_and_write_contents_resp(struct sp_port* const serialport, const char* filename, const bool debug)
+static void execute_output_to_reply(const bool success, const char* const output, char respbuf[0xff])
+{
+    // output can be bigger than what fits in a serial message, it gets truncated
+    if (! success)
+        snprintf(respbuf, 0xff, "r -1");
+    else if (output != NULL)
+        snprintf(respbuf, 0xff, "r 0 %s", output);
+    else
+        snprintf(respbuf, 0xff, "r 0");
+}
+
+static void execute_reply_callback(const bool success, const char* const output, void* const arg)
+{
+    const uint32_t slot = (uint32_t)(uintptr_t)arg;
+    char respbuf[0xff];
+
+    execute_output_to_reply(success, output, respbuf);
+
+    if (success)
+        reply_cache_store(&replies.slots[slot % REPLY_MAX_PENDING].cache, respbuf);
+
+    reply_complete(slot, respbuf);
+}
+
+static void execute_prewarm_callback(const bool success, const char* const output, void* const arg)
+{
+    char respbuf[0xff];
+
+    if (! success)
+        return;
+
+    execute_output_to_reply(success, output, respbuf);
+    reply_cache_store(arg, respbuf);
+}
+
+// run a process without blocking serial handling, replying with "r 0" (plus output if requested) or "r -1"
+// a successful reply is cached if req is not NULL
+static bool execute_and_reply_async(struct sp_port* const serialport, const char* argv[], const bool get_output,
+                                    const unsigned int timeout_ms, const reply_cache_request* const req,
+                                    const bool debug)
+{
+    uint32_t slot;
+
+    if (! reply_reserve(serialport, &slot))
+        return write_or_close(serialport, "r -1");
+
+    if (req != NULL)
+        replies.slots[slot % REPLY_MAX_PENDING].cache = *req;
+
+    if (! execute_async(argv, get_output, timeout_ms, execute_reply_callback, (void*)(uintptr_t)slot, debug))
+        reply_complete(slot, "r -1");
+
+    return ! replies.io_error;
+}
+
+static bool read_file_and_write_contents_resp(struct sp_port* const serialport, const char* filename,
+                                              const reply_cache_request* const req, const bool debug)
 {
     char cmdbuf[0xff + 4];
 
@@ -74,13 +306,16 @@ static bool read_file_and_write_contents_resp(struct sp_port* const serialport,
         if (debug)
             printf("%s(%p) completed successfully, responding with '%s'\n", __func__, filename, cmdbuf);
 
-        return write_or_close(serialport, cmdbuf);
+        if (req != NULL)
+            reply_cache_store(req, cmdbuf);
+
+        return write_reply(serialport, cmdbuf);
     }
 
     if (debug)
         printf("%s(%p) failed\n", __func__, filename);
 
-    return write_or_close(serialport, "r -1");
+    return write_reply(serialport, "r -1");
 }
 
 static bool write_int_resp(struct sp_port* const serialport, const int resp, const bool debug)
@@ -92,7 +327,7 @@ static bool write_int_resp(struct sp_port* const serialport, const int resp, con
     if (debug)
         printf("sending response '%s'\n", respbuf);
 
-    return write_or_close(serialport, respbuf);
+    return write_reply(serialport, respbuf);
 }
 
 static bool write_float_resp(struct sp_port* const serialport, const float resp, const bool debug)
@@ -104,392 +339,667 @@ static bool write_float_resp(struct sp_port* const serialport, const float resp,
     if (debug)
         printf("sending response '%s'\n", respbuf);
 
-    return write_or_close(serialport, respbuf);
+    return write_reply(serialport, respbuf);
 }
 
-void create_postponed_messages_thread(const bool debug)
+static bool write_mixer_value_resp(struct sp_port* const serialport, const mixer_control control, const bool debug)
 {
-    sys_host_setup(debug);
-    sys_mixer_setup(debug);
+    char respbuf[MIXER_VALUE_SIZE + 4] = { 'r', ' ', '0', ' ' };
+    float value;
+
+    if (! sys_mixer_get(control, &value))
+    {
+        if (debug)
+            printf("%s(%s) failed\n", __func__, mixer_control_name(control));
+
+        return write_reply(serialport, "r -1");
+    }
+
+    mixer_format_value(control, value, respbuf + 4);
+
+    if (debug)
+        printf("sending response '%s'\n", respbuf);
+
+    return write_reply(serialport, respbuf);
+}
+
+static void reply_cache_prewarm(const int timerfd, const uint32_t events, void* const arg)
+{
+    if (cache.watches[REPLY_CACHE_VERSION] < 0)
+        return;
+
+    for (size_t i = 0; i < sizeof(kVersionKeys)/sizeof(kVersionKeys[0]); ++i)
+    {
+        if (reply_cache_lookup(REPLY_CACHE_VERSION, kVersionKeys[i]) != NULL)
+            continue;
+
+        const char* argv[] = { "mod-version", kVersionKeys[i], NULL };
+
+        reply_cache_request_init(&cache_prewarm_requests[i], REPLY_CACHE_VERSION, kVersionKeys[i]);
+        execute_async(argv, true, VERSION_TIMEOUT_MS, execute_prewarm_callback, &cache_prewarm_requests[i],
+                      cache.debug);
+    }
+
+    return;
+
+    // unused
+    (void)timerfd;
+    (void)events;
+    (void)arg;
+}
+
+static void reply_cache_setup(const bool debug)
+{
+    cache.debug = debug;
+
+    // directories are watched instead of files, as those are usually replaced rather than written in-place
+    // a missing directory (or a failed watch) disables caching for its group, replies are then never stored
+    if (access(SERIAL_NUMBER_DIR, F_OK) == 0)
+        cache.watches[REPLY_CACHE_SERIAL] = event_file_watch_add(SERIAL_NUMBER_DIR, SERIAL_NUMBER_FILE,
+                                                                 reply_cache_invalidate,
+                                                                 (void*)(uintptr_t)REPLY_CACHE_SERIAL);
+
+    if (access(VERSION_DIR, F_OK) == 0)
+        cache.watches[REPLY_CACHE_VERSION] = event_file_watch_add(VERSION_DIR, NULL,
+                                                                  reply_cache_invalidate,
+                                                                  (void*)(uintptr_t)REPLY_CACHE_VERSION);
+
+    // run mod-version from the event loop once it starts, so startup is not delayed by it
+    cache.prewarm_timer = event_timer_create(reply_cache_prewarm, NULL);
+
+    if (cache.prewarm_timer >= 0)
+        event_timer_start(cache.prewarm_timer, 1);
+}
+
+static void reply_cache_destroy(void)
+{
+    for (int i = 0; i < REPLY_CACHE_GROUP_COUNT; ++i)
+    {
+        event_file_watch_remove(cache.watches[i]);
+        cache.watches[i] = -1;
+    }
+
+    if (cache.prewarm_timer >= 0)
+    {
+        event_timer_destroy(cache.prewarm_timer);
+        cache.prewarm_timer = -1;
+    }
 }
 
-void process_postponed_messages(struct sp_port* const serialport)
+void create_postponed_messages_thread(struct sp_port* const serialport, const bool debug)
 {
-    sys_host_process(serialport);
+#ifdef HAVE_SYSTEMD
+    bus_setup(debug);
+#endif
+    sys_host_setup(serialport, debug);
+    sys_mixer_setup(debug);
+    reply_cache_setup(debug);
+    bluetooth_setup(debug);
+    unit_state_setup(debug);
 }
 
 void destroy_postponed_messages_thread(void)
 {
+    unit_state_destroy();
+    bluetooth_destroy();
+    reply_cache_destroy();
     sys_host_destroy();
     sys_mixer_destroy();
+#ifdef HAVE_SYSTEMD
+    bus_destroy();
+#endif
 }
 
-bool parse_and_reply_to_message(struct sp_port* const serialport, char msg[0xff], const bool debug)
+void process_hmi_response(const char* const msg)
 {
-    if (strncmp(msg, CMD_SYS_GAIN, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* argvs = msg + SYS_CMD_ARG_START;
-
-        // parsing arguments
+    sys_host_hmi_response(msg);
+}
 
-        // io 0 = in, 1 = out
-        const bool input = *argvs++ == '0';
-        const char* const io = input ? "in" : "out";
-        argvs++;
+// --------------------------------------------------------------------------------------------------------------------
+// command handlers
+
+typedef enum {
+    CMD_ARG_NONE,
+    CMD_ARG_INT,
+    CMD_ARG_FLOAT,
+    CMD_ARG_STRING,
+} cmd_arg_shape;
+
+// higher priority commands are inserted first into the dispatch table, so they never need probing
+typedef enum {
+    CMD_PRIORITY_LOW,
+    CMD_PRIORITY_NORMAL,
+    CMD_PRIORITY_HIGH,
+} cmd_priority;
+
+typedef struct {
+    // NULL when the message has no value (i.e. it is a query)
+    const char* str;
+    // parsed value, depending on the argument shape of the command
+    int i;
+    float f;
+} cmd_arg;
+
+typedef bool (*cmd_handler)(struct sp_port* serialport, const cmd_arg* arg, bool debug);
+
+static bool handle_gain(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    const char* argvs = arg->str;
 
-        // channel 1, 2 or 0 for both
-        const char channel = *argvs++;
-        const char channelstr[2] = { channel, '\0' };
+    if (argvs == NULL)
+        return write_reply(serialport, "r -1");
 
-        // mixer value (optional)
-        const char* value = NULL;
+    // parsing arguments
 
-        if (*argvs != '\0')
-        {
-            value = ++argvs;
-            sys_mixer_gain(input, channel, value);
-            return write_or_close(serialport, "r 0");
-        }
+    // io 0 = in, 1 = out
+    const bool input = *argvs++ == '0';
+    argvs++;
 
-        const char* argv[] = { "mod-amixer", io, channelstr, "xvol", value, NULL };
+    // channel 1, 2 or 0 for both
+    const char channel = *argvs++;
 
-        return value == NULL ? execute_and_write_output_resp(serialport, argv, debug)
-                             : execute_ignoring_output(serialport, argv, debug);
+    // mixer value (optional)
+    if (*argvs != '\0')
+    {
+        sys_mixer_gain(input, channel, ++argvs);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_HP_GAIN, _CMD_SYS_LENGTH) == 0)
+    // NOTE both channels are always set together, so reading the 1st one is enough
+    return write_mixer_value_resp(serialport, mixer_control_for_gain(input, channel), debug);
+}
+
+static bool handle_hp_gain(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
     {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+        sys_mixer_headphone(arg->str);
+        return write_reply(serialport, "r 0");
+    }
 
-        if (value != NULL)
-        {
-            sys_mixer_headphone(value);
-            return write_or_close(serialport, "r 0");
-        }
+    return write_mixer_value_resp(serialport, MIXER_CONTROL_HP, debug);
+}
 
-        const char* argv[] = { "mod-amixer", "hp", "xvol", value, NULL };
+static bool handle_cv_exp_mode(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
+    {
+        sys_mixer_cv_exp_toggle(arg->str);
+        return write_reply(serialport, "r 0");
+    }
 
-        return value == NULL ? execute_and_write_output_resp(serialport, argv, debug)
-                             : execute_ignoring_output(serialport, argv, debug);
+    return write_mixer_value_resp(serialport, MIXER_CONTROL_CV_EXP, debug);
+}
+
+static bool handle_exp_mode(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
+    {
+        sys_mixer_exp_mode(arg->str);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_CVI_MODE, _CMD_SYS_LENGTH) == 0)
+    return write_mixer_value_resp(serialport, MIXER_CONTROL_EXP_PEDAL, debug);
+}
+
+static bool handle_cv_hp_mode(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
     {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+        sys_mixer_cv_headphone_toggle(arg->str);
+        return write_reply(serialport, "r 0");
+    }
 
-        if (value != NULL)
-        {
-            sys_mixer_cv_exp_toggle(value);
-            return write_or_close(serialport, "r 0");
-        }
+    return write_mixer_value_resp(serialport, MIXER_CONTROL_CV_HP, debug);
+}
 
-        const char* argv[] = { "mod-amixer", "cvexp", NULL };
+static bool handle_amixer_save(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    // acknowledged right away, the actual save happens once mixer changes settle
+    return write_reply(serialport, sys_mixer_save() ? "r 0" : "r -1");
 
-        return execute_and_write_output_resp(serialport, argv, debug);
-    }
+    // unused
+    (void)arg;
+    (void)debug;
+}
+
+static bool handle_bt_status(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    char respbuf[0xff + 4] = { 'r', ' ', '0', ' ' };
 
-    if (strncmp(msg, CMD_SYS_EXP_MODE, _CMD_SYS_LENGTH) == 0)
+    // answer right away from the last known status if we have it
+    if (bluetooth_get_status(respbuf + 4))
     {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+        if (debug)
+            printf("%s: using last known status '%s'\n", __func__, respbuf + 4);
 
-        if (value != NULL)
-        {
-            sys_mixer_exp_mode(value);
-            return write_or_close(serialport, "r 0");
-        }
+        return write_reply(serialport, respbuf);
+    }
 
-        const char* argv[] = { "mod-amixer", "exppedal", NULL };
+    const char* argv[] = { "mod-bluetooth", "hmi", NULL };
 
-        return execute_and_write_output_resp(serialport, argv, debug);
-    }
+    return execute_and_reply_async(serialport, argv, true, BLUETOOTH_TIMEOUT_MS, NULL, debug);
 
-    if (strncmp(msg, CMD_SYS_CVO_MODE, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    // unused
+    (void)arg;
+}
 
-        if (value != NULL)
-        {
-            sys_mixer_cv_headphone_toggle(value);
-            return write_or_close(serialport, "r 0");
-        }
+static bool handle_bt_discovery(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    uint32_t slot;
 
-        const char* argv[] = { "mod-amixer", "cvhp", NULL };
+    if (! reply_reserve(serialport, &slot))
+        return write_or_close(serialport, "r -1");
 
-        return execute_and_write_output_resp(serialport, argv, debug);
-    }
+    if (bluetooth_discovery(BLUETOOTH_TIMEOUT_MS, execute_reply_callback, (void*)(uintptr_t)slot))
+        return ! replies.io_error;
 
-    if (strncmp(msg, CMD_SYS_AMIXER_SAVE, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* argv[] = { "mod-amixer", "save", NULL };
+    const char* argv[] = { "mod-bluetooth", "discovery", NULL };
 
-        return execute_ignoring_output(serialport, argv, debug);
-    }
+    // status is about to change, do not wait for the next periodic refresh
+    bluetooth_refresh();
 
-    if (strncmp(msg, CMD_SYS_BT_STATUS, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* argv[] = { "mod-bluetooth", "hmi", NULL };
+    if (! execute_async(argv, false, BLUETOOTH_TIMEOUT_MS, execute_reply_callback, (void*)(uintptr_t)slot, debug))
+        reply_complete(slot, "r -1");
 
-        return execute_and_write_output_resp(serialport, argv, debug);
-    }
+    return ! replies.io_error;
 
-    if (strncmp(msg, CMD_SYS_BT_DISCOVERY, _CMD_SYS_LENGTH) == 0)
+    // unused
+    (void)arg;
+}
+
+static bool handle_systemctl(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str == NULL)
+        return write_reply(serialport, "r -1");
+
+    uint32_t slot;
+
+    if (! reply_reserve(serialport, &slot))
+        return write_or_close(serialport, "r -1");
+
+    // ask systemd directly if possible, mostly answered from memory
+    if (unit_state_query(arg->str, SYSTEMCTL_TIMEOUT_MS, execute_reply_callback, (void*)(uintptr_t)slot))
+        return ! replies.io_error;
+
+    const char* argv[] = { "systemctl", "is-active", arg->str, NULL };
+
+    if (! execute_async(argv, true, SYSTEMCTL_TIMEOUT_MS, execute_reply_callback, (void*)(uintptr_t)slot, debug))
+        reply_complete(slot, "r -1");
+
+    return ! replies.io_error;
+}
+
+static bool handle_version(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str == NULL)
+        return write_reply(serialport, "r -1");
+
+    const reply_cache_entry* const entry = reply_cache_lookup(REPLY_CACHE_VERSION, arg->str);
+
+    if (entry != NULL)
     {
-        const char* argv[] = { "mod-bluetooth", "discovery", NULL };
+        if (debug)
+            printf("%s: using cached reply '%s'\n", __func__, entry->msg);
 
-        return execute_ignoring_output(serialport, argv, debug);
+        return write_reply(serialport, entry->msg);
     }
 
-    if (strncmp(msg, CMD_SYS_SYSTEMCTL, _CMD_SYS_LENGTH) == 0)
+    const char* argv[] = { "mod-version", arg->str, NULL };
+    reply_cache_request req;
+
+    // arguments too long for a cache key are not something the HMI sends, just run those
+    if (strlen(arg->str) >= sizeof(req.key))
+        return execute_and_reply_async(serialport, argv, true, VERSION_TIMEOUT_MS, NULL, debug);
+
+    reply_cache_request_init(&req, REPLY_CACHE_VERSION, arg->str);
+
+    return execute_and_reply_async(serialport, argv, true, VERSION_TIMEOUT_MS, &req, debug);
+}
+
+static bool handle_serial(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    const reply_cache_entry* const entry = reply_cache_lookup(REPLY_CACHE_SERIAL, "");
+
+    if (entry != NULL)
     {
-        const char* argv[] = { "systemctl", "is-active", msg + SYS_CMD_ARG_START, NULL };
+        if (debug)
+            printf("%s: using cached reply '%s'\n", __func__, entry->msg);
 
-        return execute_and_write_output_resp(serialport, argv, debug);
+        return write_reply(serialport, entry->msg);
     }
 
-    if (strncmp(msg, CMD_SYS_VERSION, _CMD_SYS_LENGTH) == 0)
+    reply_cache_request req;
+    reply_cache_request_init(&req, REPLY_CACHE_SERIAL, "");
+
+    return read_file_and_write_contents_resp(serialport, SERIAL_NUMBER_DIR "/" SERIAL_NUMBER_FILE, &req, debug);
+
+    // unused
+    (void)arg;
+}
+
+static bool handle_usb_mode(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    // changing to new mode
+    if (arg->str != NULL)
     {
-        const char* argv[] = { "mod-version", msg + SYS_CMD_ARG_START, NULL };
+        switch (arg->i)
+        {
+        case 0:
+            delete_file("/data/enable-usb-multi-gadget", debug);
+            delete_file("/data/enable-usb-windows-compat", debug);
+            break;
+        case 1:
+            create_file("/data/enable-usb-multi-gadget", debug);
+            delete_file("/data/enable-usb-windows-compat", debug);
+            break;
+        case 2:
+            create_file("/data/enable-usb-multi-gadget", debug);
+            create_file("/data/enable-usb-windows-compat", debug);
+            break;
+        }
 
-        return execute_and_write_output_resp(serialport, argv, debug);
+        printf("%s: usb mode set to %d, sending 'r 0'\n", __func__, arg->i);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_SERIAL, _CMD_SYS_LENGTH) == 0)
+    // reading current mode
+    char mode = '0';
+
+    if (access("/data/enable-usb-multi-gadget", F_OK) == 0)
     {
-        return read_file_and_write_contents_resp(serialport, "/var/cache/mod/tag", debug);
+        if (access("/data/enable-usb-windows-compat", F_OK) == 0)
+            mode = '2';
+        else
+            mode = '1';
     }
 
-    if (strncmp(msg, CMD_SYS_USB_MODE, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    char respbuf[6] = {
+        'r', ' ', '0', ' ', mode, '\0'
+    };
 
-        // changing to new mode
-        if (value != NULL)
-        {
-            const char mode = *value;
-
-            switch (mode)
-            {
-            case '0':
-                delete_file("/data/enable-usb-multi-gadget", debug);
-                delete_file("/data/enable-usb-windows-compat", debug);
-                break;
-            case '1':
-                create_file("/data/enable-usb-multi-gadget", debug);
-                delete_file("/data/enable-usb-windows-compat", debug);
-                break;
-            case '2':
-                create_file("/data/enable-usb-multi-gadget", debug);
-                create_file("/data/enable-usb-windows-compat", debug);
-                break;
-            }
-
-            printf("%s: usb mode set to %c, sending 'r 0'\n", __func__, mode);
-            return write_or_close(serialport, "r 0");
-        }
-        // reading current mode
-        else
+    printf("%s: usb mode request, sending '%s'\n", __func__, respbuf);
+    return write_reply(serialport, respbuf);
+}
+
+static bool handle_noise_removal(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    // changing to new mode
+    if (arg->str != NULL)
+    {
+        switch (arg->i)
         {
-            char mode = '0';
-
-            if (access("/data/enable-usb-multi-gadget", F_OK) == 0)
-            {
-                if (access("/data/enable-usb-windows-compat", F_OK) == 0)
-                    mode = '2';
-                else
-                    mode = '1';
-            }
-
-            char respbuf[6] = {
-                'r', ' ', '0', ' ', mode, '\0'
-            };
-
-            printf("%s: usb mode request, sending '%s'\n", __func__, respbuf);
-            return write_or_close(serialport, respbuf);
+        case 0:
+            delete_file("/data/noise-removal-active", debug);
+            break;
+        case 1:
+            create_file("/data/noise-removal-active", debug);
+            break;
         }
+
+        printf("%s: noise-removal mode set to %d, sending 'r 0'\n", __func__, arg->i);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_NOISE_REMOVAL, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    // reading current mode
+    char mode;
 
-        // changing to new mode
-        if (value != NULL)
-        {
-            const char mode = *value;
-
-            switch (mode)
-            {
-            case '0':
-                delete_file("/data/noise-removal-active", debug);
-                break;
-            case '1':
-                create_file("/data/noise-removal-active", debug);
-                break;
-            }
-
-            printf("%s: noise-removal mode set to %c, sending 'r 0'\n", __func__, mode);
-            return write_or_close(serialport, "r 0");
-        }
-        // reading current mode
-        else
-        {
-            char mode;
+    if (access("/data/noise-removal-active", F_OK) == 0)
+        mode = '1';
+    else
+        mode = '0';
 
-            if (access("/data/noise-removal-active", F_OK) == 0)
-                mode = '1';
-            else
-                mode = '0';
+    char respbuf[6] = {
+        'r', ' ', '0', ' ', mode, '\0'
+    };
 
-            char respbuf[6] = {
-                'r', ' ', '0', ' ', mode, '\0'
-            };
+    printf("%s: noise-removal mode request, sending '%s'\n", __func__, respbuf);
+    return write_reply(serialport, respbuf);
+}
 
-            printf("%s: usb mode request, sending '%s'\n", __func__, respbuf);
-            return write_or_close(serialport, respbuf);
-        }
-    }
+static bool handle_reboot(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    // HMI is useless after this point, so print resp asap and move on with the reboot
+    write_reply(serialport, "r 0");
+    serial_tx_flush();
 
-    if (strncmp(msg, CMD_SYS_REBOOT, _CMD_SYS_LENGTH) == 0)
-    {
-        // HMI is useless after this point, so print resp asap and move on with the reboot
-        write_or_close(serialport, "r 0");
+    const char* argv_hmi_reset[] = { "hmi-reset", NULL };
+    const char* argv_reboot[] = { "reboot", NULL };
 
-        const char* argv_hmi_reset[] = { "hmi-reset", NULL };
-        const char* argv_reboot[] = { "reboot", NULL };
+    execute(argv_hmi_reset, debug);
+    execute(argv_reboot, debug);
+    return true;
 
-        execute(argv_hmi_reset, debug);
-        execute(argv_reboot, debug);
-        return true;
-    }
+    // unused
+    (void)arg;
+}
 
-    if (strncmp(msg, CMD_SYS_COMP_MODE, _CMD_SYS_LENGTH) == 0)
+static bool handle_comp_mode(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
     {
-        const char* const mode = strlen(msg) > SYS_CMD_ARG_START
-                               ? msg + SYS_CMD_ARG_START
-                               : NULL;
+        sys_host_set_compressor_mode(arg->i);
+        return write_reply(serialport, "r 0");
+    }
 
-        if (mode != NULL)
-        {
-            sys_host_set_compressor_mode(atoi(mode));
-            return write_or_close(serialport, "r 0");
-        }
+    return write_int_resp(serialport, sys_host_get_compressor_mode(), debug);
+}
 
-        return write_int_resp(serialport, sys_host_get_compressor_mode(), debug);
+static bool handle_comp_release(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
+    {
+        sys_host_set_compressor_release(arg->f);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_COMP_RELEASE, _CMD_SYS_LENGTH) == 0)
+    return write_int_resp(serialport, sys_host_get_compressor_release(), debug);
+}
+
+static bool handle_ng_channel(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
     {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+        sys_host_set_noisegate_channel(arg->i);
+        return write_reply(serialport, "r 0");
+    }
 
-        if (value != NULL)
-        {
-            sys_host_set_compressor_release(atof(value));
-            return write_or_close(serialport, "r 0");
-        }
+    return write_int_resp(serialport, sys_host_get_noisegate_channel(), debug);
+}
 
-        return write_int_resp(serialport, sys_host_get_compressor_release(), debug);
+static bool handle_ng_threshold(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
+    {
+        sys_host_set_noisegate_threshold(arg->f);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_NG_CHANNEL, _CMD_SYS_LENGTH) == 0)
+    return write_float_resp(serialport, sys_host_get_noisegate_threshold(), debug);
+}
+
+static bool handle_ng_decay(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
     {
-        const char* const channel = strlen(msg) > SYS_CMD_ARG_START
-                                  ? msg + SYS_CMD_ARG_START
-                                  : NULL;
+        sys_host_set_noisegate_decay(arg->f);
+        return write_reply(serialport, "r 0");
+    }
 
-        if (channel != NULL)
-        {
-            sys_host_set_noisegate_channel(atoi(channel));
-            return write_or_close(serialport, "r 0");
-        }
+    return write_int_resp(serialport, sys_host_get_noisegate_decay(), debug);
+}
 
-        return write_int_resp(serialport, sys_host_get_noisegate_channel(), debug);
+static bool handle_pedalboard_gain(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str != NULL)
+    {
+        sys_host_set_pedalboard_gain(arg->f);
+        return write_reply(serialport, "r 0");
     }
 
-    if (strncmp(msg, CMD_SYS_NG_THRESHOLD, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    return write_float_resp(serialport, sys_host_get_pedalboard_gain(), debug);
+}
 
-        if (value != NULL)
-        {
-            sys_host_set_noisegate_threshold(atof(value));
-            return write_or_close(serialport, "r 0");
-        }
+static bool handle_page_change(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str == NULL)
+        return write_reply(serialport, "r -1");
 
-        return write_float_resp(serialport, sys_host_get_noisegate_threshold(), debug);
-    }
+    sys_host_set_hmi_page(arg->i);
+    return write_reply(serialport, "r 0");
 
-    if (strncmp(msg, CMD_SYS_NG_DECAY, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    // unused
+    (void)debug;
+}
 
-        if (value != NULL)
-        {
-            sys_host_set_noisegate_decay(atof(value));
-            return write_or_close(serialport, "r 0");
-        }
+static bool handle_subpage_change(struct sp_port* const serialport, const cmd_arg* const arg, const bool debug)
+{
+    if (arg->str == NULL)
+        return write_reply(serialport, "r -1");
 
-        return write_int_resp(serialport, sys_host_get_noisegate_decay(), debug);
-    }
+    sys_host_set_hmi_subpage(arg->i);
+    return write_reply(serialport, "r 0");
 
-    if (strncmp(msg, CMD_SYS_COMP_PEDALBOARD_GAIN, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    // unused
+    (void)debug;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// command dispatch
+
+typedef struct {
+    const char* cmd;
+    cmd_handler handler;
+    cmd_arg_shape shape;
+    cmd_priority priority;
+} cmd_entry;
+
+static const cmd_entry kCommands[] = {
+    { CMD_SYS_GAIN,                 handle_gain,            CMD_ARG_STRING, CMD_PRIORITY_HIGH   },
+    { CMD_SYS_HP_GAIN,              handle_hp_gain,         CMD_ARG_FLOAT,  CMD_PRIORITY_HIGH   },
+    { CMD_SYS_PAGE_CHANGE,          handle_page_change,     CMD_ARG_INT,    CMD_PRIORITY_HIGH   },
+    { CMD_SYS_SUBPAGE_CHANGE,       handle_subpage_change,  CMD_ARG_INT,    CMD_PRIORITY_HIGH   },
+    { CMD_SYS_COMP_PEDALBOARD_GAIN, handle_pedalboard_gain, CMD_ARG_FLOAT,  CMD_PRIORITY_HIGH   },
+    { CMD_SYS_CVI_MODE,             handle_cv_exp_mode,     CMD_ARG_INT,    CMD_PRIORITY_NORMAL },
+    { CMD_SYS_EXP_MODE,             handle_exp_mode,        CMD_ARG_INT,    CMD_PRIORITY_NORMAL },
+    { CMD_SYS_CVO_MODE,             handle_cv_hp_mode,      CMD_ARG_INT,    CMD_PRIORITY_NORMAL },
+    { CMD_SYS_COMP_MODE,            handle_comp_mode,       CMD_ARG_INT,    CMD_PRIORITY_NORMAL },
+    { CMD_SYS_COMP_RELEASE,         handle_comp_release,    CMD_ARG_FLOAT,  CMD_PRIORITY_NORMAL },
+    { CMD_SYS_NG_CHANNEL,           handle_ng_channel,      CMD_ARG_INT,    CMD_PRIORITY_NORMAL },
+    { CMD_SYS_NG_THRESHOLD,         handle_ng_threshold,    CMD_ARG_FLOAT,  CMD_PRIORITY_NORMAL },
+    { CMD_SYS_NG_DECAY,             handle_ng_decay,        CMD_ARG_FLOAT,  CMD_PRIORITY_NORMAL },
+    { CMD_SYS_BT_STATUS,            handle_bt_status,       CMD_ARG_NONE,   CMD_PRIORITY_NORMAL },
+    { CMD_SYS_BT_DISCOVERY,         handle_bt_discovery,    CMD_ARG_NONE,   CMD_PRIORITY_NORMAL },
+    { CMD_SYS_SYSTEMCTL,            handle_systemctl,       CMD_ARG_STRING, CMD_PRIORITY_NORMAL },
+    { CMD_SYS_USB_MODE,             handle_usb_mode,        CMD_ARG_INT,    CMD_PRIORITY_LOW    },
+    { CMD_SYS_NOISE_REMOVAL,        handle_noise_removal,   CMD_ARG_INT,    CMD_PRIORITY_LOW    },
+    { CMD_SYS_AMIXER_SAVE,          handle_amixer_save,     CMD_ARG_NONE,   CMD_PRIORITY_LOW    },
+    { CMD_SYS_VERSION,              handle_version,         CMD_ARG_STRING, CMD_PRIORITY_LOW    },
+    { CMD_SYS_SERIAL,               handle_serial,          CMD_ARG_NONE,   CMD_PRIORITY_LOW    },
+    { CMD_SYS_REBOOT,               handle_reboot,          CMD_ARG_NONE,   CMD_PRIORITY_LOW    },
+};
+
+#define CMD_NUM_ENTRIES (sizeof(kCommands)/sizeof(kCommands[0]))
+
+// open-addressed hash table keyed on the 3 command bytes after "sys_", must be a power of 2
+#define CMD_TABLE_SIZE 64
+#define CMD_TABLE_BITS 6
+
+static const cmd_entry* cmd_table[CMD_TABLE_SIZE];
+static uint32_t cmd_table_keys[CMD_TABLE_SIZE];
+static bool cmd_table_ready = false;
+
+#define CMD_PREFIX_LENGTH (sizeof(_CMD_SYS_PREFIX) - 1)
+
+static inline uint32_t cmd_key(const char* const cmd)
+{
+    return (uint32_t)(uint8_t)cmd[CMD_PREFIX_LENGTH]
+         | (uint32_t)(uint8_t)cmd[CMD_PREFIX_LENGTH + 1] << 8
+         | (uint32_t)(uint8_t)cmd[CMD_PREFIX_LENGTH + 2] << 16;
+}
+
+static inline uint32_t cmd_hash(const uint32_t key)
+{
+    return (key * 2654435761u) >> (32 - CMD_TABLE_BITS);
+}
 
-        if (value != NULL)
+static void cmd_table_init(void)
+{
+    memset(cmd_table, 0, sizeof(cmd_table));
+
+    // insert by priority, so hot commands are found in their first slot
+    for (int prio = CMD_PRIORITY_HIGH; prio >= CMD_PRIORITY_LOW; --prio)
+    {
+        for (size_t i = 0; i < CMD_NUM_ENTRIES; ++i)
         {
-            sys_host_set_pedalboard_gain(atof(value));
-            return write_or_close(serialport, "r 0");
-        }
+            if (kCommands[i].priority != (cmd_priority)prio)
+                continue;
+
+            const uint32_t key = cmd_key(kCommands[i].cmd);
+            uint32_t slot = cmd_hash(key);
 
-        return write_float_resp(serialport, sys_host_get_pedalboard_gain(), debug);
+            while (cmd_table[slot] != NULL)
+                slot = (slot + 1) & (CMD_TABLE_SIZE - 1);
+
+            cmd_table[slot] = &kCommands[i];
+            cmd_table_keys[slot] = key;
+        }
     }
 
-    if (strncmp(msg, CMD_SYS_PAGE_CHANGE, _CMD_SYS_LENGTH) == 0)
-    {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+    cmd_table_ready = true;
+}
+
+static const cmd_entry* cmd_lookup(const char* const msg)
+{
+    if (strncmp(msg, _CMD_SYS_PREFIX, CMD_PREFIX_LENGTH) != 0)
+        return NULL;
+
+    // command codes are fixed size, followed by either a space or the end of the message
+    if (msg[_CMD_SYS_LENGTH] != ' ' && msg[_CMD_SYS_LENGTH] != '\0')
+        return NULL;
 
-        if (value == NULL)
-            return write_or_close(serialport, "r -1");
+    const uint32_t key = cmd_key(msg);
 
-        sys_host_set_hmi_page(atoi(value));
-        return write_or_close(serialport, "r 0");
+    for (uint32_t slot = cmd_hash(key); cmd_table[slot] != NULL; slot = (slot + 1) & (CMD_TABLE_SIZE - 1))
+    {
+        if (cmd_table_keys[slot] == key)
+            return cmd_table[slot];
     }
 
-    if (strncmp(msg, CMD_SYS_SUBPAGE_CHANGE, _CMD_SYS_LENGTH) == 0)
+    return NULL;
+}
+
+bool parse_and_reply_to_message(struct sp_port* const serialport, char msg[0xff], const bool debug)
+{
+    if (! cmd_table_ready)
+        cmd_table_init();
+
+    const cmd_entry* const entry = cmd_lookup(msg);
+
+    if (entry == NULL)
     {
-        const char* const value = strlen(msg) > SYS_CMD_ARG_START
-                                ? msg + SYS_CMD_ARG_START
-                                : NULL;
+        fprintf(stderr, "%s: unknown message '%s'\n", __func__, msg);
+        return write_reply(serialport, "r -1");
+    }
 
-        if (value == NULL)
-            return write_or_close(serialport, "r -1");
+    cmd_arg arg = { NULL, 0, 0.f };
 
-        sys_host_set_hmi_subpage(atoi(value));
-        return write_or_close(serialport, "r 0");
+    if (entry->shape != CMD_ARG_NONE && strlen(msg) > SYS_CMD_ARG_START)
+    {
+        arg.str = msg + SYS_CMD_ARG_START;
+
+        switch (entry->shape)
+        {
+        case CMD_ARG_INT:
+            arg.i = atoi(arg.str);
+            break;
+        case CMD_ARG_FLOAT:
+            arg.f = atof(arg.str);
+            break;
+        default:
+            break;
+        }
     }
 
-    fprintf(stderr, "%s: unknown message '%s'\n", __func__, msg);
-    return write_or_close(serialport, "r -1");
+    return entry->handler(serialport, &arg, debug);
 }
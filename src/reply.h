@@ -8,10 +8,14 @@
 
 #include <stdbool.h>
 
-// calls write_or_close as final step
+// calls write_or_close as final step, or later on from the event loop for commands that run external tools
+// replies are always written in the same order as messages are received
 // if this function returns false, serial is no longer valid
 bool parse_and_reply_to_message(struct sp_port* serialport, char msg[0xff], bool debug);
 
-void create_postponed_messages_thread(bool debug);
-void process_postponed_messages(struct sp_port* serialport);
+// NOTE requires event loop to be initialized
+void create_postponed_messages_thread(struct sp_port* serialport, bool debug);
 void destroy_postponed_messages_thread(void);
+
+// handle a response from the HMI to one of our own messages
+void process_hmi_response(const char* msg);
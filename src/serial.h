@@ -4,4 +4,35 @@
 
 #pragma once
 
+#ifdef SERIAL_BACKEND_TERMIOS
+// subset of the libserialport API, implemented directly on top of termios in serial_termios.c
+#include <stddef.h>
+
+enum sp_return {
+    SP_OK = 0,
+    SP_ERR_ARG = -1,
+    SP_ERR_FAIL = -2,
+    SP_ERR_MEM = -3,
+    SP_ERR_SUPP = -4,
+};
+
+enum sp_buffer {
+    SP_BUF_INPUT = 1,
+    SP_BUF_OUTPUT = 2,
+    SP_BUF_BOTH = 3,
+};
+
+struct sp_port;
+
+enum sp_return sp_blocking_read(struct sp_port* port, void* buf, size_t count, unsigned int timeout_ms);
+enum sp_return sp_nonblocking_read(struct sp_port* port, void* buf, size_t count);
+enum sp_return sp_blocking_write(struct sp_port* port, const void* buf, size_t count, unsigned int timeout_ms);
+enum sp_return sp_nonblocking_write(struct sp_port* port, const void* buf, size_t count);
+enum sp_return sp_flush(struct sp_port* port, enum sp_buffer buffers);
+enum sp_return sp_get_port_handle(const struct sp_port* port, void* result_ptr);
+enum sp_return sp_close(struct sp_port* port);
+void sp_free_port(struct sp_port* port);
+const char* sp_get_lib_version_string(void);
+#else
 #include <libserialport.h>
+#endif
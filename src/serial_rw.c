@@ -3,6 +3,7 @@
  */
 
 #include "serial_rw.h"
+#include "event_loop.h"
 
 #include "../mod-controller-proto/mod-protocol.h"
 
@@ -12,15 +13,193 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 // in ms
 #define SP_BLOCKING_READ_TIMEOUT 40
 
+// number of messages that fit in the outgoing queue, must be a power of 2
+#define SERIAL_TX_QUEUE_SIZE 128
+#define SERIAL_TX_QUEUE_MASK (SERIAL_TX_QUEUE_SIZE - 1)
+
+// biggest possible message, "r 0 " prefix plus 0xff bytes of data
+#define SERIAL_TX_MSG_SIZE (0xff + 5)
+
+// max number of messages written in a single call
+#define SERIAL_TX_IOV_MAX 64
+
+typedef struct serial_tx_msg {
+    uint16_t size;
+    char data[SERIAL_TX_MSG_SIZE];
+} serial_tx_msg;
+
+static struct serial_tx {
+    struct sp_port* serialport;
+    int fd;
+    bool pollout;
+    // queue indexes are free-running and masked on access
+    uint32_t head, tail;
+    // bytes already written of the message at tail
+    uint32_t offset;
+    serial_tx_msg msgs[SERIAL_TX_QUEUE_SIZE];
+} s_tx = { .fd = -1 };
+
 static inline int imax(const int a, const int b)
 {
     return a > b ? a : b;
 }
 
+#define SERIAL_RX_BUFFER_MASK (SERIAL_RX_BUFFER_SIZE - 1)
+
+_Static_assert((SERIAL_RX_BUFFER_SIZE & SERIAL_RX_BUFFER_MASK) == 0, "rx buffer size must be a power of 2");
+
+static bool serial_msg_is_valid(const char* const buf, const uint32_t len, const bool debug)
+{
+    // responses to our own messages
+    if (serial_msg_is_response(buf))
+        return true;
+
+    // check if message is valid
+    if (len < _CMD_SYS_LENGTH || strncmp(buf, _CMD_SYS_PREFIX, strlen(_CMD_SYS_PREFIX)) != 0)
+    {
+        if (debug)
+            fprintf(stderr, "%s failed, invalid command '%s' received\n", __func__, buf);
+        else
+            fprintf(stderr, "%s failed, invalid command received\n", __func__);
+        return false;
+    }
+
+    // message only has command
+    if (len == _CMD_SYS_LENGTH)
+        return true;
+
+    if (buf[_CMD_SYS_LENGTH] != ' ')
+    {
+        fprintf(stderr, "%s failed, command is missing space delimiter\n", __func__);
+        return false;
+    }
+
+    if (len < _CMD_SYS_LENGTH + _CMD_SYS_DATA_LENGTH + 2 || buf[_CMD_SYS_LENGTH + _CMD_SYS_DATA_LENGTH + 1] != ' ')
+    {
+        fprintf(stderr, "%s failed, command data size is incomplete\n", __func__);
+        return false;
+    }
+
+    // check that data size is correct
+    char data_size_str[_CMD_SYS_DATA_LENGTH + 1];
+    memcpy(data_size_str, buf + _CMD_SYS_LENGTH + 1, _CMD_SYS_DATA_LENGTH);
+    data_size_str[_CMD_SYS_DATA_LENGTH] = '\0';
+
+    const long int data_size = strtol(data_size_str, NULL, 16);
+
+    if (data_size <= 0 || data_size != (long int)(len - _CMD_SYS_LENGTH - _CMD_SYS_DATA_LENGTH - 2))
+    {
+        fprintf(stderr, "%s failed, incorrect command data size '%s'\n", __func__, data_size_str);
+        return false;
+    }
+
+    return true;
+}
+
+void serial_rx_init(serial_rx* const rx)
+{
+    rx->head = rx->tail = rx->scanned = 0;
+}
+
+int serial_rx_fill(struct sp_port* const serialport, serial_rx* const rx)
+{
+    const uint32_t used = rx->head - rx->tail;
+
+    // buffer is full, needs to be parsed first
+    if (used == SERIAL_RX_BUFFER_SIZE)
+        return 0;
+
+    // read into the contiguous free space after head
+    const uint32_t offset = rx->head & SERIAL_RX_BUFFER_MASK;
+    uint32_t size = SERIAL_RX_BUFFER_SIZE - used;
+
+    if (size > SERIAL_RX_BUFFER_SIZE - offset)
+        size = SERIAL_RX_BUFFER_SIZE - offset;
+
+    const enum sp_return ret = sp_nonblocking_read(serialport, rx->buffer + offset, size);
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "%s failed, serial read error %d\n", __func__, ret);
+        return SP_READ_ERROR_IO;
+    }
+
+    rx->head += (uint32_t)ret;
+    return ret;
+}
+
+sp_read_error_status serial_rx_next_msg(serial_rx* const rx, char buf[0xff], const bool debug)
+{
+    uint32_t end, len, offset;
+
+    // skip null bytes between messages
+    while (rx->tail != rx->head && rx->buffer[rx->tail & SERIAL_RX_BUFFER_MASK] == '\0')
+        ++rx->tail;
+
+    if (rx->tail == rx->head)
+    {
+        rx->scanned = rx->tail;
+        return SP_READ_ERROR_NO_DATA;
+    }
+
+    // look for the message terminator, resuming from where the previous call stopped
+    end = rx->scanned - rx->tail <= rx->head - rx->tail ? rx->scanned : rx->tail;
+
+    for (; end != rx->head; ++end)
+    {
+        if (rx->buffer[end & SERIAL_RX_BUFFER_MASK] == '\0')
+            break;
+    }
+
+    if (end == rx->head)
+    {
+        rx->scanned = end;
+
+        // a valid message always fits in 0xff bytes, so drop data if we are past that
+        if (end - rx->tail >= 0xff)
+        {
+            fprintf(stderr, "%s failed, message is too big, discarding %u bytes\n", __func__, end - rx->tail);
+            rx->tail = end;
+            return SP_READ_ERROR_INVALID_DATA;
+        }
+
+        return SP_READ_ERROR_NO_DATA;
+    }
+
+    len = end - rx->tail;
+
+    if (len >= 0xff)
+    {
+        fprintf(stderr, "%s failed, message is too big, discarding %u bytes\n", __func__, len);
+        rx->tail = rx->scanned = end + 1;
+        return SP_READ_ERROR_INVALID_DATA;
+    }
+
+    // copy message out of the ring-buffer, in 2 parts if wrapping around
+    offset = rx->tail & SERIAL_RX_BUFFER_MASK;
+
+    if (offset + len > SERIAL_RX_BUFFER_SIZE)
+    {
+        const uint32_t firstpart = SERIAL_RX_BUFFER_SIZE - offset;
+        memcpy(buf, rx->buffer + offset, firstpart);
+        memcpy(buf + firstpart, rx->buffer, len - firstpart);
+    }
+    else
+    {
+        memcpy(buf, rx->buffer + offset, len);
+    }
+
+    buf[len] = '\0';
+    rx->tail = rx->scanned = end + 1;
+
+    return serial_msg_is_valid(buf, len, debug) ? (int)len : SP_READ_ERROR_INVALID_DATA;
+}
+
 sp_read_error_status serial_read_msg_until_zero(struct sp_port* const serialport, char buf[0xff], const bool debug)
 {
     unsigned int reading_offset;
@@ -206,15 +385,208 @@ sp_read_error_status serial_read_ignore_until_zero(struct sp_port* serialport)
     }
 }
 
+static void serial_tx_set_pollout(const bool pollout)
+{
+    if (s_tx.pollout == pollout)
+        return;
+
+    s_tx.pollout = pollout;
+    event_loop_modify(s_tx.fd, pollout ? EPOLLIN|EPOLLOUT : EPOLLIN);
+}
+
+// serial is gone or the HMI stopped reading, nothing queued can be delivered anymore
+// the fd is forgotten before closing, as its number gets reused right away by pipes and timers
+// stopping the event loop makes us quit, so systemd restarts us with a fresh serial
+static void serial_tx_close(void)
+{
+    struct sp_port* const serialport = s_tx.serialport;
+
+    if (s_tx.fd >= 0)
+        event_loop_remove(s_tx.fd);
+
+    serial_tx_detach();
+    s_tx.head = s_tx.tail = s_tx.offset = 0;
+
+    sp_close(serialport);
+    event_loop_stop();
+}
+
+static bool serial_tx_enqueue(const char* const msg, const size_t size)
+{
+    if (size > SERIAL_TX_MSG_SIZE)
+    {
+        fprintf(stderr, "%s failed, message is too big\n", __func__);
+        return true;
+    }
+
+    // queue is full, try to make some room
+    if (s_tx.head - s_tx.tail == SERIAL_TX_QUEUE_SIZE)
+    {
+        if (! serial_tx_flush())
+            return false;
+
+        // replies are never dropped, as the HMI pairs them with its requests
+        if (s_tx.head - s_tx.tail == SERIAL_TX_QUEUE_SIZE)
+        {
+            if (serial_msg_is_response(msg))
+            {
+                fprintf(stderr, "%s failed, queue is full and the HMI is not reading, closing serial\n", __func__);
+                serial_tx_close();
+                return false;
+            }
+
+            fprintf(stderr, "%s failed, queue is full, dropping message\n", __func__);
+            return true;
+        }
+    }
+
+    serial_tx_msg* const txmsg = &s_tx.msgs[s_tx.head & SERIAL_TX_QUEUE_MASK];
+    memcpy(txmsg->data, msg, size);
+    txmsg->size = (uint16_t)size;
+    ++s_tx.head;
+
+    serial_tx_set_pollout(true);
+    return true;
+}
+
+bool serial_tx_attach(struct sp_port* const serialport)
+{
+    int fd = -1;
+
+    // vectored writes need the fd, otherwise we write messages one by one
+    if (sp_get_port_handle(serialport, &fd) != SP_OK)
+        fd = -1;
+
+    s_tx.serialport = serialport;
+    s_tx.fd = fd;
+    s_tx.pollout = false;
+    s_tx.head = s_tx.tail = s_tx.offset = 0;
+    return true;
+}
+
+void serial_tx_detach(void)
+{
+    serial_tx_set_pollout(false);
+
+    s_tx.serialport = NULL;
+    s_tx.fd = -1;
+}
+
+bool serial_tx_flush(void)
+{
+    struct iovec iov[SERIAL_TX_IOV_MAX];
+    ssize_t written;
+    uint32_t count, i;
+
+    if (s_tx.serialport == NULL)
+        return true;
+
+    while (s_tx.head != s_tx.tail)
+    {
+        count = s_tx.head - s_tx.tail;
+
+        if (count > SERIAL_TX_IOV_MAX)
+            count = SERIAL_TX_IOV_MAX;
+
+        for (i = 0; i < count; ++i)
+        {
+            serial_tx_msg* const txmsg = &s_tx.msgs[(s_tx.tail + i) & SERIAL_TX_QUEUE_MASK];
+            const uint32_t offset = i == 0 ? s_tx.offset : 0;
+
+            iov[i].iov_base = txmsg->data + offset;
+            iov[i].iov_len = txmsg->size - offset;
+        }
+
+        if (s_tx.fd >= 0)
+        {
+            written = writev(s_tx.fd, iov, (int)count);
+
+            if (written < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+
+                fprintf(stderr, "%s failed, write error: %s\n", __func__, strerror(errno));
+
+                if (errno == EIO)
+                {
+                    serial_tx_close();
+                    return false;
+                }
+
+                break;
+            }
+        }
+        else
+        {
+            errno = 0;
+            written = sp_nonblocking_write(s_tx.serialport, iov[0].iov_base, iov[0].iov_len);
+
+            if (written < 0)
+            {
+                if (written == SP_ERR_FAIL && errno == EIO)
+                {
+                    serial_tx_close();
+                    return false;
+                }
+
+                break;
+            }
+        }
+
+        // nothing could be written, try again when fd is writable
+        if (written == 0)
+            break;
+
+        // advance over fully written messages, keeping track of a partial one
+        for (i = 0; i < count && written > 0; ++i)
+        {
+            const size_t len = iov[i].iov_len;
+
+            if ((size_t)written < len)
+            {
+                s_tx.offset += (uint32_t)written;
+                break;
+            }
+
+            written -= (ssize_t)len;
+            s_tx.offset = 0;
+            ++s_tx.tail;
+        }
+
+        if (s_tx.offset != 0)
+            break;
+    }
+
+    serial_tx_set_pollout(s_tx.head != s_tx.tail);
+    return true;
+}
+
+uint32_t serial_tx_queue_depth(void)
+{
+    return s_tx.head - s_tx.tail;
+}
+
 bool write_or_close(struct sp_port* serialport, const char* const msg)
 {
+    const size_t size = strlen(msg)+1;
+
+    if (serialport == s_tx.serialport)
+        return serial_tx_enqueue(msg, size);
+
     errno = 0;
-    if (sp_nonblocking_write(serialport, msg, strlen(msg)+1) == -SP_ERR_FAIL && errno == EIO)
+    const enum sp_return ret = sp_nonblocking_write(serialport, msg, size);
+
+    if (ret == SP_ERR_FAIL && errno == EIO)
     {
         sp_close(serialport);
         return false;
     }
 
+    // write the remaining part of the message, so it does not get truncated
+    if (ret >= 0 && (size_t)ret < size)
+        sp_blocking_write(serialport, msg + ret, size - (size_t)ret, SP_BLOCKING_READ_TIMEOUT);
+
     return true;
 }
 
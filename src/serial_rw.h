@@ -19,13 +19,54 @@ typedef enum sp_read_error_status {
     SP_READ_ERROR_IO = -3,
 } sp_read_error_status;
 
+// size of the serial read-ahead buffer, must be a power of 2
+#define SERIAL_RX_BUFFER_SIZE 4096
+
+typedef struct serial_rx {
+    // ring-buffer storage, indexes are free-running and masked on access
+    char buffer[SERIAL_RX_BUFFER_SIZE];
+    uint32_t head, tail;
+    // parser state, position up to which we already looked for a null byte
+    uint32_t scanned;
+} serial_rx;
+
+// check if a message read with serial_rx_next_msg is a response (e.g. "r 0") instead of a command
+static inline bool serial_msg_is_response(const char* const msg)
+{
+    return msg[0] == 'r' && msg[1] == ' ';
+}
+
+void serial_rx_init(serial_rx* rx);
+
+// read whatever the serial port has available with a single non-blocking call
+// returns number of bytes read (can be 0) or SP_READ_ERROR_IO
+int serial_rx_fill(struct sp_port* serialport, serial_rx* rx);
+
+// get next complete message out of previously read data, never touches the serial port
+// returns message size, SP_READ_ERROR_NO_DATA if more data is needed or SP_READ_ERROR_INVALID_DATA if a frame was dropped
+// NOTE invalid frames are discarded as a whole, there is no need to call serial_read_ignore_until_zero afterwards
+sp_read_error_status serial_rx_next_msg(serial_rx* rx, char buf[0xff], bool debug);
+
 sp_read_error_status serial_read_msg_until_zero(struct sp_port* serialport, char buf[0xff], bool debug);
 
 // returns 0 if ok, otherwise an error
 sp_read_error_status serial_read_ignore_until_zero(struct sp_port* serialport);
 
 // returns false on IO error, which will automatically close the serial
+// NOTE messages for the serial port attached with serial_tx_attach are queued and written later on
 bool write_or_close(struct sp_port* serialport, const char* msg);
 
+// queue all messages for serialport, to be flushed with a single vectored write once the fd is writable
+// NOTE requires serialport fd to be in the event loop, EPOLLOUT is enabled while the queue has data
+bool serial_tx_attach(struct sp_port* serialport);
+void serial_tx_detach(void);
+
+// write as much of the queue as possible without blocking, keeping partially written messages for later
+// returns false on IO error, which will automatically close the serial, detach it and stop the event loop
+bool serial_tx_flush(void);
+
+// number of messages waiting in the queue, including a partially written one
+uint32_t serial_tx_queue_depth(void);
+
 // NOTE: DO NOT USE, needed only for tests
 bool serial_read_response(struct sp_port* serialport, char buf[0xff]);
@@ -0,0 +1,307 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "serial_io.h"
+#include "monotonic.h"
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+struct sp_port {
+    int fd;
+    char* name;
+};
+
+static const struct {
+    int baudrate;
+    speed_t speed;
+} kBaudRates[] = {
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+    { 460800, B460800 },
+    { 500000, B500000 },
+    { 576000, B576000 },
+    { 921600, B921600 },
+    { 1000000, B1000000 },
+    { 1152000, B1152000 },
+    { 1500000, B1500000 },
+    { 2000000, B2000000 },
+    { 2500000, B2500000 },
+    { 3000000, B3000000 },
+};
+
+static bool baudrate_to_speed(const int baudrate, speed_t* const speed)
+{
+    for (size_t i = 0; i < sizeof(kBaudRates)/sizeof(kBaudRates[0]); ++i)
+    {
+        if (kBaudRates[i].baudrate == baudrate)
+        {
+            *speed = kBaudRates[i].speed;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool configure_tty(const int fd, const int baudrate)
+{
+    struct termios tty;
+    speed_t speed;
+
+    if (! baudrate_to_speed(baudrate, &speed))
+    {
+        fprintf(stderr, "%s failed, unsupported baudrate %d\n", __func__, baudrate);
+        return false;
+    }
+
+    if (tcgetattr(fd, &tty) != 0)
+    {
+        fprintf(stderr, "%s failed, tcgetattr error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    // raw 8N1, no flow control of any kind
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+    // reads return immediately with whatever is available, we only read after poll/epoll tells us to
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0)
+    {
+        fprintf(stderr, "%s failed, tcsetattr error: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    // ask the driver to push received bytes to the tty layer right away instead of batching them
+    // not all drivers support this (e.g. pseudo-terminals), so errors are not fatal
+    struct serial_struct serinfo;
+    if (ioctl(fd, TIOCGSERIAL, &serinfo) == 0)
+    {
+        serinfo.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serinfo);
+    }
+
+    return true;
+}
+
+struct sp_port* serial_open(const char* const serial, const int baudrate)
+{
+    struct sp_port* serialport;
+    char* resolvedserial;
+
+    // resolve symlinks (e.g. udev rules), also checks that serial exists
+    resolvedserial = realpath(serial, NULL);
+    if (resolvedserial == NULL)
+    {
+        fprintf(stderr, "%s failed, serial device '%s' does not exist\n", __func__, serial);
+        return NULL;
+    }
+
+    serialport = malloc(sizeof(struct sp_port));
+    if (serialport == NULL)
+    {
+        fprintf(stderr, "%s failed, out of memory\n", __func__);
+        goto error_free;
+    }
+
+    serialport->name = resolvedserial;
+    serialport->fd = open(resolvedserial, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (serialport->fd < 0)
+    {
+        fprintf(stderr, "%s failed, cannot open serial port for device '%s'\n", __func__, resolvedserial);
+        goto error_with_serialport;
+    }
+
+    if (! configure_tty(serialport->fd, baudrate))
+    {
+        fprintf(stderr, "%s failed, cannot configure serial port for device '%s'\n", __func__, resolvedserial);
+        goto error_close;
+    }
+
+    return serialport;
+
+error_close:
+    close(serialport->fd);
+
+error_with_serialport:
+    free(serialport);
+
+error_free:
+    free(resolvedserial);
+    return NULL;
+}
+
+void serial_close(struct sp_port* const serialport)
+{
+    sp_close(serialport);
+    sp_free_port(serialport);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// libserialport compatible API, only what mod-system-control needs
+
+enum sp_return sp_blocking_read(struct sp_port* const port, void* const buf, const size_t count,
+                                const unsigned int timeout_ms)
+{
+    const int64_t deadline = monotonic_ms() + timeout_ms;
+    struct pollfd pfd = { .fd = port->fd, .events = POLLIN, .revents = 0 };
+    size_t total = 0;
+
+    while (total < count)
+    {
+        const ssize_t r = read(port->fd, (char*)buf + total, count - total);
+
+        if (r > 0)
+        {
+            total += (size_t)r;
+            continue;
+        }
+        if (r < 0 && errno != EAGAIN && errno != EINTR)
+            return SP_ERR_FAIL;
+
+        // timeout of 0 means wait forever
+        int wait = -1;
+        if (timeout_ms != 0)
+        {
+            const int64_t remaining = deadline - monotonic_ms();
+            if (remaining <= 0)
+                break;
+            wait = (int)remaining;
+        }
+
+        if (poll(&pfd, 1, wait) < 0 && errno != EINTR)
+            return SP_ERR_FAIL;
+    }
+
+    return (enum sp_return)total;
+}
+
+enum sp_return sp_nonblocking_read(struct sp_port* const port, void* const buf, const size_t count)
+{
+    const ssize_t r = read(port->fd, buf, count);
+
+    if (r < 0)
+        return errno == EAGAIN ? SP_OK : SP_ERR_FAIL;
+
+    return (enum sp_return)r;
+}
+
+enum sp_return sp_blocking_write(struct sp_port* const port, const void* const buf, const size_t count,
+                                 const unsigned int timeout_ms)
+{
+    const int64_t deadline = monotonic_ms() + timeout_ms;
+    struct pollfd pfd = { .fd = port->fd, .events = POLLOUT, .revents = 0 };
+    size_t total = 0;
+
+    while (total < count)
+    {
+        const ssize_t r = write(port->fd, (const char*)buf + total, count - total);
+
+        if (r > 0)
+        {
+            total += (size_t)r;
+            continue;
+        }
+        if (r < 0 && errno != EAGAIN && errno != EINTR)
+            return SP_ERR_FAIL;
+
+        int wait = -1;
+        if (timeout_ms != 0)
+        {
+            const int64_t remaining = deadline - monotonic_ms();
+            if (remaining <= 0)
+                break;
+            wait = (int)remaining;
+        }
+
+        if (poll(&pfd, 1, wait) < 0 && errno != EINTR)
+            return SP_ERR_FAIL;
+    }
+
+    return (enum sp_return)total;
+}
+
+enum sp_return sp_nonblocking_write(struct sp_port* const port, const void* const buf, const size_t count)
+{
+    const ssize_t r = write(port->fd, buf, count);
+
+    if (r < 0)
+        return errno == EAGAIN ? SP_OK : SP_ERR_FAIL;
+
+    return (enum sp_return)r;
+}
+
+enum sp_return sp_flush(struct sp_port* const port, const enum sp_buffer buffers)
+{
+    int queue;
+
+    switch (buffers)
+    {
+    case SP_BUF_INPUT:
+        queue = TCIFLUSH;
+        break;
+    case SP_BUF_OUTPUT:
+        queue = TCOFLUSH;
+        break;
+    case SP_BUF_BOTH:
+        queue = TCIOFLUSH;
+        break;
+    default:
+        return SP_ERR_ARG;
+    }
+
+    return tcflush(port->fd, queue) == 0 ? SP_OK : SP_ERR_FAIL;
+}
+
+enum sp_return sp_get_port_handle(const struct sp_port* const port, void* const result_ptr)
+{
+    *(int*)result_ptr = port->fd;
+    return SP_OK;
+}
+
+enum sp_return sp_close(struct sp_port* const port)
+{
+    if (port->fd < 0)
+        return SP_ERR_ARG;
+
+    close(port->fd);
+    port->fd = -1;
+    return SP_OK;
+}
+
+void sp_free_port(struct sp_port* const port)
+{
+    free(port->name);
+    free(port);
+}
+
+const char* sp_get_lib_version_string(void)
+{
+    return "termios";
+}
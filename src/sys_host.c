@@ -4,6 +4,7 @@
 
 #include "sys_host.h"
 #include "cli.h"
+#include "event_loop.h"
 #include "serial_rw.h"
 
 #include "../mod-controller-proto/mod-protocol.h"
@@ -11,15 +12,36 @@
 #define SERVER_MODE
 #include "sys_host_impl.h"
 
-#include <pthread.h>
 #include <stdlib.h>
 
-static volatile bool sys_host_thread_running = false;
-static volatile bool sys_host_values_changed = false;
+// delay before writing changed host values to disk, in ms
+#define SYS_HOST_VALUES_WRITE_DELAY 5000
+
+// delay before resending cached HMI contents after a page change, in ms
+// NOTE this is racy, workaround for mod-ui side handling messages slower than us
+#define HMI_RESEND_DELAY 400
+
+// default max number of HMI pushes waiting for a response, can be changed with MOD_HMI_PUSH_WINDOW env var
+#define HMI_PUSH_WINDOW 4
+
+// how long to wait for a HMI response before considering it lost, in ms
+#define HMI_PUSH_ACK_TIMEOUT 100
+
+// how many times messages without a response are sent again before giving up on them
+#define HMI_PUSH_MAX_RETRIES 2
+
+// number of HMI pushes that can be in-flight or waiting for the window, must be a power of 2
+#define HMI_PUSH_QUEUE_SIZE 128
+#define HMI_PUSH_QUEUE_MASK (HMI_PUSH_QUEUE_SIZE - 1)
+#define HMI_PUSH_MSG_SIZE 0x110
+
 static int sys_host_shmfd;
 static sys_serial_shm_data* sys_host_data;
-static pthread_t sys_host_thread;
-static int sys_host_has_msgs;
+static int sys_host_doorbellfd = -1;
+static int sys_host_values_timer = -1;
+static int hmi_resend_timer = -1;
+static int hmi_push_timer = -1;
+static struct sp_port* s_serialport;
 static bool s_debug;
 
 // compressor state
@@ -42,26 +64,94 @@ static float noisegate_threshold = -60.0f;
  #define HMI_NUM_ACTUATORS 6
 #else
  // fallback, so just it builds for local testing
- #define HMI_NUM_PAGES 1
+ // NOTE 2 pages, so tests can switch between them
+ #define HMI_NUM_PAGES 2
  #define HMI_NUM_SUBPAGES 1
  #define HMI_NUM_ACTUATORS 2
 #endif
 
-// page cache handling
-typedef struct HMI_CACHE_T {
-    // values match mod-host message size
-    char led_blink[32];
-    char led_brightness[32];
-    char label[24];
-    char value[24];
-    char unit[24];
-    char indicator[32];
-} hmi_cache_t;
-static hmi_cache_t* hmi_cache[HMI_NUM_PAGES * HMI_NUM_SUBPAGES * HMI_NUM_ACTUATORS];
+#define HMI_NUM_SLOTS (HMI_NUM_PAGES * HMI_NUM_SUBPAGES * HMI_NUM_ACTUATORS)
+
+// widget fields cached per actuator, in the order they are sent to the HMI
+typedef enum {
+    HMI_FIELD_LED_BLINK,
+    HMI_FIELD_LED_BRIGHTNESS,
+    HMI_FIELD_LABEL,
+    HMI_FIELD_UNIT,
+    HMI_FIELD_VALUE,
+    HMI_FIELD_INDICATOR,
+    HMI_FIELD_COUNT
+} hmi_field;
+
+typedef struct {
+    const char* cmd;
+    // max stored length, matches mod-host message size
+    uint8_t maxlen;
+    bool quoted;
+} hmi_field_info;
+
+static const hmi_field_info kHmiFields[HMI_FIELD_COUNT] = {
+    [HMI_FIELD_LED_BLINK]      = { CMD_SYS_CHANGE_LED_BLINK,        31, false },
+    [HMI_FIELD_LED_BRIGHTNESS] = { CMD_SYS_CHANGE_LED_BRIGHTNESS,   31, false },
+    [HMI_FIELD_LABEL]          = { CMD_SYS_CHANGE_NAME,             23, true  },
+    [HMI_FIELD_UNIT]           = { CMD_SYS_CHANGE_UNIT,             23, true  },
+    [HMI_FIELD_VALUE]          = { CMD_SYS_CHANGE_VALUE,            23, true  },
+    [HMI_FIELD_INDICATOR]      = { CMD_SYS_CHANGE_WIDGET_INDICATOR, 31, false },
+};
+
+// page cache handling, one slot per page, subpage and actuator, all preallocated
+// fields are stored with their length and without null terminator
+typedef struct {
+    uint8_t len[HMI_FIELD_COUNT];
+    char data[HMI_FIELD_COUNT][32];
+} hmi_cache_slot;
+
+static struct {
+    // which fields of each slot are set, one bit per hmi_field
+    uint8_t used[HMI_NUM_SLOTS];
+    hmi_cache_slot slots[HMI_NUM_SLOTS];
+} hmi_cache;
+
+// what the HMI currently shows for each actuator, as last sent by us
+// invalidated whenever we cannot be sure about it anymore (resets, lost or failed messages)
+static struct {
+    uint8_t valid[HMI_NUM_ACTUATORS];
+    hmi_cache_slot slots[HMI_NUM_ACTUATORS];
+} hmi_display;
+
 static int hmi_page = 0;
 static int hmi_subpage = 0;
-static int hmi_page_or_subpage_changed = 0;
-static bool hmi_io_values_requested = false;
+
+// messages drained from mod-host but not handled yet, see sys_host_process
+#define HOST_STAGE_MAX_ENTRIES 256
+
+typedef struct {
+    sys_serial_event_type etype;
+    uint8_t page, subpage;
+    bool superseded;
+    uint32_t offset, size;
+} host_stage_entry;
+
+static struct {
+    host_stage_entry entries[HOST_STAGE_MAX_ENTRIES];
+    char text[SYS_SERIAL_SHM_DATA_SIZE * 2];
+    uint32_t count, used;
+    // per page, subpage, actuator and field, matches generation if a newer message was already seen
+    uint32_t seen[HMI_NUM_SLOTS * HMI_FIELD_COUNT];
+    uint32_t generation;
+} host_stage;
+
+// HMI push queue, indexes are free-running and masked on access
+// messages between tail and sent are waiting for a response, between sent and head are waiting for the window
+// responses carry no id, so after a timeout nothing is sent until late responses had the chance to arrive,
+// otherwise they would be taken as responses to what we send next
+static struct {
+    char msgs[HMI_PUSH_QUEUE_SIZE][HMI_PUSH_MSG_SIZE];
+    uint32_t head, sent, tail;
+    uint32_t window;
+    uint32_t retries;
+    bool draining;
+} hmi_push;
 
 static bool read_host_values(void)
 {
@@ -121,29 +211,53 @@ static void write_host_values(void)
     write_file(buf, "/data/audioproc.txt", s_debug);
 }
 
-static void* sys_host_thread_run(void* const arg)
+// which cached field a message type updates, or -1 if not cached (e.g. popups)
+static int hmi_field_for_event(const sys_serial_event_type etype)
 {
-    while (sys_host_thread_running)
+    switch (etype)
     {
-        if (sys_host_values_changed)
-        {
-            write_host_values();
-            sys_host_values_changed = false;
-        }
+    case sys_serial_event_type_led_blink:
+        return HMI_FIELD_LED_BLINK;
+    case sys_serial_event_type_led_brightness:
+        return HMI_FIELD_LED_BRIGHTNESS;
+    case sys_serial_event_type_name:
+        return HMI_FIELD_LABEL;
+    case sys_serial_event_type_unit:
+        return HMI_FIELD_UNIT;
+    case sys_serial_event_type_value:
+        return HMI_FIELD_VALUE;
+    case sys_serial_event_type_widget_indicator:
+        return HMI_FIELD_INDICATOR;
+    default:
+        return -1;
+    }
+}
 
-        if (sem_timedwait_secs(&sys_host_data->server.sem, 5))
-            continue;
+static bool hmi_field_equals(const hmi_cache_slot* const slot, const int field,
+                             const char* const data, const uint8_t len)
+{
+    return slot->len[field] == len && memcmp(slot->data[field], data, len) == 0;
+}
 
-        if (! sys_host_thread_running)
-            break;
+// store a cached field as shown by the HMI for an actuator, returns false if that is what it shows already
+static bool hmi_display_update(const int actuator, const hmi_cache_slot* const slot, const int field)
+{
+    hmi_cache_slot* const shown = &hmi_display.slots[actuator];
+    const uint8_t bit = 1u << field;
+    const uint8_t len = slot->len[field];
 
-        sys_host_has_msgs = 1;
-    }
+    if ((hmi_display.valid[actuator] & bit) != 0 && hmi_field_equals(shown, field, slot->data[field], len))
+        return false;
 
-    return NULL;
+    memcpy(shown->data[field], slot->data[field], len);
+    shown->len[field] = len;
+    hmi_display.valid[actuator] |= bit;
+    return true;
+}
 
-    // unused
-    (void)arg;
+static void hmi_display_invalidate(void)
+{
+    memset(hmi_display.valid, 0, sizeof(hmi_display.valid));
 }
 
 static bool hmi_command_cache_add(const uint8_t page,
@@ -222,68 +336,23 @@ static bool hmi_command_cache_add(const uint8_t page,
     }
 
     const size_t index = page * HMI_NUM_SUBPAGES * HMI_NUM_ACTUATORS + subpage * HMI_NUM_ACTUATORS + actuatorId;
-    hmi_cache_t* cache = hmi_cache[index];
-
-    if (cache == NULL)
-    {
-        hmi_cache[index] = cache = calloc(1, sizeof(hmi_cache_t));
-
-        if (cache == NULL)
-        {
-            if (s_debug) {
-                printf("%s: failed to allocate memory\n", __func__);
-                fflush(stdout);
-            }
-            return false;
-        }
-    }
-
+    const int field = hmi_field_for_event(etype);
     const bool match_pages = page == hmi_page && matching_subpage;
     bool match_content = false;
 
-    switch (etype)
+    // there is no cache for popups, and we allow them to be repeated
+    if (field >= 0)
     {
-    case sys_serial_event_type_led_blink:
-        if (strncmp(cache->led_blink, msg, sizeof(cache->led_blink)-1) != 0)
-            strncpy(cache->led_blink, msg, sizeof(cache->led_blink)-1);
-        else
-            match_content = true;
-        break;
-    case sys_serial_event_type_led_brightness:
-        if (strncmp(cache->led_brightness, msg, sizeof(cache->led_brightness)-1) != 0)
-            strncpy(cache->led_brightness, msg, sizeof(cache->led_brightness)-1);
-        else
-            match_content = true;
-        break;
-    case sys_serial_event_type_name:
-        if (strncmp(cache->label, msg, sizeof(cache->label)-1) != 0)
-            strncpy(cache->label, msg, sizeof(cache->label)-1);
-        else
-            match_content = true;
-        break;
-    case sys_serial_event_type_unit:
-        if (strncmp(cache->unit, msg, sizeof(cache->unit)-1) != 0)
-            strncpy(cache->unit, msg, sizeof(cache->unit)-1);
-        else
-            match_content = true;
-        break;
-    case sys_serial_event_type_value:
-        if (strncmp(cache->value, msg, sizeof(cache->value)-1) != 0)
-            strncpy(cache->value, msg, sizeof(cache->value)-1);
-        else
-            match_content = true;
-        break;
-    case sys_serial_event_type_widget_indicator:
-        if (strncmp(cache->indicator, msg, sizeof(cache->indicator)-1) != 0)
-            strncpy(cache->indicator, msg, sizeof(cache->indicator)-1);
-        else
-            match_content = true;
-        break;
-    case sys_serial_event_type_popup:
-        // there is no cache for popups, and we allow them to be repeated
-        break;
-    default:
-        break;
+        hmi_cache_slot* const slot = &hmi_cache.slots[index];
+        const uint8_t len = (uint8_t)strnlen(msg, kHmiFields[field].maxlen);
+
+        memcpy(slot->data[field], msg, len);
+        slot->len[field] = len;
+        hmi_cache.used[index] |= 1u << field;
+
+        // only send what the HMI is not showing already
+        if (match_pages)
+            match_content = ! hmi_display_update(actuatorId, slot, field);
     }
 
     if (s_debug)
@@ -291,7 +360,7 @@ static bool hmi_command_cache_add(const uint8_t page,
         if (match_pages)
         {
             if (match_content)
-                printf("%s: page and subpage %u,%u are currently active but new contents match old, ignoring\n",
+                printf("%s: page and subpage %u,%u are currently active but HMI already shows new contents, ignoring\n",
                        __func__, page, subpage);
             else
                 printf("%s: page and subpage %u,%u are currently active, will trigger HMI now with new content\n",
@@ -379,15 +448,101 @@ static void hmi_command_cache_remove(const uint8_t page, uint8_t subpage, char m
 
     if (s_debug)
     {
-        printf("%s has index %lu and cache pointer %p\n", __func__, index, hmi_cache[index]);
+        printf("%s has index %lu and fields %02x\n", __func__, index, hmi_cache.used[index]);
         fflush(stdout);
     }
 
-    if (hmi_cache[index] != NULL)
+    hmi_cache.used[index] = 0;
+
+    // the HMI clears unassigned actuators by itself
+    hmi_display.valid[actuatorId] = 0;
+}
+
+static void hmi_push_send_pending(struct sp_port* const serialport)
+{
+    // timer is already running for the end of the drain
+    if (hmi_push.draining)
+        return;
+
+    while (hmi_push.sent != hmi_push.head && hmi_push.sent - hmi_push.tail < hmi_push.window)
+    {
+        write_or_close(serialport, hmi_push.msgs[hmi_push.sent & HMI_PUSH_QUEUE_MASK]);
+        ++hmi_push.sent;
+    }
+
+    if (hmi_push.sent != hmi_push.tail)
+    {
+        if (! event_timer_is_active(hmi_push_timer))
+            event_timer_start(hmi_push_timer, HMI_PUSH_ACK_TIMEOUT);
+    }
+    else
+    {
+        event_timer_stop(hmi_push_timer);
+    }
+}
+
+static void hmi_push_enqueue(struct sp_port* const serialport, const char* const msg)
+{
+    const size_t size = strlen(msg) + 1;
+
+    if (size > HMI_PUSH_MSG_SIZE)
+    {
+        fprintf(stderr, "%s failed, message is too big\n", __func__);
+        return;
+    }
+
+    if (hmi_push.head - hmi_push.tail == HMI_PUSH_QUEUE_SIZE)
+    {
+        fprintf(stderr, "%s failed, queue is full, dropping message\n", __func__);
+        hmi_display_invalidate();
+        return;
+    }
+
+    memcpy(hmi_push.msgs[hmi_push.head & HMI_PUSH_QUEUE_MASK], msg, size);
+    ++hmi_push.head;
+
+    hmi_push_send_pending(serialport);
+}
+
+static void hmi_push_timer_callback(const int fd, const uint32_t events, void* const arg)
+{
+    // late responses had their chance, anything from now on belongs to what we send next
+    if (hmi_push.draining)
+    {
+        hmi_push.draining = false;
+        hmi_push_send_pending(s_serialport);
+        return;
+    }
+
+    if (hmi_push.sent == hmi_push.tail)
+        return;
+
+    if (++hmi_push.retries > HMI_PUSH_MAX_RETRIES)
     {
-        free(hmi_cache[index]);
-        hmi_cache[index] = NULL;
+        fprintf(stderr, "%s: no response from HMI for %u messages, assuming lost\n",
+                __func__, hmi_push.sent - hmi_push.tail);
+
+        hmi_push.tail = hmi_push.sent;
+        hmi_push.retries = 0;
     }
+    else
+    {
+        fprintf(stderr, "%s: no response from HMI for %u messages, sending them again\n",
+                __func__, hmi_push.sent - hmi_push.tail);
+
+        hmi_push.sent = hmi_push.tail;
+    }
+
+    hmi_push.draining = true;
+    event_timer_start(hmi_push_timer, HMI_PUSH_ACK_TIMEOUT);
+
+    // HMI might have been restarted or reconnected, so we do not know what it shows anymore
+    hmi_display_invalidate();
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
 }
 
 static void send_command_to_hmi(struct sp_port* const serialport, const char* const sys_cmd,
@@ -425,11 +580,7 @@ static void send_command_to_hmi(struct sp_port* const serialport, const char* co
         fflush(stdout);
     }
 
-    // write message
-    write_or_close(serialport, msg);
-
-    // response
-    serial_read_ignore_until_zero(serialport);
+    hmi_push_enqueue(serialport, msg);
 }
 
 static void send_command_to_host(const sys_serial_event_type etype, const char* const value)
@@ -447,8 +598,6 @@ static void send_command_to_host(const sys_serial_event_type etype, const char*
         fprintf(stdout, "send_command_to_host %02x:%s '%s'\n", etype, sys_serial_event_type_to_str(etype), value);
         fflush(stdout);
     }
-
-    sem_post(&data->sem);
 }
 
 static void send_command_to_host_int(const sys_serial_event_type etype, const int value)
@@ -470,9 +619,9 @@ static void send_command_to_host_float(const sys_serial_event_type etype, const
 static void sys_host_resend_hmi(struct sp_port* const serialport)
 {
     size_t index;
-    hmi_cache_t* cache;
+    const hmi_cache_slot* slot;
     char msg[SYS_SERIAL_SHM_DATA_SIZE];
-    int subpage;
+    int subpage, skipped = 0;
 
     for (int i=0; i<HMI_NUM_ACTUATORS; ++i)
     {
@@ -485,48 +634,44 @@ static void sys_host_resend_hmi(struct sp_port* const serialport)
             subpage = hmi_subpage;
 
         index = hmi_page * HMI_NUM_SUBPAGES * HMI_NUM_ACTUATORS + subpage * HMI_NUM_ACTUATORS + i;
-        cache = hmi_cache[index];
 
-        if (cache == NULL)
+        // we do not know what the HMI shows for fields we do not send
+        if (hmi_cache.used[index] == 0)
+        {
+            hmi_display.valid[i] = 0;
             continue;
+        }
 
-        printf("%s: found cache with index %lu %p; page and subpage %u,%u\n",
-               __func__, index, cache, hmi_page, subpage);
+        slot = &hmi_cache.slots[index];
 
-        if (cache->led_blink[0] != '\0')
-        {
-            memcpy(msg, cache->led_blink, sizeof(cache->led_blink));
-            send_command_to_hmi(serialport, CMD_SYS_CHANGE_LED_BLINK, msg, false);
-        }
-        if (cache->led_brightness[0] != '\0')
-        {
-            memcpy(msg, cache->led_brightness, sizeof(cache->led_brightness));
-            send_command_to_hmi(serialport, CMD_SYS_CHANGE_LED_BRIGHTNESS, msg, false);
-        }
-        if (cache->label[0] != '\0')
-        {
-            memcpy(msg, cache->label, sizeof(cache->label));
-            send_command_to_hmi(serialport, CMD_SYS_CHANGE_NAME, msg, true);
-        }
-        if (cache->unit[0] != '\0')
-        {
-            memcpy(msg, cache->unit, sizeof(cache->unit));
-            send_command_to_hmi(serialport, CMD_SYS_CHANGE_UNIT, msg, true);
-        }
-        if (cache->value[0] != '\0')
-        {
-            memcpy(msg, cache->value, sizeof(cache->value));
-            send_command_to_hmi(serialport, CMD_SYS_CHANGE_VALUE, msg, true);
-        }
-        if (cache->indicator[0] != '\0')
+        if (s_debug)
+            printf("%s: found cache with index %lu fields %02x; page and subpage %u,%u\n",
+                   __func__, index, hmi_cache.used[index], hmi_page, subpage);
+
+        for (int field = 0; field < HMI_FIELD_COUNT; ++field)
         {
-            memcpy(msg, cache->indicator, sizeof(cache->indicator));
-            send_command_to_hmi(serialport, CMD_SYS_CHANGE_WIDGET_INDICATOR, msg, false);
+            if ((hmi_cache.used[index] & (1u << field)) == 0)
+            {
+                hmi_display.valid[i] &= ~(1u << field);
+                continue;
+            }
+
+            // same as shown for this actuator on the previous page
+            if (! hmi_display_update(i, slot, field))
+            {
+                ++skipped;
+                continue;
+            }
+
+            memcpy(msg, slot->data[field], slot->len[field]);
+            msg[slot->len[field]] = '\0';
+            send_command_to_hmi(serialport, kHmiFields[field].cmd, msg, kHmiFields[field].quoted);
         }
     }
 
     if (s_debug)
     {
+        printf("%s: skipped %d fields already shown by HMI\n", __func__, skipped);
         fputs("\n", stdout);
         fflush(stdout);
     }
@@ -538,153 +683,375 @@ static void sys_host_reset(const uint8_t page, const uint8_t subpage)
     hmi_subpage = subpage;
     // pedalboard_gain = 0.0f;
 
-    hmi_cache_t* cache;
-    for (int i=0; i<HMI_NUM_PAGES * HMI_NUM_SUBPAGES * HMI_NUM_ACTUATORS; ++i)
-    {
-        cache = hmi_cache[i];
+    memset(hmi_cache.used, 0, sizeof(hmi_cache.used));
 
-        if (cache == NULL)
-            continue;
+    // HMI gets redrawn by mod-ui after these
+    hmi_display_invalidate();
+}
 
-        free(hmi_cache[i]);
-        hmi_cache[i] = NULL;
+static void sys_host_cleanup_events(void)
+{
+    if (sys_host_doorbellfd >= 0)
+    {
+        event_loop_remove(sys_host_doorbellfd);
+        mod_doorbell_fd_close(&sys_host_data->server.doorbell, sys_host_doorbellfd);
+        sys_host_doorbellfd = -1;
     }
+
+    event_timer_destroy(sys_host_values_timer);
+    event_timer_destroy(hmi_resend_timer);
+    event_timer_destroy(hmi_push_timer);
+    sys_host_values_timer = hmi_resend_timer = hmi_push_timer = -1;
 }
 
-void sys_host_setup(const bool debug)
+static void sys_host_send_io_values(void)
 {
-    s_debug = debug;
+    send_command_to_host_int(sys_serial_event_type_compressor_mode, compressor_mode);
+    send_command_to_host_float(sys_serial_event_type_compressor_release, compressor_release);
+    send_command_to_host_int(sys_serial_event_type_noisegate_channel, noisegate_channel);
+    send_command_to_host_float(sys_serial_event_type_noisegate_decay, noisegate_decay);
+    send_command_to_host_float(sys_serial_event_type_noisegate_threshold, noisegate_threshold);
+    send_command_to_host_float(sys_serial_event_type_pedalboard_gain, pedalboard_gain);
 
-    if (! sys_serial_open(&sys_host_shmfd, &sys_host_data))
+    if (s_debug)
     {
-        fprintf(stderr, "sys_host shared memory failed\n");
-        return;
+        fputs("\n", stdout);
+        fflush(stdout);
     }
-
-    read_host_values();
-    sys_host_thread_running = true;
-    pthread_create(&sys_host_thread, NULL, sys_host_thread_run, NULL);
 }
 
-void sys_host_process(struct sp_port* const serialport)
+static void sys_host_handle_message(const sys_serial_event_type etype,
+                                    const uint8_t page, const uint8_t subpage,
+                                    char msg[SYS_SERIAL_SHM_DATA_SIZE],
+                                    bool* const io_values_requested)
 {
-    if (sys_host_data == NULL)
-        return;
+    struct sp_port* const serialport = s_serialport;
+
+    if (s_debug)
+    {
+        fprintf(stdout, "Received message from host %u %u %02x:%s '%s'\n",
+                page, subpage, etype, sys_serial_event_type_to_str(etype), msg);
+        fflush(stdout);
+    }
 
-    if (hmi_page_or_subpage_changed)
+    switch (etype)
     {
-        // NOTE this is racy, workaround for mod-ui side handling messages slower than us
-        if (++hmi_page_or_subpage_changed == 10)
+    case sys_serial_event_type_special_req:
+        if (strcmp(msg, "restart") == 0)
         {
-            hmi_page_or_subpage_changed = 0;
-            sys_host_resend_hmi(serialport);
+            *io_values_requested = true;
+            sys_host_reset(0, 0);
         }
+        else if (strcmp(msg, "pages") == 0)
+        {
+            sys_host_reset(page, subpage);
+        }
+        break;
+    case sys_serial_event_type_unassign:
+        hmi_command_cache_remove(page, subpage, msg);
+        break;
+    case sys_serial_event_type_led_blink:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_CHANGE_LED_BLINK, msg, false);
+        break;
+    case sys_serial_event_type_led_brightness:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_CHANGE_LED_BRIGHTNESS, msg, false);
+        break;
+    case sys_serial_event_type_name:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_CHANGE_NAME, msg, true);
+        break;
+    case sys_serial_event_type_unit:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_CHANGE_UNIT, msg, true);
+        break;
+    case sys_serial_event_type_value:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_CHANGE_VALUE, msg, true);
+        break;
+    case sys_serial_event_type_widget_indicator:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_CHANGE_WIDGET_INDICATOR, msg, false);
+        break;
+    case sys_serial_event_type_popup:
+        if (hmi_command_cache_add(page, subpage, etype, msg))
+            send_command_to_hmi(serialport, CMD_SYS_LAUNCH_POPUP, msg, false);
+        break;
+    default:
+        break;
     }
 
-    if (hmi_io_values_requested)
+    if (s_debug)
     {
-        hmi_io_values_requested = false;
-        send_command_to_host_int(sys_serial_event_type_compressor_mode, compressor_mode);
-        send_command_to_host_float(sys_serial_event_type_compressor_release, compressor_release);
-        send_command_to_host_int(sys_serial_event_type_noisegate_channel, noisegate_channel);
-        send_command_to_host_float(sys_serial_event_type_noisegate_decay, noisegate_decay);
-        send_command_to_host_float(sys_serial_event_type_noisegate_threshold, noisegate_threshold);
-        send_command_to_host_float(sys_serial_event_type_pedalboard_gain, pedalboard_gain);
+        fputs("\n", stdout);
+        fflush(stdout);
+    }
+}
 
-        if (s_debug)
+// coalescing key of a staged message, or -1 if it must be kept as-is
+static int host_stage_key(const host_stage_entry* const entry, const char* const msg)
+{
+    const int field = hmi_field_for_event(entry->etype);
+    int actuator = 0;
+
+    if (field < 0 || entry->page >= HMI_NUM_PAGES || entry->subpage >= HMI_NUM_SUBPAGES)
+        return -1;
+
+    // messages start with the actuator id, followed by a space
+    if (msg[0] < '0' || msg[0] > '9')
+        return -1;
+
+    for (const char* c = msg; *c != ' '; ++c)
+    {
+        if (*c < '0' || *c > '9' || (actuator = actuator * 10 + (*c - '0')) >= HMI_NUM_ACTUATORS)
+            return -1;
+    }
+
+    return ((entry->page * HMI_NUM_SUBPAGES + entry->subpage) * HMI_NUM_ACTUATORS + actuator)
+           * HMI_FIELD_COUNT + field;
+}
+
+// handle everything staged, skipping messages superseded by a newer one for the same actuator field
+static void host_stage_flush(bool* const io_values_requested)
+{
+    char msg[SYS_SERIAL_SHM_DATA_SIZE];
+    int key, coalesced = 0;
+
+    // walk backwards, so the newest message of each key is the one found first
+    // special requests and unassigns reset the cache, nothing is coalesced across them
+    ++host_stage.generation;
+
+    for (uint32_t i = host_stage.count; i-- != 0;)
+    {
+        host_stage_entry* const entry = &host_stage.entries[i];
+
+        if (entry->etype == sys_serial_event_type_special_req || entry->etype == sys_serial_event_type_unassign)
         {
-            fputs("\n", stdout);
-            fflush(stdout);
+            ++host_stage.generation;
+            continue;
         }
+
+        if ((key = host_stage_key(entry, host_stage.text + entry->offset)) < 0)
+            continue;
+
+        if (host_stage.seen[key] == host_stage.generation)
+        {
+            entry->superseded = true;
+            ++coalesced;
+            continue;
+        }
+
+        host_stage.seen[key] = host_stage.generation;
     }
 
-    if (! __sync_bool_compare_and_swap(&sys_host_has_msgs, 1, 0))
-        return;
+    // everything left goes out in the original order
+    for (uint32_t i = 0; i < host_stage.count; ++i)
+    {
+        const host_stage_entry* const entry = &host_stage.entries[i];
+
+        if (entry->superseded)
+            continue;
+
+        memcpy(msg, host_stage.text + entry->offset, entry->size);
+        sys_host_handle_message(entry->etype, entry->page, entry->subpage, msg, io_values_requested);
+    }
+
+    if (s_debug && coalesced != 0)
+    {
+        fprintf(stdout, "%s: skipped %d outdated messages from host\n", __func__, coalesced);
+        fflush(stdout);
+    }
 
+    host_stage.count = 0;
+    host_stage.used = 0;
+}
+
+static void sys_host_process(void)
+{
     sys_serial_shm_data_channel* const data = &sys_host_data->server;
 
     sys_serial_event_type etype;
     uint8_t page, subpage;
     char msg[SYS_SERIAL_SHM_DATA_SIZE];
+    bool io_values_requested = false;
 
-    while (data->head != data->tail)
+    // drain everything mod-host sent first, so outdated messages can be dropped before reaching the HMI
+    while (sys_serial_pending(data))
     {
         if (! sys_serial_read(data, &etype, &page, &subpage, msg))
             continue;
 
+        const uint32_t size = (uint32_t)strlen(msg) + 1;
+
+        if (host_stage.count == HOST_STAGE_MAX_ENTRIES || size > sizeof(host_stage.text) - host_stage.used)
+            host_stage_flush(&io_values_requested);
+
+        host_stage_entry* const entry = &host_stage.entries[host_stage.count++];
+        entry->etype = etype;
+        entry->page = page;
+        entry->subpage = subpage;
+        entry->superseded = false;
+        entry->offset = host_stage.used;
+        entry->size = size;
+
+        memcpy(host_stage.text + host_stage.used, msg, size);
+        host_stage.used += size;
+    }
+
+    host_stage_flush(&io_values_requested);
+
+    if (io_values_requested)
+        sys_host_send_io_values();
+}
+
+// process everything mod-host sent, then tell it to ring the doorbell for the next message
+static void sys_host_process_and_sleep(void)
+{
+    sys_serial_shm_data_channel* const data = &sys_host_data->server;
+
+    for (;;)
+    {
+        sys_host_process();
+        mod_doorbell_sleep_begin(&data->doorbell);
+
+        // something might have arrived before mod-host could see us sleeping
+        if (! sys_serial_pending(data))
+            break;
+
+        mod_doorbell_sleep_cancel(&data->doorbell);
+    }
+}
+
+static void sys_host_doorbell_callback(const int fd, const uint32_t events, void* const arg)
+{
+    mod_doorbell_fd_drain(fd);
+    sys_host_process_and_sleep();
+
+    // unused
+    (void)events;
+    (void)arg;
+}
+
+static void sys_host_values_timer_callback(const int fd, const uint32_t events, void* const arg)
+{
+    write_host_values();
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
+}
+
+static void hmi_resend_timer_callback(const int fd, const uint32_t events, void* const arg)
+{
+    sys_host_resend_hmi(s_serialport);
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
+}
+
+void sys_host_setup(struct sp_port* const serialport, const bool debug)
+{
+    s_serialport = serialport;
+    s_debug = debug;
+
+    const char* const push_window = getenv("MOD_HMI_PUSH_WINDOW");
+    hmi_push.window = push_window != NULL && atoi(push_window) > 0 ? (uint32_t)atoi(push_window) : HMI_PUSH_WINDOW;
+
+    if (hmi_push.window > HMI_PUSH_QUEUE_SIZE)
+        hmi_push.window = HMI_PUSH_QUEUE_SIZE;
+
+    if (! sys_serial_open(&sys_host_shmfd, &sys_host_data))
+    {
+        fprintf(stderr, "sys_host shared memory failed\n");
+        return;
+    }
+
+    sys_host_doorbellfd = mod_doorbell_fd_open(&sys_host_data->server.doorbell, SYS_SERIAL_DOORBELL_SOCKET);
+    sys_host_values_timer = event_timer_create(sys_host_values_timer_callback, NULL);
+    hmi_resend_timer = event_timer_create(hmi_resend_timer_callback, NULL);
+    hmi_push_timer = event_timer_create(hmi_push_timer_callback, NULL);
+
+    if (sys_host_doorbellfd < 0 || sys_host_values_timer < 0 || hmi_resend_timer < 0 || hmi_push_timer < 0 ||
+        ! event_loop_add(sys_host_doorbellfd, EPOLLIN, sys_host_doorbell_callback, NULL))
+    {
+        fprintf(stderr, "sys_host event setup failed\n");
+        sys_host_cleanup_events();
+        sys_serial_close(sys_host_shmfd, sys_host_data);
+        sys_host_data = NULL;
+        return;
+    }
+
+    read_host_values();
+    sys_host_process_and_sleep();
+}
+
+void sys_host_destroy(void)
+{
+    if (sys_host_data == NULL)
+        return;
+
+    // write any pending changes right away
+    if (event_timer_is_active(sys_host_values_timer))
+        write_host_values();
+
+    sys_host_cleanup_events();
+    sys_serial_close(sys_host_shmfd, sys_host_data);
+    sys_host_data = NULL;
+}
+
+static void sys_host_values_changed(void)
+{
+    if (sys_host_values_timer >= 0 && ! event_timer_is_active(sys_host_values_timer))
+        event_timer_start(sys_host_values_timer, SYS_HOST_VALUES_WRITE_DELAY);
+}
+
+void sys_host_hmi_response(const char* const msg)
+{
+    // response to a message that already timed out, being sent again or given up on
+    if (hmi_push.draining)
+    {
         if (s_debug)
         {
-            fprintf(stdout, "Received message from host %u %u %02x:%s '%s'\n",
-                    page, subpage, etype, sys_serial_event_type_to_str(etype), msg);
+            fprintf(stdout, "%s: late HMI response '%s', ignored\n", __func__, msg);
             fflush(stdout);
         }
 
-        switch (etype)
-        {
-        case sys_serial_event_type_special_req:
-            if (strcmp(msg, "restart") == 0)
-            {
-                hmi_io_values_requested = true;
-                sys_host_reset(0, 0);
-            }
-            else if (strcmp(msg, "pages") == 0)
-            {
-                sys_host_reset(page, subpage);
-            }
-            break;
-        case sys_serial_event_type_unassign:
-            hmi_command_cache_remove(page, subpage, msg);
-            break;
-        case sys_serial_event_type_led_blink:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_CHANGE_LED_BLINK, msg, false);
-            break;
-        case sys_serial_event_type_led_brightness:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_CHANGE_LED_BRIGHTNESS, msg, false);
-            break;
-        case sys_serial_event_type_name:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_CHANGE_NAME, msg, true);
-            break;
-        case sys_serial_event_type_unit:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_CHANGE_UNIT, msg, true);
-            break;
-        case sys_serial_event_type_value:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_CHANGE_VALUE, msg, true);
-            break;
-        case sys_serial_event_type_widget_indicator:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_CHANGE_WIDGET_INDICATOR, msg, false);
-            break;
-        case sys_serial_event_type_popup:
-            if (hmi_command_cache_add(page, subpage, etype, msg))
-                send_command_to_hmi(serialport, CMD_SYS_LAUNCH_POPUP, msg, false);
-            break;
-        default:
-            break;
-        }
+        // more might be on the way, keep waiting until the HMI is quiet
+        event_timer_start(hmi_push_timer, HMI_PUSH_ACK_TIMEOUT);
+        return;
+    }
 
+    // responses come in the same order as messages were sent
+    if (hmi_push.sent == hmi_push.tail)
+    {
         if (s_debug)
         {
-            fputs("\n", stdout);
+            fprintf(stdout, "%s: unexpected HMI response '%s', ignored\n", __func__, msg);
             fflush(stdout);
         }
+        return;
     }
-}
 
-void sys_host_destroy(void)
-{
-    if (sys_host_data == NULL)
-        return;
+    const char* const pushmsg = hmi_push.msgs[hmi_push.tail & HMI_PUSH_QUEUE_MASK];
 
-    sys_host_thread_running = false;
-    sem_post(&sys_host_data->server.sem);
-    pthread_join(sys_host_thread, NULL);
+    if (strncmp(msg, "r 0", 3) != 0)
+    {
+        fprintf(stderr, "%s: HMI replied '%s' to '%s'\n", __func__, msg, pushmsg);
+        hmi_display_invalidate();
+    }
+    else if (s_debug)
+        fprintf(stdout, "%s: HMI replied '%s' to '%s'\n", __func__, msg, pushmsg);
 
-    sys_serial_close(sys_host_shmfd, sys_host_data);
+    ++hmi_push.tail;
+    hmi_push.retries = 0;
+
+    // restart timeout for the remaining in-flight messages
+    event_timer_stop(hmi_push_timer);
+    hmi_push_send_pending(s_serialport);
 }
 
 int sys_host_get_compressor_mode(void)
@@ -720,42 +1087,42 @@ float sys_host_get_pedalboard_gain(void)
 void sys_host_set_compressor_mode(const int mode)
 {
     compressor_mode = mode;
-    sys_host_values_changed = true;
+    sys_host_values_changed();
     send_command_to_host_int(sys_serial_event_type_compressor_mode, mode);
 }
 
 void sys_host_set_compressor_release(const float value)
 {
     compressor_release = value;
-    sys_host_values_changed = true;
+    sys_host_values_changed();
     send_command_to_host_float(sys_serial_event_type_compressor_release, value);
 }
 
 void sys_host_set_noisegate_channel(const int channel)
 {
     noisegate_channel = channel;
-    sys_host_values_changed = true;
+    sys_host_values_changed();
     send_command_to_host_int(sys_serial_event_type_noisegate_channel, channel);
 }
 
 void sys_host_set_noisegate_decay(const float value)
 {
     noisegate_decay = value;
-    sys_host_values_changed = true;
+    sys_host_values_changed();
     send_command_to_host_float(sys_serial_event_type_noisegate_decay, value);
 }
 
 void sys_host_set_noisegate_threshold(const float value)
 {
     noisegate_threshold = value;
-    sys_host_values_changed = true;
+    sys_host_values_changed();
     send_command_to_host_float(sys_serial_event_type_noisegate_threshold, value);
 }
 
 void sys_host_set_pedalboard_gain(const float value)
 {
     pedalboard_gain = value;
-    sys_host_values_changed = true;
+    sys_host_values_changed();
     send_command_to_host_float(sys_serial_event_type_pedalboard_gain, value);
 }
 
@@ -779,7 +1146,7 @@ void sys_host_set_hmi_page(const int page)
 
     hmi_page = page;
     hmi_subpage = 0;
-    hmi_page_or_subpage_changed = 1;
+    event_timer_start(hmi_resend_timer, HMI_RESEND_DELAY);
 }
 
 void sys_host_set_hmi_subpage(const int subpage)
@@ -801,5 +1168,5 @@ void sys_host_set_hmi_subpage(const int subpage)
     }
 
     hmi_subpage = subpage;
-    hmi_page_or_subpage_changed = 1;
+    event_timer_start(hmi_resend_timer, HMI_RESEND_DELAY);
 }
@@ -8,10 +8,12 @@
 
 #include <stdbool.h>
 
-void sys_host_setup(bool debug);
-void sys_host_process(struct sp_port* serialport);
+void sys_host_setup(struct sp_port* serialport, bool debug);
 void sys_host_destroy(void);
 
+// to be called for every response received from the HMI
+void sys_host_hmi_response(const char* msg);
+
 int sys_host_get_compressor_mode(void);
 float sys_host_get_compressor_release(void);
 int sys_host_get_noisegate_channel(void);
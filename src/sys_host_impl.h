@@ -4,21 +4,33 @@
 
 #pragma once
 
-#define SYS_SERIAL_SHM "/sys_msgs"
+// layout of sys_serial_shm_data, bump version (and the name, which carries it) on any incompatible change
+// old clients then fail to find the shared memory instead of reading garbage from it
+#define SYS_SERIAL_SHM "/sys_msgs.2"
+#define SYS_SERIAL_SHM_MAGIC 0x6d737973 /* "sysm" */
+#define SYS_SERIAL_SHM_VERSION 2
+
+// socket used by the server to wait on its channel doorbell from the main loop
+#define SYS_SERIAL_DOORBELL_SOCKET "/tmp/sys_msgs.doorbell"
 
 // #include "lv2-hmi.h"
 
-#include "mod-semaphore.h"
+#include "mod-doorbell.h"
 
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-// must be 8192 - sizeof sys_serial_shm_data members, so we cleanly align to 64bits
-#define SYS_SERIAL_SHM_DATA_SIZE (8192 - sizeof(sem_t) - sizeof(uint32_t)*2)
+// ring buffer size, must be a power of 2 so head and tail can be free-running and masked on access
+#define SYS_SERIAL_SHM_DATA_SIZE 8192
+#define SYS_SERIAL_SHM_DATA_MASK (SYS_SERIAL_SHM_DATA_SIZE - 1)
+
+// head, tail and doorbell each get their own cache line, so producer and consumer do not fight over them
+#define SYS_SERIAL_SHM_CACHE_LINE_SIZE 64
 
 // using invalid ascii characters as to not conflict with regular text contents
 typedef enum {
@@ -83,16 +95,42 @@ const char* sys_serial_event_type_to_str(const sys_serial_event_type etype)
     return "unknown";
 }
 
+// every message is stored as a record header followed by the message itself, including its null byte
+// records are padded to the header size, so a header is never split at the end of the buffer
+typedef struct {
+    uint8_t etype;
+    // only used for client -> server messages, 0 otherwise
+    uint8_t page, subpage;
+    // etype with all bits flipped, to tell real records apart from garbage
+    uint8_t check;
+    uint32_t size;
+} sys_serial_record;
+
+#define SYS_SERIAL_RECORD_ALIGN sizeof(sys_serial_record)
+
+// single-producer, single-consumer ring
+// head and tail are free-running, accessed with acquire/release ordering so records are complete once visible
+// each side also keeps the last seen value of the other side's index, to avoid touching its cache line every time
 typedef struct {
-    // semaphore for syncing
-    sem_t sem;
-    // for ringbuffer-like access
-    uint32_t head, tail;
+    // written by the producer only
+    struct {
+        uint32_t head;
+        uint32_t cached_tail;
+    } __attribute__((aligned(SYS_SERIAL_SHM_CACHE_LINE_SIZE))) producer;
+    // written by the consumer only
+    struct {
+        uint32_t tail;
+        uint32_t cached_head;
+    } __attribute__((aligned(SYS_SERIAL_SHM_CACHE_LINE_SIZE))) consumer;
+    // for waking up the consumer
+    mod_doorbell doorbell __attribute__((aligned(SYS_SERIAL_SHM_CACHE_LINE_SIZE)));
     // actual data buffer
-    uint8_t buffer[SYS_SERIAL_SHM_DATA_SIZE];
+    uint8_t buffer[SYS_SERIAL_SHM_DATA_SIZE] __attribute__((aligned(SYS_SERIAL_SHM_CACHE_LINE_SIZE)));
 } sys_serial_shm_data_channel;
 
 typedef struct {
+    // written by the server once everything else is ready, checked by the client when opening
+    uint32_t magic, version, size;
     sys_serial_shm_data_channel server, client;
 } sys_serial_shm_data;
 
@@ -100,9 +138,6 @@ static inline
 bool sys_serial_open(int* shmfd, sys_serial_shm_data** data)
 {
     int fd;
-#ifdef SERVER_MODE
-    sem_t sem_server, sem_client;
-#endif
     sys_serial_shm_data* ptr;
 
 #ifdef SERVER_MODE
@@ -126,14 +161,13 @@ bool sys_serial_open(int* shmfd, sys_serial_shm_data** data)
         fprintf(stderr, "ftruncate failed\n");
         goto cleanup;
     }
-    if (sem_init(&sem_server, 1, 0) != 0)
-    {
-        fprintf(stderr, "server sem_init failed\n");
-        goto cleanup;
-    }
-    if (sem_init(&sem_client, 1, 0) != 0)
+#else
+    // touching memory past the end of the file would crash, so check before mapping it
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)sizeof(sys_serial_shm_data))
     {
-        fprintf(stderr, "client sem_init failed\n");
+        fprintf(stderr, "shm size mismatch\n");
         goto cleanup;
     }
 #endif
@@ -148,28 +182,32 @@ bool sys_serial_open(int* shmfd, sys_serial_shm_data** data)
     if (ptr == NULL || ptr == MAP_FAILED)
     {
         fprintf(stderr, "mmap failed\n");
-        goto cleanup_sem;
+        goto cleanup;
     }
 
 #ifdef SERVER_MODE
     memset(ptr, 0, sizeof(sys_serial_shm_data));
-    ptr->server.sem = sem_server;
-    ptr->client.sem = sem_client;
+    mod_doorbell_init(&ptr->server.doorbell);
+    mod_doorbell_init(&ptr->client.doorbell);
+    ptr->version = SYS_SERIAL_SHM_VERSION;
+    ptr->size = sizeof(sys_serial_shm_data);
+    __atomic_store_n(&ptr->magic, SYS_SERIAL_SHM_MAGIC, __ATOMIC_RELEASE);
+#else
+    if (__atomic_load_n(&ptr->magic, __ATOMIC_ACQUIRE) != SYS_SERIAL_SHM_MAGIC ||
+        ptr->version != SYS_SERIAL_SHM_VERSION || ptr->size != sizeof(sys_serial_shm_data))
+    {
+        fprintf(stderr, "shm layout mismatch, got version %u size %u, expected version %u size %u\n",
+                ptr->version, ptr->size, SYS_SERIAL_SHM_VERSION, (uint32_t)sizeof(sys_serial_shm_data));
+        munmap(ptr, sizeof(sys_serial_shm_data));
+        goto cleanup;
+    }
 #endif
 
     *shmfd = fd;
     *data = ptr;
     return true;
 
-cleanup_sem:
-#ifdef SERVER_MODE
-    sem_destroy(&sem_server);
-    sem_destroy(&sem_client);
-#endif
-
-#ifdef SERVER_MODE
 cleanup:
-#endif
     close(fd);
 #ifdef SERVER_MODE
     shm_unlink(SYS_SERIAL_SHM);
@@ -183,10 +221,6 @@ cleanup:
 static inline
 void sys_serial_close(int shmfd, sys_serial_shm_data* data)
 {
-#ifdef SERVER_MODE
-    sem_destroy(&data->server.sem);
-    sem_destroy(&data->client.sem);
-#endif
     munmap(data, sizeof(sys_serial_shm_data));
 
     close(shmfd);
@@ -195,7 +229,88 @@ void sys_serial_close(int shmfd, sys_serial_shm_data* data)
 #endif
 }
 
-// server, read must only be a result of a semaphore post action
+// total space taken by a record with a message of size bytes (including null byte)
+static inline
+uint32_t sys_serial_record_size(const uint32_t size)
+{
+    return (sizeof(sys_serial_record) + size + SYS_SERIAL_RECORD_ALIGN - 1) & ~(uint32_t)(SYS_SERIAL_RECORD_ALIGN - 1);
+}
+
+// copy into the ring at pos, in 2 parts if wrapping around the end
+static inline
+void sys_serial_copy_in(sys_serial_shm_data_channel* const data,
+                        const uint32_t pos, const void* const src, const uint32_t size)
+{
+    const uint32_t offset = pos & SYS_SERIAL_SHM_DATA_MASK;
+    const uint32_t firstpart = SYS_SERIAL_SHM_DATA_SIZE - offset;
+
+    if (size <= firstpart)
+    {
+        memcpy(data->buffer + offset, src, size);
+        return;
+    }
+
+    memcpy(data->buffer + offset, src, firstpart);
+    memcpy(data->buffer, (const uint8_t*)src + firstpart, size - firstpart);
+}
+
+// copy out of the ring at pos, in 2 parts if wrapping around the end
+static inline
+void sys_serial_copy_out(const sys_serial_shm_data_channel* const data,
+                         const uint32_t pos, void* const dst, const uint32_t size)
+{
+    const uint32_t offset = pos & SYS_SERIAL_SHM_DATA_MASK;
+    const uint32_t firstpart = SYS_SERIAL_SHM_DATA_SIZE - offset;
+
+    if (size <= firstpart)
+    {
+        memcpy(dst, data->buffer + offset, size);
+        return;
+    }
+
+    memcpy(dst, data->buffer + offset, firstpart);
+    memcpy((uint8_t*)dst + firstpart, data->buffer, size - firstpart);
+}
+
+// server or client, reading side: check if there is anything to read
+static inline
+bool sys_serial_pending(sys_serial_shm_data_channel* const data)
+{
+    const uint32_t tail = data->consumer.tail;
+
+    if (tail != data->consumer.cached_head)
+        return true;
+
+    data->consumer.cached_head = __atomic_load_n(&data->producer.head, __ATOMIC_ACQUIRE);
+    return tail != data->consumer.cached_head;
+}
+
+// server or client, reading side: wait until there is something to read, timeout < 0 means forever
+// spins for a little while first, as more data usually follows shortly during bursts
+static inline
+bool sys_serial_wait(sys_serial_shm_data_channel* const data, const int timeout_ms)
+{
+    for (int i = 0; i < MOD_DOORBELL_SPIN_COUNT; ++i)
+    {
+        if (sys_serial_pending(data))
+            return true;
+
+        mod_doorbell_cpu_relax();
+    }
+
+    mod_doorbell_sleep_begin(&data->doorbell);
+
+    // data might have arrived right before the producer could see us sleeping
+    if (! sys_serial_pending(data))
+        mod_doorbell_wait(&data->doorbell, timeout_ms);
+
+    mod_doorbell_sleep_cancel(&data->doorbell);
+    return sys_serial_pending(data);
+}
+
+// server or client, reading side
+// if a record looks corrupted, everything up to the last head seen is dropped,
+// as head always points to a record boundary and reading can safely restart from there
 static inline
 bool sys_serial_read(sys_serial_shm_data_channel* const data,
                      sys_serial_event_type* const etype,
@@ -204,17 +319,19 @@ bool sys_serial_read(sys_serial_shm_data_channel* const data,
 #endif
                      char msg[SYS_SERIAL_SHM_DATA_SIZE])
 {
-    if (data->head == data->tail)
+    if (! sys_serial_pending(data))
     {
         fprintf(stderr, "sys_serial_read: failed, there is nothing to read\n");
         return false;
     }
 
-    const uint32_t head = data->head;
-    const uint32_t tail = data->tail;
-    const uint8_t firstbyte = data->buffer[tail];
+    const uint32_t head = data->consumer.cached_head;
+    const uint32_t tail = data->consumer.tail;
+    sys_serial_record record;
 
-    switch (firstbyte)
+    memcpy(&record, data->buffer + (tail & SYS_SERIAL_SHM_DATA_MASK), sizeof(record));
+
+    switch (record.etype)
     {
 #ifdef SERVER_MODE
     case sys_serial_event_type_special_req:
@@ -237,54 +354,37 @@ bool sys_serial_read(sys_serial_shm_data_channel* const data,
         break;
 #endif
     default:
-        fprintf(stderr, "sys_serial_read: failed, invalid byte %02x\n", firstbyte);
-        data->tail = tail + 1;
-        return false;
+        fprintf(stderr, "sys_serial_read: failed, invalid record type %02x\n", record.etype);
+        goto drop;
     }
 
-    // keep reading until reaching null byte or head
-    uint32_t i, nexttail = tail + 1;
-#ifdef SERVER_MODE
-    // page
-    if (nexttail == SYS_SERIAL_SHM_DATA_SIZE)
-        nexttail = 0;
-    *page = data->buffer[nexttail++];
-    // subpage
-    if (nexttail == SYS_SERIAL_SHM_DATA_SIZE)
-        nexttail = 0;
-    *subpage = data->buffer[nexttail++];
-#endif
-    for (i=0; i < SYS_SERIAL_SHM_DATA_SIZE; ++i, ++nexttail)
+    if ((record.check ^ record.etype) != 0xff || record.size == 0 ||
+        record.size > SYS_SERIAL_SHM_DATA_SIZE || sys_serial_record_size(record.size) > head - tail)
     {
-        if (nexttail == SYS_SERIAL_SHM_DATA_SIZE)
-            nexttail = 0;
-
-        msg[i] = data->buffer[nexttail];
-
-        if (msg[i] == '\0')
-        {
-            if (++nexttail == SYS_SERIAL_SHM_DATA_SIZE)
-                nexttail = 0;
-            break;
-        }
-
-        if (nexttail == head)
-        {
-            i = SYS_SERIAL_SHM_DATA_SIZE;
-            break;
-        }
+        fprintf(stderr, "sys_serial_read: failed, corrupted record header\n");
+        goto drop;
     }
 
-    if (i == SYS_SERIAL_SHM_DATA_SIZE)
+    sys_serial_copy_out(data, tail + sizeof(record), msg, record.size);
+
+    if (msg[record.size - 1] != '\0')
     {
-        fprintf(stderr, "sys_serial_read: failed, tail reached head without finding null byte\n");
-        data->tail = head;
-        return false;
+        fprintf(stderr, "sys_serial_read: failed, record is not null terminated\n");
+        goto drop;
     }
 
-    *etype = firstbyte;
-    data->tail = nexttail;
+    *etype = record.etype;
+#ifdef SERVER_MODE
+    *page = record.page;
+    *subpage = record.subpage;
+#endif
+    __atomic_store_n(&data->consumer.tail, tail + sys_serial_record_size(record.size), __ATOMIC_RELEASE);
     return true;
+
+drop:
+    fprintf(stderr, "sys_serial_read: dropping %u bytes\n", head - tail);
+    __atomic_store_n(&data->consumer.tail, head, __ATOMIC_RELEASE);
+    return false;
 }
 
 // client, not thread-safe, needs write lock
@@ -296,73 +396,54 @@ bool sys_serial_write(sys_serial_shm_data_channel* const data,
 #endif
                       const char* const msg)
 {
-    uint32_t size = strlen(msg);
+    const size_t len = strlen(msg);
 
 #ifdef SERVER_MODE
-    if (size == 0)
+    if (len == 0)
     {
         fprintf(stderr, "sys_serial_write: failed, empty message\n");
         return false;
     }
 #endif
-    if (size >= SYS_SERIAL_SHM_DATA_SIZE)
+    if (len >= SYS_SERIAL_SHM_DATA_SIZE - sizeof(sys_serial_record))
     {
         fprintf(stderr, "sys_serial_write: failed, message too big\n");
         return false;
     }
 
-    // add space for etype and terminating null byte
-    size += 2;
+    // add space for terminating null byte
+    const uint32_t size = (uint32_t)len + 1;
+    const uint32_t recsize = sys_serial_record_size(size);
 
-#ifndef SERVER_MODE
-    // add space for page and subpage
-    size += 2;
-#endif
-
-    /* */ uint32_t head = data->head;
-    const uint32_t tail = data->tail;
-    const uint32_t wrap = tail > head ? 0 : SYS_SERIAL_SHM_DATA_SIZE;
+    const uint32_t head = data->producer.head;
 
-    if (size >= wrap + tail - head)
+    // only look at the real tail if the last one seen is not enough
+    if (recsize > SYS_SERIAL_SHM_DATA_SIZE - (head - data->producer.cached_tail))
     {
-        fprintf(stderr, "sys_serial_write: failed, not enough space\n");
-        return false;
-    }
+        data->producer.cached_tail = __atomic_load_n(&data->consumer.tail, __ATOMIC_ACQUIRE);
 
-    data->buffer[head] = etype;
+        if (recsize > SYS_SERIAL_SHM_DATA_SIZE - (head - data->producer.cached_tail))
+        {
+            fprintf(stderr, "sys_serial_write: failed, not enough space\n");
+            return false;
+        }
+    }
 
+    const sys_serial_record record = {
+        .etype = etype,
 #ifndef SERVER_MODE
-    if (++head == SYS_SERIAL_SHM_DATA_SIZE)
-        head = 0;
-    data->buffer[head] = page;
-    if (++head == SYS_SERIAL_SHM_DATA_SIZE)
-        head = 0;
-    data->buffer[head] = subpage;
-    size -= 2;
+        .page = page,
+        .subpage = subpage,
 #endif
+        .check = (uint8_t)~etype,
+        .size = size,
+    };
 
-    uint32_t nexthead = head + size;
-
-    if (nexthead > SYS_SERIAL_SHM_DATA_SIZE)
-    {
-        nexthead -= SYS_SERIAL_SHM_DATA_SIZE;
-
-        const uint32_t firstpart = SYS_SERIAL_SHM_DATA_SIZE - head - 1;
-
-        if (firstpart != 0)
-            memcpy(data->buffer + head + 1, msg, firstpart);
-
-        memcpy(data->buffer, msg + firstpart, nexthead);
-    }
-    else
-    {
-        if (nexthead == SYS_SERIAL_SHM_DATA_SIZE)
-            nexthead = 0;
-
-        memcpy(data->buffer + head + 1, msg, size - 1);
-    }
+    // header is aligned and never wraps, the message might
+    memcpy(data->buffer + (head & SYS_SERIAL_SHM_DATA_MASK), &record, sizeof(record));
+    sys_serial_copy_in(data, head + sizeof(record), msg, size);
 
-    data->head = nexthead;
-    sem_post(&data->sem);
+    __atomic_store_n(&data->producer.head, head + recsize, __ATOMIC_RELEASE);
+    mod_doorbell_ring(&data->doorbell);
     return true;
 }
@@ -3,229 +3,444 @@
  */
 
 #include "sys_mixer.h"
-#include "serial.h"
+#include "mixer.h"
+#include "monotonic.h"
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+// minimum time between writes of the same control, so fast encoder sweeps do not flood the hardware
+// can be changed per device through MOD_MIXER_MIN_INTERVAL_MS, e.g. "50" or "50,hp=100,cvexp=0"
+#define MIXER_DEFAULT_MIN_INTERVAL_MS 50
+
+// mixer state is saved once nothing changed for this long, instead of on every HMI request
+// can be changed through MOD_MIXER_SAVE_DELAY_MS
+#define MIXER_DEFAULT_SAVE_DELAY_MS 3000
+
+// each lane has its own thread, so a slow write in one of them does not hold back the others
+// controls within a lane are still applied in order, by that lane only
+typedef struct sys_mixer_lane {
+    uint32_t controls;
+    sem_t semaphore;
+    pthread_t thread;
+} sys_mixer_lane;
+
+static volatile bool sys_mixer_lanes_running;
+static sys_mixer_lane sys_mixer_lanes[MIXER_LANE_COUNT];
+
+// the main mixer thread only takes care of saving state
 static volatile bool sys_mixer_thread_running;
 static sem_t sys_mixer_semaphore;
 static pthread_t sys_mixer_thread;
 static bool s_debug;
 
-// defined in reply.c
-/*static*/ bool execute_ignoring_output(struct sp_port* const serialport, const char* argv[], const bool debug);
+// latest requested value of each mixer control, and which ones still need to be applied
+// the serial side only does atomic stores and never waits, the mixer thread drains all dirty controls at once
+// NOTE values are stored as raw float bits so they can be read and written atomically
+static uint32_t pending_values[MIXER_CONTROL_COUNT];
+static uint32_t pending_dirty;
+
+// controls set through us, for which pending_values is what the HMI expects to read back
+// even while the value is still waiting for its lane (or its min interval) to be applied
+static uint32_t pending_known;
 
-typedef struct amixer_msg {
-    bool valid;
-    bool input;
-    char channel;
-    char control[9]; /* biggest possible is "exppedal" */
-    char value[8];
-} amixer_msg;
+// set when the HMI asks for mixer state to be saved, or when a lane changed something
+static uint32_t save_requested;
+static uint32_t save_changed;
 
-static struct amixer_msg last_amixer_msg;
-static pthread_mutex_t last_amixer_mutex = PTHREAD_MUTEX_INITIALIZER;
+// min_interval_ms is read-only after setup, each last_write_ms entry is only used by the lane of its control
+static unsigned int min_interval_ms[MIXER_CONTROL_COUNT];
+static int64_t last_write_ms[MIXER_CONTROL_COUNT];
+static unsigned int save_delay_ms;
 
-static void handle_postponed_message(const amixer_msg* const msg)
+static void handle_postponed_message(const mixer_value* const values, const int count)
 {
-    // headphone mode
-    if (msg->channel == 'h')
+    if (mixer_set_batch(values, count))
+        return;
+
+    for (int i = 0; i < count; ++i)
     {
-        const char* argv[] = { "mod-amixer", "hp", "xvol", msg->value, NULL };
+        fprintf(stderr, "%s failed, cannot set mixer control '%s'\n",
+                __func__, mixer_control_name(values[i].control));
+
+        // hardware state is unknown now, let getters ask the driver
+        __atomic_fetch_and(&pending_known, ~(1u << values[i].control), __ATOMIC_RELAXED);
+    }
+}
 
-        execute_ignoring_output(NULL, argv, s_debug);
+static int mixer_control_from_name(const char* const name)
+{
+    for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
+    {
+        if (strcmp(mixer_control_name((mixer_control)i), name) == 0)
+            return i;
     }
-    // cv related stuff
-    else if (msg->channel == 'v')
+
+    return -1;
+}
+
+static void setup_min_intervals(void)
+{
+    const char* const spec = getenv("MOD_MIXER_MIN_INTERVAL_MS");
+    char buf[0xff];
+    char* saveptr;
+    char* end;
+
+    for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
+        min_interval_ms[i] = MIXER_DEFAULT_MIN_INTERVAL_MS;
+
+    if (spec == NULL)
+        return;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    // comma separated list of "ms" for all controls or "name=ms" for a single one
+    for (char* item = strtok_r(buf, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
     {
-        const char* argv[] = { "mod-amixer", msg->control, msg->value, NULL };
+        char* const equal = strchr(item, '=');
+        const char* const value = equal != NULL ? equal + 1 : item;
+        int control = MIXER_CONTROL_COUNT;
+
+        if (equal != NULL)
+        {
+            *equal = '\0';
+            control = mixer_control_from_name(item);
+        }
+
+        const unsigned long interval = strtoul(value, &end, 10);
 
-        execute_ignoring_output(NULL, argv, s_debug);
+        if (control < 0 || end == value || *end != '\0')
+        {
+            fprintf(stderr, "%s failed, invalid MOD_MIXER_MIN_INTERVAL_MS entry '%s'\n", __func__, item);
+            continue;
+        }
+
+        for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
+        {
+            if (control == MIXER_CONTROL_COUNT || control == i)
+                min_interval_ms[i] = (unsigned int)interval;
+        }
     }
-    // gain mode
-    else
+
+    if (s_debug)
     {
-        const char* const io = msg->input ? "in" : "out";
-        const char channelstr[2] = { msg->channel, '\0' };
-        const char* argv[] = { "mod-amixer", io, channelstr, "xvol", msg->value, NULL };
+        for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
+            printf("%s: mixer control '%s' is written at most every %u ms\n",
+                   __func__, mixer_control_name((mixer_control)i), min_interval_ms[i]);
+    }
+}
+
+static void setup_save_delay(void)
+{
+    const char* const spec = getenv("MOD_MIXER_SAVE_DELAY_MS");
+    char* end;
+
+    save_delay_ms = MIXER_DEFAULT_SAVE_DELAY_MS;
+
+    if (spec == NULL)
+        return;
 
-        execute_ignoring_output(NULL, argv, s_debug);
+    const unsigned long delay = strtoul(spec, &end, 10);
+
+    if (end == spec || *end != '\0')
+    {
+        fprintf(stderr, "%s failed, invalid MOD_MIXER_SAVE_DELAY_MS '%s'\n", __func__, spec);
+        return;
     }
+
+    save_delay_ms = (unsigned int)delay;
 }
 
-static void* postponed_messages_thread_run(void* const arg)
+// apply dirty controls of a lane in one go, except those written too recently which are kept in deferred for later
+// next is set to the time at which the next deferred control can be written, or 0 if nothing is deferred
+// returns the number of controls written
+static int handle_postponed_messages(const sys_mixer_lane* const lane,
+                                     uint32_t* const deferred, int64_t* const next, const bool force)
 {
-    struct amixer_msg local_amixer_msg;
-    memset(&local_amixer_msg, 0, sizeof(local_amixer_msg));
+    const uint32_t dirty = (__atomic_fetch_and(&pending_dirty, ~lane->controls, __ATOMIC_ACQUIRE) & lane->controls)
+                         | *deferred;
+    const int64_t now = monotonic_ms();
+    mixer_value values[MIXER_CONTROL_COUNT];
+    int count = 0;
+    uint32_t bits;
 
-    while (sys_mixer_thread_running)
+    *deferred = 0;
+    *next = 0;
+
+    for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
     {
-        pthread_mutex_lock(&last_amixer_mutex);
+        if ((dirty & (1u << i)) == 0)
+            continue;
 
-        if (last_amixer_msg.valid)
+        // too soon, try again later with whatever the latest value is by then
+        if (! force && last_write_ms[i] != 0 && now < last_write_ms[i] + min_interval_ms[i])
         {
-            local_amixer_msg = last_amixer_msg;
-            last_amixer_msg.valid = false;
-        }
+            const int64_t when = last_write_ms[i] + min_interval_ms[i];
 
-        pthread_mutex_unlock(&last_amixer_mutex);
+            *deferred |= 1u << i;
 
-        if (local_amixer_msg.valid)
-        {
-            local_amixer_msg.valid = false;
-            handle_postponed_message(&local_amixer_msg);
+            if (*next == 0 || when < *next)
+                *next = when;
+
+            continue;
         }
 
-        sem_wait(&sys_mixer_semaphore);
+        // a newer value might have arrived meanwhile, that is fine as its dirty bit is set again
+        bits = __atomic_load_n(&pending_values[i], __ATOMIC_RELAXED);
+        memcpy(&values[count].value, &bits, sizeof(float));
+        values[count++].control = (mixer_control)i;
+
+        last_write_ms[i] = now;
     }
 
-    return NULL;
+    // everything that is ready goes out together, as a single helper call where possible
+    // NOTE a restore touching several lanes still costs one call per lane, but those run in parallel;
+    // batching across lanes would make this lane wait for the others, which is what lanes are meant to avoid
+    if (count != 0)
+        handle_postponed_message(values, count);
 
-    // unused
-    (void)arg;
+    return count;
 }
 
-void sys_mixer_setup(const bool debug)
+static void save_mixer_state(void)
 {
-    s_debug = debug;
-    sys_mixer_thread_running = true;
-    sem_init(&sys_mixer_semaphore, 0, 0);
-    pthread_create(&sys_mixer_thread, NULL, postponed_messages_thread_run, NULL);
+    if (s_debug)
+        printf("%s: saving mixer state\n", __func__);
+
+    if (! mixer_save())
+        fprintf(stderr, "%s failed, cannot save mixer state\n", __func__);
 }
 
-void sys_mixer_destroy()
+static void wait_until(sem_t* const sem, const int64_t deadline_ms)
 {
-    sys_mixer_thread_running = false;
+    const int64_t now = monotonic_ms();
+
+    if (deadline_ms <= now)
+        return;
+
+    // deadline is monotonic, so wall clock changes neither shorten nor stretch the wait
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ms / 1000),
+        .tv_nsec = (long)(deadline_ms % 1000) * 1000000,
+    };
+
+    while (sem_clockwait(sem, CLOCK_MONOTONIC, &ts) != 0 && errno == EINTR) {}
+}
+
+static void lane_changed(void)
+{
+    __atomic_store_n(&save_changed, 1, __ATOMIC_RELEASE);
     sem_post(&sys_mixer_semaphore);
-    pthread_join(sys_mixer_thread, NULL);
-    sem_destroy(&sys_mixer_semaphore);
 }
 
-void sys_mixer_gain(bool input, char channel, const char* value)
+static void* lane_thread_run(void* const arg)
 {
-    pthread_mutex_lock(&last_amixer_mutex);
+    sys_mixer_lane* const lane = arg;
+    uint32_t deferred = 0;
+    int64_t next;
 
-    // trigger previously cached value if does not match current one
-    if (last_amixer_msg.valid && (last_amixer_msg.input != input ||
-                                  last_amixer_msg.channel != channel ||
-                                  strcmp(last_amixer_msg.control, "xvol") != 0))
+    while (sys_mixer_lanes_running)
     {
-        handle_postponed_message(&last_amixer_msg);
-    }
+        if (handle_postponed_messages(lane, &deferred, &next, false) != 0)
+            lane_changed();
 
-    // cache request for later handling
-    last_amixer_msg.valid = true;
-    last_amixer_msg.input = input;
-    last_amixer_msg.channel = channel;
-    strcpy(last_amixer_msg.control, "xvol");
-    strncpy(last_amixer_msg.value, value, sizeof(last_amixer_msg.value)-1);
+        if (next != 0)
+            wait_until(&lane->semaphore, next);
+        else
+            sem_wait(&lane->semaphore);
+    }
 
-    sem_post(&sys_mixer_semaphore);
-    pthread_mutex_unlock(&last_amixer_mutex);
+    // make sure the last requested values land before quitting
+    if (handle_postponed_messages(lane, &deferred, &next, true) != 0)
+        lane_changed();
 
-    if (s_debug)
-        printf("%s: postponing amixer gain value set\n", __func__);
+    return NULL;
 }
 
-void sys_mixer_headphone(const char* value)
+static void* postponed_messages_thread_run(void* const arg)
 {
-    pthread_mutex_lock(&last_amixer_mutex);
+    int64_t save_at = 0;
+    bool unsaved = false;
 
-    // trigger previously cached value if does not match current one
-    if (last_amixer_msg.valid && (last_amixer_msg.channel != 'h' ||
-                                  strcmp(last_amixer_msg.control, "xvol") != 0))
+    while (sys_mixer_thread_running)
     {
-        handle_postponed_message(&last_amixer_msg);
+        const bool requested = __atomic_exchange_n(&save_requested, 0, __ATOMIC_ACQUIRE) != 0;
+
+        // any change pushes the save further, so it only happens once things are quiet
+        if (__atomic_exchange_n(&save_changed, 0, __ATOMIC_ACQUIRE) != 0)
+        {
+            unsaved = true;
+            save_at = monotonic_ms() + save_delay_ms;
+        }
+
+        // an explicit request only brings a pending save forward, with nothing changed there is nothing to save
+        if (requested && unsaved)
+            save_at = 0;
+
+        if (unsaved && monotonic_ms() >= save_at)
+        {
+            unsaved = false;
+            save_mixer_state();
+        }
+
+        if (unsaved)
+            wait_until(&sys_mixer_semaphore, save_at);
+        else
+            sem_wait(&sys_mixer_semaphore);
     }
 
-    // cache request for later handling
-    last_amixer_msg.valid = true;
-    last_amixer_msg.input = false;
-    last_amixer_msg.channel = 'h';
-    strcpy(last_amixer_msg.control, "xvol");
-    strncpy(last_amixer_msg.value, value, sizeof(last_amixer_msg.value)-1);
+    // lanes are stopped before us, so this catches their last changes
+    if (__atomic_exchange_n(&save_changed, 0, __ATOMIC_ACQUIRE) != 0 || unsaved)
+        save_mixer_state();
 
-    sem_post(&sys_mixer_semaphore);
-    pthread_mutex_unlock(&last_amixer_mutex);
+    return NULL;
 
-    if (s_debug)
-        printf("%s: postponing amixer hp gain value set\n", __func__);
+    // unused
+    (void)arg;
 }
 
-void sys_mixer_cv_exp_toggle(const char* value)
+static void postpone_control(const mixer_control control, const float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    __atomic_store_n(&pending_values[control], bits, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&pending_known, 1u << control, __ATOMIC_RELEASE);
+    __atomic_fetch_or(&pending_dirty, 1u << control, __ATOMIC_RELEASE);
+}
+
+static void postpone_message(const mixer_control control, const bool stereo, const char* const value)
 {
-    pthread_mutex_lock(&last_amixer_mutex);
+    float fvalue;
 
-    // trigger previously cached value if does not match current one
-    if (last_amixer_msg.valid && (last_amixer_msg.channel != 'v' ||
-                                  strcmp(last_amixer_msg.control, "cvexp") != 0))
+    if (! mixer_parse_value(control, value, &fvalue))
     {
-        handle_postponed_message(&last_amixer_msg);
+        fprintf(stderr, "%s failed, invalid value '%s' for mixer control '%s'\n",
+                __func__, value, mixer_control_name(control));
+        return;
     }
 
-    // cache request for later handling
-    last_amixer_msg.valid = true;
-    last_amixer_msg.input = false;
-    last_amixer_msg.channel = 'v';
-    strcpy(last_amixer_msg.control, "cvexp");
-    strncpy(last_amixer_msg.value, value, sizeof(last_amixer_msg.value)-1);
+    // cache request for later handling, replacing any value not applied yet
+    postpone_control(control, fvalue);
 
-    sem_post(&sys_mixer_semaphore);
-    pthread_mutex_unlock(&last_amixer_mutex);
+    // set control and the one after it (both channels)
+    // NOTE stereo pairs always belong to the same lane
+    if (stereo)
+        postpone_control(control + 1, fvalue);
+
+    sem_post(&sys_mixer_lanes[mixer_control_lane(control)].semaphore);
 
     if (s_debug)
-        printf("%s: postponing amixer cv exp toggle\n", __func__);
+        printf("%s: postponing mixer control '%s' set\n", __func__, mixer_control_name(control));
 }
 
-void sys_mixer_exp_mode(const char* value)
+void sys_mixer_setup(const bool debug)
 {
-    pthread_mutex_lock(&last_amixer_mutex);
+    s_debug = debug;
+    pending_dirty = 0;
+    pending_known = 0;
+    save_requested = 0;
+    save_changed = 0;
+    memset(last_write_ms, 0, sizeof(last_write_ms));
+    setup_min_intervals();
+    setup_save_delay();
+    mixer_init(NULL, debug);
+
+    sys_mixer_thread_running = true;
+    sem_init(&sys_mixer_semaphore, 0, 0);
+    pthread_create(&sys_mixer_thread, NULL, postponed_messages_thread_run, NULL);
 
-    // trigger previously cached value if does not match current one
-    if (last_amixer_msg.valid && (last_amixer_msg.channel != 'v' ||
-                                  strcmp(last_amixer_msg.control, "exppedal") != 0))
+    sys_mixer_lanes_running = true;
+
+    for (int i = 0; i < MIXER_LANE_COUNT; ++i)
     {
-        handle_postponed_message(&last_amixer_msg);
-    }
+        sys_mixer_lane* const lane = &sys_mixer_lanes[i];
 
-    // cache request for later handling
-    last_amixer_msg.valid = true;
-    last_amixer_msg.input = false;
-    last_amixer_msg.channel = 'v';
-    strcpy(last_amixer_msg.control, "exppedal");
-    strncpy(last_amixer_msg.value, value, sizeof(last_amixer_msg.value)-1);
+        lane->controls = 0;
 
-    sem_post(&sys_mixer_semaphore);
-    pthread_mutex_unlock(&last_amixer_mutex);
+        for (int c = 0; c < MIXER_CONTROL_COUNT; ++c)
+        {
+            if (mixer_control_lane((mixer_control)c) == (mixer_lane)i)
+                lane->controls |= 1u << c;
+        }
 
-    if (s_debug)
-        printf("%s: postponing amixer exp mode set\n", __func__);
+        sem_init(&lane->semaphore, 0, 0);
+        pthread_create(&lane->thread, NULL, lane_thread_run, lane);
+    }
 }
 
-void sys_mixer_cv_headphone_toggle(const char* value)
+void sys_mixer_destroy()
 {
-    pthread_mutex_lock(&last_amixer_mutex);
+    sys_mixer_lanes_running = false;
 
-    // trigger previously cached value if does not match current one
-    if (last_amixer_msg.valid && (last_amixer_msg.channel != 'v' ||
-                                  strcmp(last_amixer_msg.control, "cvhp") != 0))
+    for (int i = 0; i < MIXER_LANE_COUNT; ++i)
+        sem_post(&sys_mixer_lanes[i].semaphore);
+
+    for (int i = 0; i < MIXER_LANE_COUNT; ++i)
     {
-        handle_postponed_message(&last_amixer_msg);
+        pthread_join(sys_mixer_lanes[i].thread, NULL);
+        sem_destroy(&sys_mixer_lanes[i].semaphore);
     }
 
-    // cache request for later handling
-    last_amixer_msg.valid = true;
-    last_amixer_msg.input = false;
-    last_amixer_msg.channel = 'v';
-    strcpy(last_amixer_msg.control, "cvhp");
-    strncpy(last_amixer_msg.value, value, sizeof(last_amixer_msg.value)-1);
+    sys_mixer_thread_running = false;
+    sem_post(&sys_mixer_semaphore);
+    pthread_join(sys_mixer_thread, NULL);
+    sem_destroy(&sys_mixer_semaphore);
+
+    // the driver is gone, whatever comes next has to ask the new one
+    pending_known = 0;
+    mixer_cleanup();
+}
+
+bool sys_mixer_get(const mixer_control control, float* const value)
+{
+    if ((__atomic_load_n(&pending_known, __ATOMIC_ACQUIRE) & (1u << control)) == 0)
+        return mixer_get(control, value);
+
+    const uint32_t bits = __atomic_load_n(&pending_values[control], __ATOMIC_RELAXED);
+    memcpy(value, &bits, sizeof(*value));
+    return true;
+}
 
+bool sys_mixer_save(void)
+{
+    // nothing to fold the request into, save right away
+    if (! sys_mixer_thread_running)
+        return mixer_save();
+
+    __atomic_store_n(&save_requested, 1, __ATOMIC_RELEASE);
     sem_post(&sys_mixer_semaphore);
-    pthread_mutex_unlock(&last_amixer_mutex);
+    return true;
+}
 
-    if (s_debug)
-        printf("%s: postponing amixer cv hp toggle\n", __func__);
+void sys_mixer_gain(bool input, char channel, const char* value)
+{
+    postpone_message(mixer_control_for_gain(input, channel), channel == '0', value);
+}
+
+void sys_mixer_headphone(const char* value)
+{
+    postpone_message(MIXER_CONTROL_HP, false, value);
+}
+
+void sys_mixer_cv_exp_toggle(const char* value)
+{
+    postpone_message(MIXER_CONTROL_CV_EXP, false, value);
+}
+
+void sys_mixer_exp_mode(const char* value)
+{
+    postpone_message(MIXER_CONTROL_EXP_PEDAL, false, value);
+}
+
+void sys_mixer_cv_headphone_toggle(const char* value)
+{
+    postpone_message(MIXER_CONTROL_CV_HP, false, value);
 }
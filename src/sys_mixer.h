@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include "mixer.h"
+
 #include <stdbool.h>
 
 void sys_mixer_setup(bool debug);
@@ -13,4 +15,11 @@ void sys_mixer_gain(bool input, char channel, const char* value);
 void sys_mixer_headphone(const char* value);
 void sys_mixer_cv_exp_toggle(const char* value);
 void sys_mixer_exp_mode(const char* value);
-void sys_mixer_cv_headphone_toggle(const char* value);
\ No newline at end of file
+void sys_mixer_cv_headphone_toggle(const char* value);
+
+// latest value set through the functions above, even if not applied yet, otherwise same as mixer_get
+bool sys_mixer_get(mixer_control control, float* value);
+
+// mixer state is saved automatically a few seconds after the last change and on shutdown,
+// this saves pending changes right away instead, and does nothing if there are none
+bool sys_mixer_save(void);
\ No newline at end of file
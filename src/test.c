@@ -2,9 +2,15 @@
  * This file is part of mod-system-control.
  */
 
+#include "event_loop.h"
+#include "mixer.h"
+#include "monotonic.h"
 #include "serial_io.h"
 #include "serial_rw.h"
 #include "reply.h"
+#include "sys_host.h"
+#include "sys_host_impl.h"
+#include "sys_mixer.h"
 
 #include "../mod-controller-proto/mod-protocol.h"
 
@@ -15,12 +21,21 @@
 #include <assert.h>
 
 #define _GNU_SOURCE
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+static void run_event_loop(unsigned int ms);
+static int read_hmi_push(struct sp_port* hmi, char buf[0xff]);
+static int read_hmi_pushes(struct sp_port* hmi, char bufs[][0xff], int max);
 static void update_syscmd_size(char cmdbuf[0xff]);
 static void test_hmi_command(struct sp_port* hmi, struct sp_port* sys, const char* cmd, const char* resp);
+static bool file_has_line(const char* filename, const char* line);
+static int file_count_lines(const char* filename, const char* prefix);
+static bool wait_for_file_line(const char* filename, const char* line, int timeout_ms);
 
 int main(int argc, char* argv[])
 {
@@ -260,6 +275,513 @@ int main(int argc, char* argv[])
     assert(ret == SP_READ_ERROR_NO_DATA);
     printf("\n");
 
+    // --------------------------------------------------------------------------------------------
+    // buffered reader, several messages read with a single call
+
+    static serial_rx rx;
+    serial_rx_init(&rx);
+
+    printf("TEST: write burst of messages from hmi side\n");
+    assert(write_or_close(serialport_hmi, "sys_ver 07 version"));
+    assert(write_or_close(serialport_hmi, "sys_gibberish"));
+    assert(write_or_close(serialport_hmi, "sys_ser"));
+    printf("\n");
+
+    printf("TEST: read burst of messages from sys side\n");
+    ret = serial_rx_fill(serialport_sys, &rx);
+    assert(ret == sizeof("sys_ver 07 version") + sizeof("sys_gibberish") + sizeof("sys_ser"));
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == strlen("sys_ver 07 version"));
+    assert(strcmp(buf, "sys_ver 07 version") == 0);
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == SP_READ_ERROR_INVALID_DATA);
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == strlen("sys_ser"));
+    assert(strcmp(buf, "sys_ser") == 0);
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    // --------------------------------------------------------------------------------------------
+    // buffered reader, message split across reads
+
+    printf("TEST: write partial message from hmi side\n");
+    assert(sp_nonblocking_write(serialport_hmi, "sys_ver 07 ve", 13) == 13);
+    printf("\n");
+
+    printf("TEST: read partial message from sys side\n");
+    ret = serial_rx_fill(serialport_sys, &rx);
+    assert(ret == 13);
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    printf("TEST: write rest of partial message from hmi side\n");
+    assert(write_or_close(serialport_hmi, "rsion"));
+    printf("\n");
+
+    printf("TEST: read rest of partial message from sys side\n");
+    ret = serial_rx_fill(serialport_sys, &rx);
+    assert(ret == sizeof("rsion"));
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == strlen("sys_ver 07 version"));
+    assert(strcmp(buf, "sys_ver 07 version") == 0);
+    ret = serial_rx_next_msg(&rx, buf, false);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    // --------------------------------------------------------------------------------------------
+    // queued writes, only sent out on flush
+
+    printf("TEST: queue messages from sys side\n");
+    assert(serial_tx_attach(serialport_sys));
+    assert(write_or_close(serialport_sys, "r 0"));
+    assert(write_or_close(serialport_sys, "r -1"));
+    assert(serial_tx_queue_depth() == 2);
+    ret = serial_read_msg_until_zero(serialport_hmi, buf, false);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    printf("TEST: flush queued messages from sys side\n");
+    assert(serial_tx_flush());
+    assert(serial_tx_queue_depth() == 0);
+    serial_tx_detach();
+    assert(serial_read_response(serialport_hmi, buf));
+    assert(strcmp(buf, "r 0") == 0);
+    assert(serial_read_response(serialport_hmi, buf));
+    assert(strcmp(buf, "r -1") == 0);
+    printf("\n");
+
+    // --------------------------------------------------------------------------------------------
+    // mixer engine, using the file-backed driver
+
+    printf("TEST: mixer set and get with file driver\n");
+    char mixerdir[] = "/tmp/mod-mixer-test-XXXXXX";
+    assert(mkdtemp(mixerdir) != NULL);
+    setenv("MOD_MIXER_STATE_DIR", mixerdir, 1);
+    assert(mixer_init("file", false));
+    float mixervalue;
+    char mixerstr[MIXER_VALUE_SIZE];
+    assert(mixer_get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == 0.f);
+    assert(mixer_set(MIXER_CONTROL_IN1, -3.5f));
+    assert(mixer_get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == -3.5f);
+    assert(mixer_driver_file.get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == -3.5f);
+    assert(mixer_parse_value(MIXER_CONTROL_CV_EXP, "exp", &mixervalue) && mixervalue == 1.f);
+    assert(mixer_set(MIXER_CONTROL_CV_EXP, mixervalue));
+    assert(mixer_get(MIXER_CONTROL_CV_EXP, &mixervalue));
+    mixer_format_value(MIXER_CONTROL_CV_EXP, mixervalue, mixerstr);
+    assert(strcmp(mixerstr, "exp") == 0);
+    assert(! mixer_parse_value(MIXER_CONTROL_CV_HP, "2", &mixervalue));
+    const mixer_value mixerbatch[] = {
+        { MIXER_CONTROL_OUT1, -6.f },
+        { MIXER_CONTROL_OUT2, -6.f },
+        { MIXER_CONTROL_HP, 3.f },
+    };
+    assert(mixer_set_batch(mixerbatch, sizeof(mixerbatch)/sizeof(mixerbatch[0])));
+    assert(mixer_get(MIXER_CONTROL_OUT2, &mixervalue) && mixervalue == -6.f);
+    assert(mixer_get(MIXER_CONTROL_HP, &mixervalue) && mixervalue == 3.f);
+    mixer_cleanup();
+    printf("\n");
+
+    // values known from before are gone after cleanup, so these really come from the files
+    printf("TEST: mixer get with file driver reads values back\n");
+    assert(mixer_init("file", false));
+    assert(mixer_get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == -3.5f);
+    assert(mixer_get(MIXER_CONTROL_OUT2, &mixervalue) && mixervalue == -6.f);
+    assert(mixer_get(MIXER_CONTROL_CV_EXP, &mixervalue) && mixervalue == 1.f);
+    mixer_cleanup();
+    printf("\n");
+
+    // the second set is held back by the min interval, the HMI must still read it back right away
+    printf("TEST: sys mixer get right after set\n");
+    setenv("MOD_MIXER_DRIVER", "file", 1);
+    setenv("MOD_MIXER_MIN_INTERVAL_MS", "in1=1000", 1);
+    sys_mixer_setup(false);
+    sys_mixer_gain(true, '1', "-9");
+    assert(sys_mixer_get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == -9.f);
+    sys_mixer_gain(true, '1', "-12");
+    assert(sys_mixer_get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == -12.f);
+    assert(sys_mixer_get(MIXER_CONTROL_OUT2, &mixervalue) && mixervalue == -6.f);
+    sys_mixer_destroy();
+    assert(mixer_driver_file.get(MIXER_CONTROL_IN1, &mixervalue) && mixervalue == -12.f);
+    unsetenv("MOD_MIXER_MIN_INTERVAL_MS");
+    printf("\n");
+
+    // the file driver leaves a line in "saves" for every save
+    printf("TEST: sys mixer saves once per quiet period and only if something changed\n");
+    char mixersaves[PATH_MAX];
+    snprintf(mixersaves, sizeof(mixersaves), "%s/saves", mixerdir);
+    unlink(mixersaves);
+    setenv("MOD_MIXER_SAVE_DELAY_MS", "100", 1);
+    sys_mixer_setup(false);
+    assert(sys_mixer_save());
+    usleep(300 * 1000);
+    assert(file_count_lines(mixersaves, "save") == 0);
+    sys_mixer_gain(false, '1', "-1");
+    sys_mixer_gain(false, '1', "-2");
+    sys_mixer_gain(false, '1', "-3");
+    usleep(400 * 1000);
+    assert(file_count_lines(mixersaves, "save") == 1);
+    assert(sys_mixer_save());
+    usleep(300 * 1000);
+    assert(file_count_lines(mixersaves, "save") == 1);
+    sys_mixer_headphone("-4");
+    sys_mixer_destroy();
+    assert(file_count_lines(mixersaves, "save") == 2);
+    unsetenv("MOD_MIXER_SAVE_DELAY_MS");
+    unsetenv("MOD_MIXER_DRIVER");
+    printf("\n");
+
+    // "in xall" and "out xall" must give the same values as asking for each control
+    printf("TEST: mixer get all with helper driver\n");
+    assert(mixer_init("helper", false));
+    float mixervalues[MIXER_CONTROL_COUNT];
+    assert(mixer_driver_helper.get_all(mixervalues));
+    assert(mixervalues[MIXER_CONTROL_IN1] == 8.f);
+    for (int i = 0; i < MIXER_CONTROL_COUNT; ++i)
+    {
+        assert(mixer_driver_helper.get((mixer_control)i, &mixervalue));
+        printf("TEST: mixer control '%s' -> %f vs %f\n",
+               mixer_control_name((mixer_control)i), (double)mixervalues[i], (double)mixervalue);
+        assert(mixervalues[i] == mixervalue);
+    }
+    mixer_cleanup();
+    printf("\n");
+
+    // tests/bin/mod-amixer writes down every request it gets
+    printf("TEST: mixer batch with helper driver\n");
+    char amixerlog[] = "/tmp/mod-amixer-test-XXXXXX";
+    const int amixerlogfd = mkstemp(amixerlog);
+    assert(amixerlogfd >= 0);
+    close(amixerlogfd);
+    setenv("MOD_AMIXER_LOG", amixerlog, 1);
+    assert(mixer_init("helper", false));
+    assert(mixer_set_batch(mixerbatch, sizeof(mixerbatch)/sizeof(mixerbatch[0])));
+    assert(file_has_line(amixerlog, "batch out 1 xvol -6.000000 , out 2 xvol -6.000000 , hp xvol 3.000000 ,"));
+    assert(! file_has_line(amixerlog, "hp xvol 3.000000"));
+    mixer_cleanup();
+    printf("\n");
+
+    // and does not try a batch again after that
+    printf("TEST: mixer batch with helper driver sets controls one by one if mod-amixer fails\n");
+    assert(truncate(amixerlog, 0) == 0);
+    setenv("MOD_AMIXER_FAIL_BATCH", "1", 1);
+    assert(mixer_init("helper", false));
+    assert(mixer_set_batch(mixerbatch, sizeof(mixerbatch)/sizeof(mixerbatch[0])));
+    assert(file_has_line(amixerlog, "out 1 xvol -6.000000"));
+    assert(file_has_line(amixerlog, "out 2 xvol -6.000000"));
+    assert(file_has_line(amixerlog, "hp xvol 3.000000"));
+    assert(mixer_set_batch(mixerbatch, sizeof(mixerbatch)/sizeof(mixerbatch[0])));
+    assert(file_count_lines(amixerlog, "batch ") == 1);
+    mixer_cleanup();
+    unsetenv("MOD_AMIXER_FAIL_BATCH");
+    printf("\n");
+
+    // the first value goes out right away, then only the newest one once the interval has passed
+    printf("TEST: sys mixer paces writes of a control\n");
+    assert(truncate(amixerlog, 0) == 0);
+    setenv("MOD_MIXER_MIN_INTERVAL_MS", "in1=300", 1);
+    sys_mixer_setup(false);
+    sys_mixer_gain(true, '1', "-1");
+    assert(wait_for_file_line(amixerlog, "in 1 xvol -1.000000", 150));
+    sys_mixer_gain(true, '1', "-2");
+    sys_mixer_gain(true, '1', "-3");
+    sys_mixer_gain(true, '1', "-4");
+    assert(! file_has_line(amixerlog, "in 1 xvol -4.000000"));
+    assert(wait_for_file_line(amixerlog, "in 1 xvol -4.000000", 300 + 100));
+    assert(! file_has_line(amixerlog, "in 1 xvol -2.000000"));
+    assert(! file_has_line(amixerlog, "in 1 xvol -3.000000"));
+    sys_mixer_destroy();
+    unsetenv("MOD_MIXER_MIN_INTERVAL_MS");
+    unsetenv("MOD_AMIXER_LOG");
+    unlink(amixerlog);
+    printf("\n");
+
+    // --------------------------------------------------------------------------------------------
+    // shared memory ring, with the test on both sides of a channel outside of shared memory
+
+    static sys_serial_shm_data ringdata;
+    sys_serial_shm_data_channel* const ring = &ringdata.client;
+    sys_serial_event_type etype;
+    char ringmsg[SYS_SERIAL_SHM_DATA_SIZE];
+    mod_doorbell_init(&ring->doorbell);
+
+    printf("TEST: shm ring write and read\n");
+    assert(! sys_serial_pending(ring));
+    assert(sys_serial_write(ring, sys_serial_event_type_compressor_mode, 0, 0, "1"));
+    assert(sys_serial_write(ring, sys_serial_event_type_noisegate_decay, 0, 0, "10"));
+    assert(sys_serial_read(ring, &etype, ringmsg));
+    assert(etype == sys_serial_event_type_compressor_mode && strcmp(ringmsg, "1") == 0);
+    assert(sys_serial_read(ring, &etype, ringmsg));
+    assert(etype == sys_serial_event_type_noisegate_decay && strcmp(ringmsg, "10") == 0);
+    assert(! sys_serial_pending(ring));
+    printf("\n");
+
+    printf("TEST: shm ring records are padded to the header size\n");
+    assert(sys_serial_record_size(1) == 2 * sizeof(sys_serial_record));
+    assert(sys_serial_record_size(sizeof(sys_serial_record)) == 2 * sizeof(sys_serial_record));
+    assert(sys_serial_record_size(sizeof(sys_serial_record) + 1) == 3 * sizeof(sys_serial_record));
+    assert(ring->producer.head == 2 * sys_serial_record_size(2));
+    assert(ring->consumer.tail == ring->producer.head);
+    printf("\n");
+
+    // last header slot of the buffer, with indexes about to overflow too
+    printf("TEST: shm ring messages wrap around the end of the buffer\n");
+    const uint32_t ringbase = UINT32_MAX - sizeof(sys_serial_record) + 1;
+    assert((ringbase & SYS_SERIAL_SHM_DATA_MASK) == SYS_SERIAL_SHM_DATA_SIZE - sizeof(sys_serial_record));
+    ring->producer.head = ring->producer.cached_tail = ringbase;
+    ring->consumer.tail = ring->consumer.cached_head = ringbase;
+    const char* const ringlongmsg = "this message does not fit before the end of the buffer";
+    assert(sys_serial_write(ring, sys_serial_event_type_pedalboard_gain, 0, 0, ringlongmsg));
+    assert(ring->producer.head == ringbase + sys_serial_record_size(strlen(ringlongmsg) + 1));
+    assert(sys_serial_read(ring, &etype, ringmsg));
+    assert(etype == sys_serial_event_type_pedalboard_gain && strcmp(ringmsg, ringlongmsg) == 0);
+    assert(! sys_serial_pending(ring));
+    printf("\n");
+
+    printf("TEST: shm ring refuses to write when full\n");
+    uint32_t ringcount = 0;
+    while (sys_serial_write(ring, sys_serial_event_type_compressor_mode, 0, 0, "1"))
+        ++ringcount;
+    assert(ringcount == SYS_SERIAL_SHM_DATA_SIZE / sys_serial_record_size(2));
+    assert(sys_serial_read(ring, &etype, ringmsg));
+    assert(sys_serial_write(ring, sys_serial_event_type_compressor_mode, 0, 0, "2"));
+    while (--ringcount > 0)
+        assert(sys_serial_read(ring, &etype, ringmsg) && strcmp(ringmsg, "1") == 0);
+    assert(sys_serial_read(ring, &etype, ringmsg) && strcmp(ringmsg, "2") == 0);
+    assert(! sys_serial_pending(ring));
+    printf("\n");
+
+    printf("TEST: shm ring drops corrupted records and recovers\n");
+    const uint32_t ringtail = ring->consumer.tail;
+    assert(sys_serial_write(ring, sys_serial_event_type_compressor_mode, 0, 0, "1"));
+    assert(sys_serial_write(ring, sys_serial_event_type_compressor_mode, 0, 0, "2"));
+    ring->buffer[(ringtail & SYS_SERIAL_SHM_DATA_MASK) + offsetof(sys_serial_record, check)] ^= 0xff;
+    assert(! sys_serial_read(ring, &etype, ringmsg));
+    assert(! sys_serial_pending(ring));
+    assert(sys_serial_write(ring, sys_serial_event_type_compressor_mode, 0, 0, "3"));
+    assert(sys_serial_read(ring, &etype, ringmsg) && strcmp(ringmsg, "3") == 0);
+    printf("\n");
+
+    // a type meant for the other direction is just as bad
+    printf("TEST: shm ring drops records of the wrong direction\n");
+    assert(sys_serial_write(ring, sys_serial_event_type_value, 0, 0, "1"));
+    assert(! sys_serial_read(ring, &etype, ringmsg));
+    assert(! sys_serial_pending(ring));
+    assert(sys_serial_write(ring, sys_serial_event_type_noisegate_channel, 0, 0, "4"));
+    assert(sys_serial_read(ring, &etype, ringmsg) && strcmp(ringmsg, "4") == 0);
+    printf("\n");
+
+    printf("TEST: shm is refused with an unknown layout version\n");
+    assert(event_loop_init());
+    sys_host_setup(serialport_sys, false);
+    int shmfd;
+    sys_serial_shm_data* shmdata;
+    assert(sys_serial_open(&shmfd, &shmdata));
+    shmdata->version = SYS_SERIAL_SHM_VERSION + 1;
+    int shmfd2;
+    sys_serial_shm_data* shmdata2;
+    assert(! sys_serial_open(&shmfd2, &shmdata2));
+    shmdata->version = SYS_SERIAL_SHM_VERSION;
+    assert(sys_serial_open(&shmfd2, &shmdata2));
+    sys_serial_close(shmfd2, shmdata2);
+    sys_serial_close(shmfd, shmdata);
+    sys_host_destroy();
+    event_loop_cleanup();
+    printf("\n");
+
+    // --------------------------------------------------------------------------------------------
+    // HMI pushes, with the test acting as mod-host on the other side of the shared memory
+
+    printf("TEST: HMI pushes are limited by the window\n");
+    assert(event_loop_init());
+    setenv("MOD_HMI_PUSH_WINDOW", "2", 1);
+    sys_host_setup(serialport_sys, false);
+    int hostshmfd;
+    sys_serial_shm_data* hostdata;
+    char pushes[3][0xff];
+    assert(sys_serial_open(&hostshmfd, &hostdata));
+    assert(hostdata->magic == SYS_SERIAL_SHM_MAGIC && hostdata->version == SYS_SERIAL_SHM_VERSION);
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 1.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 2.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_unit, 0, 0, "0 dB"));
+    run_event_loop(10);
+    assert(read_hmi_push(serialport_hmi, pushes[0]) > 0);
+    assert(strstr(pushes[0], "\"1.0\"") != NULL);
+    assert(read_hmi_push(serialport_hmi, pushes[1]) > 0);
+    assert(strstr(pushes[1], "\"2.0\"") != NULL);
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    printf("TEST: HMI push response moves the window\n");
+    sys_host_hmi_response("r 0");
+    assert(read_hmi_push(serialport_hmi, pushes[2]) > 0);
+    assert(strstr(pushes[2], "\"dB\"") != NULL);
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    printf("TEST: HMI pushes without response are sent again, late responses are ignored\n");
+    run_event_loop(150);
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    sys_host_hmi_response("r 0");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 5.0"));
+    run_event_loop(150);
+    assert(read_hmi_push(serialport_hmi, buf) > 0);
+    assert(strcmp(buf, pushes[1]) == 0);
+    assert(read_hmi_push(serialport_hmi, buf) > 0);
+    assert(strcmp(buf, pushes[2]) == 0);
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    sys_host_hmi_response("r 0");
+    assert(read_hmi_push(serialport_hmi, buf) > 0);
+    assert(strstr(buf, "\"5.0\"") != NULL);
+    sys_host_hmi_response("r 0");
+    sys_host_hmi_response("r 0");
+    run_event_loop(250);
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    printf("\n");
+
+    printf("TEST: HMI pushes without response are given up on after a few retries\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 3.0"));
+    run_event_loop(700);
+    for (int i = 0; i < 3; ++i)
+    {
+        assert(read_hmi_push(serialport_hmi, buf) > 0);
+        assert(strstr(buf, "\"3.0\"") != NULL);
+    }
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    sys_host_hmi_response("r 0");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 4.0"));
+    run_event_loop(10);
+    assert(read_hmi_push(serialport_hmi, buf) > 0);
+    assert(strstr(buf, "\"4.0\"") != NULL);
+    sys_host_hmi_response("r 0");
+    printf("\n");
+
+    // written all at once, so they are all drained before any gets handled
+    printf("TEST: HMI pushes only keep the newest message per actuator field\n");
+    char coalesced[8][0xff];
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 6.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_name, 0, 0, "0 Gain"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 7.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_popup, 0, 0, "0 hi"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 8.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_popup, 0, 0, "0 hi"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_unit, 0, 0, "0 Hz"));
+    run_event_loop(10);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 5);
+    assert(strstr(coalesced[0], "\"Gain\"") != NULL);
+    assert(strncmp(coalesced[1], "sys_pop", 7) == 0);
+    assert(strstr(coalesced[2], "\"8.0\"") != NULL);
+    assert(strcmp(coalesced[3], coalesced[1]) == 0);
+    assert(strstr(coalesced[4], "\"Hz\"") != NULL);
+    printf("\n");
+
+    printf("TEST: HMI pushes are not coalesced across page changes\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 6.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_special_req, 0, 0, "pages"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 7.0"));
+    run_event_loop(10);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"6.0\"") != NULL);
+    assert(strstr(coalesced[1], "\"7.0\"") != NULL);
+    printf("\n");
+
+    printf("TEST: HMI pushes are not coalesced across restarts\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 9.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_special_req, 0, 0, "restart"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 10.0"));
+    run_event_loop(10);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"9.0\"") != NULL);
+    assert(strstr(coalesced[1], "\"10.0\"") != NULL);
+    printf("\n");
+
+    // same value again, which only reaches the HMI because the unassign dropped it from the cache
+    printf("TEST: HMI pushes are not coalesced across unassigns\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 8.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_unassign, 0, 0, "1"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "1 8.0"));
+    run_event_loop(10);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"8.0\"") != NULL);
+    assert(strcmp(coalesced[1], coalesced[0]) == 0);
+    printf("\n");
+
+    // both pages have the same label for actuator 0, only the value differs
+    printf("TEST: HMI page changes only push fields the HMI does not show already\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_special_req, 0, 0, "pages"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_name, 0, 0, "0 Gain"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 1.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_name, 1, 0, "0 Gain"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 1, 0, "0 2.0"));
+    run_event_loop(10);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"Gain\"") != NULL);
+    assert(strstr(coalesced[1], "\"1.0\"") != NULL);
+    sys_host_set_hmi_page(1);
+    run_event_loop(500);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 1);
+    assert(strstr(coalesced[0], "\"2.0\"") != NULL);
+    sys_host_set_hmi_page(0);
+    run_event_loop(500);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 1);
+    assert(strstr(coalesced[0], "\"1.0\"") != NULL);
+    printf("\n");
+
+    // mod-ui redraws everything after a reset, none of it may be skipped
+    printf("TEST: HMI gets a full repaint after a reset\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_special_req, 0, 0, "pages"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_name, 0, 0, "0 Gain"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 1.0"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_name, 1, 0, "0 Gain"));
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 1, 0, "0 2.0"));
+    run_event_loop(10);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"Gain\"") != NULL);
+    assert(strstr(coalesced[1], "\"1.0\"") != NULL);
+    printf("\n");
+
+    // after giving up on a push the label is sent again too, not only the value that differs
+    printf("TEST: HMI gets a full repaint after a push timed out\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 0, 0, "0 3.0"));
+    run_event_loop(700);
+    for (int i = 0; i < 3; ++i)
+    {
+        assert(read_hmi_push(serialport_hmi, buf) > 0);
+        assert(strstr(buf, "\"3.0\"") != NULL);
+    }
+    ret = read_hmi_push(serialport_hmi, buf);
+    assert(ret == SP_READ_ERROR_NO_DATA);
+    sys_host_set_hmi_page(1);
+    run_event_loop(500);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"Gain\"") != NULL);
+    assert(strstr(coalesced[1], "\"2.0\"") != NULL);
+    printf("\n");
+
+    printf("TEST: HMI gets a full repaint after an error reply\n");
+    assert(sys_serial_write(&hostdata->server, sys_serial_event_type_value, 1, 0, "0 4.0"));
+    run_event_loop(10);
+    assert(read_hmi_push(serialport_hmi, buf) > 0);
+    assert(strstr(buf, "\"4.0\"") != NULL);
+    sys_host_hmi_response("r -1");
+    sys_host_set_hmi_page(0);
+    run_event_loop(500);
+    assert(read_hmi_pushes(serialport_hmi, coalesced, 8) == 2);
+    assert(strstr(coalesced[0], "\"Gain\"") != NULL);
+    assert(strstr(coalesced[1], "\"3.0\"") != NULL);
+    printf("\n");
+
+    sys_serial_close(hostshmfd, hostdata);
+    sys_host_destroy();
+    event_loop_cleanup();
+
     // --------------------------------------------------------------------------------------------
     // now test all commands and their expected output
 
@@ -412,6 +934,52 @@ int main(int argc, char* argv[])
     (void)argv;
 }
 
+static void stop_event_loop_callback(const int fd, const uint32_t events, void* const arg)
+{
+    event_loop_stop();
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
+}
+
+// run the event loop for a while, so timers and the sys_host doorbell get handled
+static void run_event_loop(const unsigned int ms)
+{
+    const int timerfd = event_timer_create(stop_event_loop_callback, NULL);
+    assert(timerfd >= 0);
+    event_timer_start(timerfd, ms);
+    assert(event_loop_run());
+    event_timer_destroy(timerfd);
+}
+
+// HMI pushes have quoted values not accounted in their size, so read them as-is up to the null byte
+static int read_hmi_push(struct sp_port* const serialport_hmi, char buf[0xff])
+{
+    for (int len = 0; len < 0xff && sp_nonblocking_read(serialport_hmi, buf + len, 1) == 1; ++len)
+    {
+        if (buf[len] == '\0')
+            return len;
+    }
+
+    return SP_READ_ERROR_NO_DATA;
+}
+
+// read all pushes, responding to each one so the window lets the rest through
+static int read_hmi_pushes(struct sp_port* const serialport_hmi, char bufs[][0xff], const int max)
+{
+    int count = 0;
+
+    for (; read_hmi_push(serialport_hmi, bufs[count]) > 0; ++count)
+    {
+        assert(count + 1 < max);
+        sys_host_hmi_response("r 0");
+    }
+
+    return count;
+}
+
 static void update_syscmd_size(char cmdbuf[0xff])
 {
     static const char hexadecimals[] = {
@@ -450,3 +1018,56 @@ static void test_hmi_command(struct sp_port* const serialport_hmi,
     assert(strcmp(buf, resp) == 0);
     printf("\n");
 }
+
+static bool file_has_line(const char* const filename, const char* const line)
+{
+    FILE* const f = fopen(filename, "r");
+    char buf[0xff];
+    bool found = false;
+
+    if (f == NULL)
+        return false;
+
+    while (! found && fgets(buf, sizeof(buf), f) != NULL)
+    {
+        buf[strcspn(buf, "\n")] = '\0';
+        found = strcmp(buf, line) == 0;
+    }
+
+    fclose(f);
+    return found;
+}
+
+static int file_count_lines(const char* const filename, const char* const prefix)
+{
+    FILE* const f = fopen(filename, "r");
+    char buf[0xff];
+    int count = 0;
+
+    if (f == NULL)
+        return 0;
+
+    while (fgets(buf, sizeof(buf), f) != NULL)
+    {
+        if (strncmp(buf, prefix, strlen(prefix)) == 0)
+            ++count;
+    }
+
+    fclose(f);
+    return count;
+}
+
+static bool wait_for_file_line(const char* const filename, const char* const line, const int timeout_ms)
+{
+    const int64_t deadline = monotonic_ms() + timeout_ms;
+
+    while (! file_has_line(filename, line))
+    {
+        if (monotonic_ms() >= deadline)
+            return false;
+
+        usleep(5 * 1000);
+    }
+
+    return true;
+}
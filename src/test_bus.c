@@ -0,0 +1,413 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+// tests for everything talking to the system bus, against stub services living in this same process
+// NOTE needs a private bus, see the test-bus-run target
+
+#include "bluetooth.h"
+#include "bus.h"
+#include "event_loop.h"
+#include "reply.h"
+#include "serial_io.h"
+#include "serial_rw.h"
+#include "unit_state.h"
+
+#include "../mod-controller-proto/mod-protocol.h"
+
+#ifndef DEBUG
+ #define DEBUG
+#endif
+#define _DEBUG
+#include <assert.h>
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SYSTEMD
+
+#define STUB_SYSTEMD_PATH "/org/freedesktop/systemd1"
+#define STUB_SYSTEMD_UNIT_PATH_PREFIX STUB_SYSTEMD_PATH "/unit"
+#define STUB_BLUEZ_ADAPTER_PATH "/org/bluez/hci0"
+#define STUB_BLUEZ_ADAPTER_ADDRESS "00:11:22:33:44:55"
+
+typedef struct stub_unit {
+    const char* name;
+    const char* state;
+} stub_unit;
+
+// services we pretend to be, on a connection of their own
+static struct {
+    sd_bus* bus;
+    int fd;
+    // number of unit state requests received
+    unsigned int gets;
+    stub_unit units[3];
+    // bluetooth adapter, only there after stub_bluez_setup
+    bool discoverable;
+} stub = {
+    .fd = -1,
+    .units = {
+        { "ssh.service", "inactive" },
+        { "jack2.service", "active" },
+        // changes state right before replying with the old one, as if both happened at the same time
+        { "racy.service", "inactive" },
+    },
+};
+
+static stub_unit* stub_unit_find(const char* const name)
+{
+    for (size_t i = 0; i < sizeof(stub.units)/sizeof(stub.units[0]); ++i)
+    {
+        if (strcmp(stub.units[i].name, name) == 0)
+            return &stub.units[i];
+    }
+
+    return NULL;
+}
+
+// send PropertiesChanged for a unit, without a state it only has properties we do not care about
+static void stub_unit_changed(const char* const name, const char* const state)
+{
+    stub_unit* const unit = stub_unit_find(name);
+    sd_bus_message* m = NULL;
+    char* path = NULL;
+
+    assert(unit != NULL);
+
+    if (state != NULL)
+        unit->state = state;
+
+    assert(sd_bus_path_encode(STUB_SYSTEMD_UNIT_PATH_PREFIX, name, &path) >= 0);
+    assert(sd_bus_message_new_signal(stub.bus, &m, path, "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+    assert(sd_bus_message_append(m, "s", "org.freedesktop.systemd1.Unit") >= 0);
+    assert(sd_bus_message_open_container(m, 'a', "{sv}") >= 0);
+    assert(sd_bus_message_append(m, "{sv}", "SubState", "s", "running") >= 0);
+    if (state != NULL)
+        assert(sd_bus_message_append(m, "{sv}", "ActiveState", "s", state) >= 0);
+    assert(sd_bus_message_close_container(m) >= 0);
+    assert(sd_bus_message_append(m, "as", 0) >= 0);
+    assert(sd_bus_send(stub.bus, m, NULL) >= 0);
+    assert(sd_bus_flush(stub.bus) >= 0);
+
+    sd_bus_message_unref(m);
+    free(path);
+}
+
+static int stub_systemd_manager(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    if (! sd_bus_message_is_method_call(m, "org.freedesktop.systemd1.Manager", "Subscribe"))
+        return 0;
+
+    return sd_bus_reply_method_return(m, "");
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int stub_systemd_unit(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* interface;
+    const char* property;
+    const char* state;
+    char* name = NULL;
+    stub_unit* unit;
+    int r = 0;
+
+    if (! sd_bus_message_is_method_call(m, "org.freedesktop.DBus.Properties", "Get") ||
+        sd_bus_path_decode(sd_bus_message_get_path(m), STUB_SYSTEMD_UNIT_PATH_PREFIX, &name) <= 0)
+        return 0;
+
+    if (sd_bus_message_read(m, "ss", &interface, &property) < 0 || strcmp(property, "ActiveState") != 0 ||
+        (unit = stub_unit_find(name)) == NULL)
+        goto out;
+
+    ++stub.gets;
+
+    state = unit->state;
+
+    if (strcmp(unit->name, "racy.service") == 0)
+        stub_unit_changed(unit->name, strcmp(state, "active") == 0 ? "inactive" : "active");
+
+    r = sd_bus_reply_method_return(m, "v", "s", state);
+
+out:
+    free(name);
+    return r;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int stub_bluez_object_manager(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    if (! sd_bus_message_is_method_call(m, "org.freedesktop.DBus.ObjectManager", "GetManagedObjects"))
+        return 0;
+
+    return sd_bus_reply_method_return(m, "a{oa{sa{sv}}}", 1,
+                                      STUB_BLUEZ_ADAPTER_PATH, 1,
+                                      "org.bluez.Adapter1", 3,
+                                      "Address", "s", STUB_BLUEZ_ADAPTER_ADDRESS,
+                                      "Powered", "b", 1,
+                                      "Discoverable", "b", stub.discoverable);
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int stub_bluez_adapter(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* interface;
+    const char* property;
+    sd_bus_message* signal = NULL;
+    int value;
+
+    if (! sd_bus_message_is_method_call(m, "org.freedesktop.DBus.Properties", "Set"))
+        return 0;
+
+    if (sd_bus_message_read(m, "ssv", &interface, &property, "b", &value) < 0)
+        return 0;
+
+    if (strcmp(property, "Discoverable") == 0)
+    {
+        stub.discoverable = value;
+
+        assert(sd_bus_message_new_signal(stub.bus, &signal, STUB_BLUEZ_ADAPTER_PATH,
+                                         "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+        assert(sd_bus_message_append(signal, "sa{sv}as", interface, 1, "Discoverable", "b", value, 0) >= 0);
+        assert(sd_bus_send(stub.bus, signal, NULL) >= 0);
+        sd_bus_message_unref(signal);
+    }
+
+    return sd_bus_reply_method_return(m, "");
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+// send InterfacesAdded for a device that is already connected
+static void stub_bluez_device_connected(const char* const alias)
+{
+    sd_bus_message* m = NULL;
+
+    assert(sd_bus_message_new_signal(stub.bus, &m, "/", "org.freedesktop.DBus.ObjectManager", "InterfacesAdded") >= 0);
+    assert(sd_bus_message_append(m, "oa{sa{sv}}",
+                                 STUB_BLUEZ_ADAPTER_PATH "/dev_66_77_88_99_AA_BB", 1,
+                                 "org.bluez.Device1", 2,
+                                 "Alias", "s", alias,
+                                 "Connected", "b", 1) >= 0);
+    assert(sd_bus_send(stub.bus, m, NULL) >= 0);
+    assert(sd_bus_flush(stub.bus) >= 0);
+
+    sd_bus_message_unref(m);
+}
+
+static void stub_fd_callback(const int fd, const uint32_t events, void* const arg)
+{
+    while (sd_bus_process(stub.bus, NULL) > 0) {}
+
+    sd_bus_flush(stub.bus);
+
+    return;
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
+}
+
+static void stub_setup(void)
+{
+    assert(sd_bus_open_system(&stub.bus) >= 0);
+    assert(sd_bus_request_name(stub.bus, "org.freedesktop.systemd1", 0) >= 0);
+    assert(sd_bus_add_object(stub.bus, NULL, STUB_SYSTEMD_PATH, stub_systemd_manager, NULL) >= 0);
+    assert(sd_bus_add_fallback(stub.bus, NULL, STUB_SYSTEMD_UNIT_PATH_PREFIX, stub_systemd_unit, NULL) >= 0);
+
+    stub.fd = sd_bus_get_fd(stub.bus);
+    assert(event_loop_add(stub.fd, EPOLLIN, stub_fd_callback, NULL));
+}
+
+// BlueZ only shows up when asked to, so we can test what happens without it
+static void stub_bluez_setup(void)
+{
+    assert(sd_bus_request_name(stub.bus, "org.bluez", 0) >= 0);
+    assert(sd_bus_add_object(stub.bus, NULL, "/", stub_bluez_object_manager, NULL) >= 0);
+    assert(sd_bus_add_object(stub.bus, NULL, STUB_BLUEZ_ADAPTER_PATH, stub_bluez_adapter, NULL) >= 0);
+}
+
+static void stub_destroy(void)
+{
+    event_loop_remove(stub.fd);
+    stub.bus = sd_bus_flush_close_unref(stub.bus);
+    stub.fd = -1;
+}
+
+static void stop_event_loop_callback(const int fd, const uint32_t events, void* const arg)
+{
+    event_loop_stop();
+
+    // unused
+    (void)fd;
+    (void)events;
+    (void)arg;
+}
+
+// run the event loop for a while, so both sides of the bus get handled
+static void run_event_loop(const unsigned int ms)
+{
+    const int timerfd = event_timer_create(stop_event_loop_callback, NULL);
+    assert(timerfd >= 0);
+    event_timer_start(timerfd, ms);
+    assert(event_loop_run());
+    event_timer_destroy(timerfd);
+}
+
+// send a command as the HMI, cached replies must be there right away, others once the stub services reply
+static void test_command(struct sp_port* const serialport_hmi,
+                         struct sp_port* const serialport_sys,
+                         const char* const cmd,
+                         const char* const resp,
+                         const bool cached)
+{
+    char cmdbuf[0xff], buf[0xff];
+    int i;
+
+    snprintf(cmdbuf, sizeof(cmdbuf), "%s", cmd);
+
+    printf("TEST: '%s' replies '%s'%s\n", cmdbuf, resp, cached ? " right away" : "");
+    assert(parse_and_reply_to_message(serialport_sys, cmdbuf, false));
+
+    for (i = 0; ! serial_read_response(serialport_hmi, buf); ++i)
+    {
+        assert(! cached && i < 100);
+        run_event_loop(10);
+    }
+
+    printf("TEST: '%s' reply -> '%s' vs '%s'\n", cmd, buf, resp);
+    assert(strcmp(buf, resp) == 0);
+}
+
+static void test_systemctl(struct sp_port* const serialport_hmi,
+                           struct sp_port* const serialport_sys,
+                           const char* const unit,
+                           const char* const state,
+                           const bool cached)
+{
+    char cmdbuf[0xff], respbuf[0xff];
+    const unsigned int gets = stub.gets;
+
+    snprintf(cmdbuf, sizeof(cmdbuf), CMD_SYS_SYSTEMCTL, (int)strlen(unit), unit);
+    snprintf(respbuf, sizeof(respbuf), CMD_RESPONSE_STR, 0, state);
+
+    test_command(serialport_hmi, serialport_sys, cmdbuf, respbuf, cached);
+    assert(stub.gets == (cached ? gets : gets + 1));
+    printf("\n");
+}
+
+int main(void)
+{
+    if (getenv("DBUS_SYSTEM_BUS_ADDRESS") == NULL)
+    {
+        fprintf(stderr, "DBUS_SYSTEM_BUS_ADDRESS is not set, refusing to touch the real system bus\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sp_port* const serialport_sys = serial_open("sys", 0);
+    struct sp_port* const serialport_hmi = serial_open("hmi", 0);
+
+    if (serialport_sys == NULL || serialport_hmi == NULL)
+        return EXIT_FAILURE;
+
+    assert(event_loop_init());
+    stub_setup();
+    assert(bus_setup(false));
+
+    // --------------------------------------------------------------------------------------------
+    // systemd unit states
+
+    printf("TEST: subscribe to systemd signals\n");
+    unit_state_setup(false);
+    run_event_loop(50);
+    printf("\n");
+
+    test_systemctl(serialport_hmi, serialport_sys, "ssh.service", "inactive", false);
+    test_systemctl(serialport_hmi, serialport_sys, "ssh.service", "inactive", true);
+    test_systemctl(serialport_hmi, serialport_sys, "jack2.service", "active", false);
+
+    printf("TEST: cached unit state follows PropertiesChanged\n");
+    stub_unit_changed("ssh.service", "active");
+    run_event_loop(50);
+    printf("\n");
+    test_systemctl(serialport_hmi, serialport_sys, "ssh.service", "active", true);
+
+    printf("TEST: cached unit state is dropped on PropertiesChanged without ActiveState\n");
+    stub_unit_changed("ssh.service", NULL);
+    run_event_loop(50);
+    printf("\n");
+    test_systemctl(serialport_hmi, serialport_sys, "ssh.service", "active", false);
+    test_systemctl(serialport_hmi, serialport_sys, "ssh.service", "active", true);
+    test_systemctl(serialport_hmi, serialport_sys, "jack2.service", "active", true);
+
+    // stub switches the unit to active before sending the reply that says inactive
+    printf("TEST: unit state is not cached when it changed while waiting for systemd\n");
+    printf("\n");
+    test_systemctl(serialport_hmi, serialport_sys, "racy.service", "inactive", false);
+    run_event_loop(50);
+    test_systemctl(serialport_hmi, serialport_sys, "racy.service", "active", false);
+
+    unit_state_destroy();
+
+    // --------------------------------------------------------------------------------------------
+    // bluetooth through BlueZ
+
+    setenv("MOD_BLUETOOTH_BACKEND", "bluez", 1);
+
+    // BlueZ showing up later must not matter, tests/bin/mod-bluetooth is in use by then
+    printf("TEST: fall back to mod-bluetooth when BlueZ is not there\n");
+    bluetooth_setup(false);
+    run_event_loop(200);
+    stub_bluez_setup();
+    run_event_loop(50);
+    test_command(serialport_hmi, serialport_sys, CMD_SYS_BT_STATUS, "r 0 Unavailable||(none)", true);
+    bluetooth_destroy();
+    printf("\n");
+
+    printf("TEST: bluetooth status follows BlueZ\n");
+    bluetooth_setup(false);
+    run_event_loop(50);
+    test_command(serialport_hmi, serialport_sys, CMD_SYS_BT_STATUS, "r 0 On||" STUB_BLUEZ_ADAPTER_ADDRESS, true);
+    test_command(serialport_hmi, serialport_sys, CMD_SYS_BT_DISCOVERY, "r 0", false);
+    assert(stub.discoverable);
+    run_event_loop(50);
+    test_command(serialport_hmi, serialport_sys, CMD_SYS_BT_STATUS, "r 0 Discoverable||" STUB_BLUEZ_ADAPTER_ADDRESS, true);
+    stub_bluez_device_connected("Phone");
+    run_event_loop(50);
+    test_command(serialport_hmi, serialport_sys, CMD_SYS_BT_STATUS, "r 0 Connected|Phone|" STUB_BLUEZ_ADAPTER_ADDRESS, true);
+    bluetooth_destroy();
+    printf("\n");
+
+    // --------------------------------------------------------------------------------------------
+
+    bus_destroy();
+    stub_destroy();
+    event_loop_cleanup();
+    serial_close(serialport_sys);
+    serial_close(serialport_hmi);
+    return EXIT_SUCCESS;
+}
+
+#else
+
+int main(void)
+{
+    printf("built without systemd support, there is nothing to test\n");
+    return EXIT_SUCCESS;
+}
+
+#endif // HAVE_SYSTEMD
@@ -0,0 +1,308 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#include "unit_state.h"
+#include "bus.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SYSTEMD
+
+#define SYSTEMD_SERVICE "org.freedesktop.systemd1"
+#define SYSTEMD_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_UNIT_PATH_PREFIX SYSTEMD_PATH "/unit"
+#define SYSTEMD_MANAGER_INTERFACE "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_UNIT_INTERFACE "org.freedesktop.systemd1.Unit"
+
+#define UNIT_STATE_CACHE_SIZE 16
+#define UNIT_NAME_MAX 256
+#define UNIT_STATE_MAX 32
+
+typedef struct unit_state_entry {
+    bool valid;
+    char unit[UNIT_NAME_MAX];
+    char state[UNIT_STATE_MAX];
+} unit_state_entry;
+
+typedef struct unit_state_request {
+    execute_callback callback;
+    void* arg;
+    // the unit changed while waiting for the reply, which might be older than that change
+    bool outdated;
+    struct unit_state_request* next;
+    char unit[UNIT_NAME_MAX];
+} unit_state_request;
+
+static unit_state_entry s_cache[UNIT_STATE_CACHE_SIZE];
+
+// requests waiting for a reply from systemd
+static unit_state_request* s_requests;
+static bool s_debug;
+
+// systemd only sends signals to subscribers, without that we cannot know when cached values become stale
+static bool s_subscribed;
+
+static unit_state_entry* unit_state_find(const char* const unit)
+{
+    for (int i = 0; i < UNIT_STATE_CACHE_SIZE; ++i)
+    {
+        if (s_cache[i].valid && strcmp(s_cache[i].unit, unit) == 0)
+            return &s_cache[i];
+    }
+
+    return NULL;
+}
+
+static void unit_state_store(const char* const unit, const char* const state)
+{
+    unit_state_entry* entry = unit_state_find(unit);
+
+    if (entry == NULL)
+    {
+        for (int i = 0; i < UNIT_STATE_CACHE_SIZE; ++i)
+        {
+            if (! s_cache[i].valid)
+            {
+                entry = &s_cache[i];
+                break;
+            }
+        }
+
+        // full, just do not cache
+        if (entry == NULL)
+            return;
+
+        snprintf(entry->unit, sizeof(entry->unit), "%s", unit);
+        entry->valid = true;
+    }
+
+    snprintf(entry->state, sizeof(entry->state), "%s", state);
+
+    if (s_debug)
+        printf("%s: unit '%s' is now '%s'\n", __func__, unit, state);
+}
+
+static int unit_state_properties_changed(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    const char* interface;
+    const char* property;
+    const char* state = NULL;
+    char* unit = NULL;
+    unit_state_entry* entry;
+    int r;
+
+    if (sd_bus_path_decode(sd_bus_message_get_path(m), SYSTEMD_UNIT_PATH_PREFIX, &unit) <= 0)
+        return 0;
+
+    for (unit_state_request* req = s_requests; req != NULL; req = req->next)
+    {
+        if (strcmp(req->unit, unit) == 0)
+            req->outdated = true;
+    }
+
+    if ((entry = unit_state_find(unit)) == NULL)
+        goto out;
+
+    if (sd_bus_message_read(m, "s", &interface) < 0 || strcmp(interface, SYSTEMD_UNIT_INTERFACE) != 0)
+        goto out;
+
+    if (sd_bus_message_enter_container(m, 'a', "{sv}") < 0)
+        goto invalidate;
+
+    while ((r = sd_bus_message_enter_container(m, 'e', "sv")) > 0)
+    {
+        if (sd_bus_message_read(m, "s", &property) < 0)
+            goto invalidate;
+
+        if (strcmp(property, "ActiveState") == 0)
+            r = sd_bus_message_read(m, "v", "s", &state);
+        else
+            r = sd_bus_message_skip(m, "v");
+
+        if (r < 0 || sd_bus_message_exit_container(m) < 0)
+            goto invalidate;
+    }
+
+    // ActiveState is sent along with changes, but if not we need to ask again
+    if (r < 0 || state == NULL)
+        goto invalidate;
+
+    unit_state_store(unit, state);
+    goto out;
+
+invalidate:
+    entry->valid = false;
+
+out:
+    free(unit);
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int unit_state_subscribe_reply(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    if (sd_bus_message_get_error(m) != NULL)
+    {
+        fprintf(stderr, "%s failed, unit states will not be cached: %s\n",
+                __func__, sd_bus_message_get_error(m)->message);
+        return 0;
+    }
+
+    s_subscribed = true;
+    return 0;
+
+    // unused
+    (void)userdata;
+    (void)error;
+}
+
+static int unit_state_get_reply(sd_bus_message* const m, void* const userdata, sd_bus_error* const error)
+{
+    unit_state_request* const req = userdata;
+    const char* state;
+
+    for (unit_state_request** it = &s_requests; *it != NULL; it = &(*it)->next)
+    {
+        if (*it == req)
+        {
+            *it = req->next;
+            break;
+        }
+    }
+
+    if (sd_bus_message_get_error(m) != NULL || sd_bus_message_read(m, "v", "s", &state) < 0)
+    {
+        if (s_debug)
+            printf("%s: cannot get state of '%s'\n", __func__, req->unit);
+
+        req->callback(false, NULL, req->arg);
+        goto out;
+    }
+
+    // an outdated state would stay cached until the next change, just do not cache it
+    if (s_subscribed && ! req->outdated)
+        unit_state_store(req->unit, state);
+
+    req->callback(true, state, req->arg);
+
+out:
+    free(req);
+    return 0;
+
+    // unused
+    (void)error;
+}
+
+void unit_state_setup(const bool debug)
+{
+    sd_bus* const bus = bus_get();
+
+    memset(s_cache, 0, sizeof(s_cache));
+    s_requests = NULL;
+    s_debug = debug;
+    s_subscribed = false;
+
+    if (bus == NULL)
+        return;
+
+    if (sd_bus_match_signal(bus, NULL, SYSTEMD_SERVICE, NULL, "org.freedesktop.DBus.Properties",
+                            "PropertiesChanged", unit_state_properties_changed, NULL) < 0 ||
+        sd_bus_call_method_async(bus, NULL, SYSTEMD_SERVICE, SYSTEMD_PATH, SYSTEMD_MANAGER_INTERFACE,
+                                 "Subscribe", unit_state_subscribe_reply, NULL, "") < 0)
+    {
+        fprintf(stderr, "%s failed, unit states will not be cached\n", __func__);
+    }
+
+    bus_update();
+}
+
+void unit_state_destroy(void)
+{
+    memset(s_cache, 0, sizeof(s_cache));
+    s_requests = NULL;
+    s_subscribed = false;
+}
+
+bool unit_state_query(const char* const unit, const unsigned int timeout_ms,
+                      const execute_callback callback, void* const arg)
+{
+    sd_bus* const bus = bus_get();
+    sd_bus_message* m = NULL;
+    unit_state_request* req;
+    char* path = NULL;
+
+    // NOTE cached values are not used after losing the connection, as they are not kept up to date anymore
+    if (bus == NULL || strlen(unit) >= UNIT_NAME_MAX)
+        return false;
+
+    const unit_state_entry* const entry = unit_state_find(unit);
+
+    if (entry != NULL)
+    {
+        callback(true, entry->state, arg);
+        return true;
+    }
+
+    if ((req = malloc(sizeof(unit_state_request))) == NULL)
+        return false;
+
+    req->callback = callback;
+    req->arg = arg;
+    req->outdated = false;
+    snprintf(req->unit, sizeof(req->unit), "%s", unit);
+
+    // unit objects are always reachable by their escaped name, no need for a GetUnit round-trip
+    if (sd_bus_path_encode(SYSTEMD_UNIT_PATH_PREFIX, unit, &path) < 0 ||
+        sd_bus_message_new_method_call(bus, &m, SYSTEMD_SERVICE, path,
+                                       "org.freedesktop.DBus.Properties", "Get") < 0 ||
+        sd_bus_message_append(m, "ss", SYSTEMD_UNIT_INTERFACE, "ActiveState") < 0 ||
+        sd_bus_call_async(bus, NULL, m, unit_state_get_reply, req, (uint64_t)timeout_ms * 1000) < 0)
+    {
+        fprintf(stderr, "%s failed, cannot query '%s'\n", __func__, unit);
+        sd_bus_message_unref(m);
+        free(path);
+        free(req);
+        return false;
+    }
+
+    req->next = s_requests;
+    s_requests = req;
+
+    sd_bus_message_unref(m);
+    free(path);
+    bus_update();
+    return true;
+}
+
+#else
+
+void unit_state_setup(const bool debug)
+{
+    // unused
+    (void)debug;
+}
+
+void unit_state_destroy(void)
+{
+}
+
+bool unit_state_query(const char* const unit, const unsigned int timeout_ms,
+                      const execute_callback callback, void* const arg)
+{
+    return false;
+
+    // unused
+    (void)unit;
+    (void)timeout_ms;
+    (void)callback;
+    (void)arg;
+}
+
+#endif // HAVE_SYSTEMD
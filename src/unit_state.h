@@ -0,0 +1,19 @@
+/*
+ * This file is part of mod-system-control.
+ */
+
+#pragma once
+
+#include "cli.h"
+
+// systemd unit states fetched over D-Bus and cached, kept up to date by PropertiesChanged signals
+// NOTE only available with systemd support and a system bus connection (see bus.h)
+void unit_state_setup(bool debug);
+void unit_state_destroy(void);
+
+// get the active state of a unit, same as "systemctl is-active <unit>"
+// callback output is the state name (e.g. "inactive"), the same as running systemctl through execute_async,
+// success is only false if the state could not be fetched
+// it can be called right away when the state is cached, otherwise once systemd replies or timeout_ms passes
+// returns false if systemd cannot be queried, callback is not called in that case
+bool unit_state_query(const char* unit, unsigned int timeout_ms, execute_callback callback, void* arg);